@@ -0,0 +1,314 @@
+/*
+ * Benchmarks for bitmap and block_store
+ *
+ * Run the whole suite with `make run_benchmarks`, which writes the results to bench_results.json
+ * (Google Benchmark's JSON format) so runs can be compared over time. Any of the usual
+ * --benchmark_* flags work on the executable itself, e.g. --benchmark_filter=bitmap_ffz.
+ */
+
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "block_store.h"
+#include "bitmap.h"
+
+// Scratch images go here, in the working directory
+#define BENCH_IMAGE "bench_image.bs"
+
+// Fixed seed, so every run measures the same bits
+static std::mt19937_64 &rng() {
+    static std::mt19937_64 generator(12345);
+    return generator;
+}
+
+// Sets roughly fill percent of the bits, spread out at random
+static void fill_random(bitmap_t *bitmap, const size_t bits, const int fill) {
+    std::bernoulli_distribution coin(fill / 100.0);
+    for (size_t i = 0; i < bits; i++) {
+        if (coin(rng())) bitmap_set(bitmap, i);
+    }
+}
+
+// Sizes in bits by fill ratios in percent
+static void bitmap_args(benchmark::internal::Benchmark *bench) {
+    bench->ArgNames({"bits", "fill"});
+    for (const int64_t bits : {1 << 10, 1 << 16, 1 << 22}) {
+        for (const int64_t fill : {0, 50, 90, 100}) {
+            bench->Args({bits, fill});
+        }
+    }
+}
+
+//
+// Bitmap
+//
+
+// A device's map fills from the front, so the first zero is where the fill ends
+static void bitmap_ffz(benchmark::State &state) {
+    const size_t bits = (size_t) state.range(0);
+    bitmap_t *bitmap  = bitmap_create(bits);
+    bitmap_set_range(bitmap, 0, bits * state.range(1) / 100);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t)(bits * state.range(1) / 100 / 8));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_ffz)->Apply(bitmap_args);
+
+static void bitmap_ffs(benchmark::State &state) {
+    const size_t bits = (size_t) state.range(0);
+    bitmap_t *bitmap  = bitmap_create(bits);
+    bitmap_set_range(bitmap, 0, bits);
+    bitmap_reset_range(bitmap, 0, bits * state.range(1) / 100);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bitmap_ffs(bitmap));
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t)(bits * state.range(1) / 100 / 8));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_ffs)->Apply(bitmap_args);
+
+static void bitmap_total_set(benchmark::State &state) {
+    const size_t bits = (size_t) state.range(0);
+    bitmap_t *bitmap  = bitmap_create(bits);
+    fill_random(bitmap, bits, (int) state.range(1));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) bitmap_get_bytes(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_total_set)->Apply(bitmap_args);
+
+static void count_bit(size_t bit, void *arg) {
+    *(size_t *) arg += bit;
+}
+
+static void bitmap_for_each(benchmark::State &state) {
+    const size_t bits = (size_t) state.range(0);
+    bitmap_t *bitmap  = bitmap_create(bits);
+    fill_random(bitmap, bits, (int) state.range(1));
+    for (auto _ : state) {
+        size_t sum = 0;
+        bitmap_for_each(bitmap, count_bit, &sum);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t) bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_for_each)->Apply(bitmap_args);
+
+static void bitmap_iter(benchmark::State &state) {
+    const size_t bits = (size_t) state.range(0);
+    bitmap_t *bitmap  = bitmap_create(bits);
+    fill_random(bitmap, bits, (int) state.range(1));
+    for (auto _ : state) {
+        size_t sum = 0;
+        bitmap_iter_t it;
+        bitmap_iter_init(&it, bitmap);
+        for (size_t bit; (bit = bitmap_next_set(&it)) != SIZE_MAX;) sum += bit;
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * (int64_t) bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(bitmap_iter)->Apply(bitmap_args);
+
+//
+// Block store
+//
+
+// A device with fill percent of its blocks in use, at random
+static block_store_t *filled_device(const size_t block_size, const size_t block_count, const int fill) {
+    block_store_t *bs = block_store_create_ex(block_size, block_count);
+    std::bernoulli_distribution coin(fill / 100.0);
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    std::vector<uint8_t> buffer(block_size, 0x5A);
+    for (size_t i = 0; i < user_blocks; i++) {
+        block_store_write(bs, i, buffer.data());
+        if (coin(rng())) block_store_request(bs, i);
+    }
+    return bs;
+}
+
+// Allocate and release a batch at a time on a device that's already mostly full.
+// Args: blocks on the device, fill percent, 1 for the hierarchical map, 1 for next fit
+static void block_store_churn(benchmark::State &state) {
+    block_store_t *bs = filled_device(64, (size_t) state.range(0), (int) state.range(1));
+    block_store_set_fbm(bs, state.range(2) ? BS_FBM_HIER : BS_FBM_FLAT);
+    block_store_set_alloc_policy(bs, state.range(3) ? BS_ALLOC_NEXT_FIT : BS_ALLOC_FIRST_FIT);
+    size_t ids[32];
+    for (auto _ : state) {
+        size_t allocated = 0;
+        for (; allocated < 32 && (ids[allocated] = block_store_allocate(bs)) != SIZE_MAX; allocated++) {
+        }
+        for (size_t i = 0; i < allocated; i++) block_store_release(bs, ids[i]);
+    }
+    state.SetItemsProcessed(state.iterations() * 32);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_store_churn)
+    ->ArgNames({"blocks", "fill", "hier", "next_fit"})
+    ->ArgsProduct({{1 << 12, 1 << 20}, {50, 95}, {0, 1}, {0, 1}});
+
+// Same thing through block_store_allocate_n/release_n
+static void block_store_churn_n(benchmark::State &state) {
+    block_store_t *bs = filled_device(64, (size_t) state.range(0), (int) state.range(1));
+    size_t ids[32];
+    for (auto _ : state) {
+        const size_t allocated = block_store_allocate_n(bs, 32, ids);
+        block_store_release_n(bs, ids, allocated);
+    }
+    state.SetItemsProcessed(state.iterations() * 32);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_store_churn_n)->ArgNames({"blocks", "fill"})->ArgsProduct({{1 << 12, 1 << 20}, {50, 95}});
+
+// Every thread allocates and releases batches on the same device in concurrent mode
+// Args: 1 to count it all with block_store_set_stats
+static block_store_t *shared_device;
+
+static void block_store_concurrent_churn(benchmark::State &state) {
+    if (state.thread_index() == 0) {
+        shared_device = block_store_create_ex(64, 1 << 20);
+        block_store_set_concurrent(shared_device, true);
+        block_store_set_stats(shared_device, state.range(0));
+    }
+    size_t ids[32];
+    for (auto _ : state) {
+        size_t allocated = 0;
+        for (; allocated < 32 && (ids[allocated] = block_store_allocate(shared_device)) != SIZE_MAX; allocated++) {
+        }
+        for (size_t i = 0; i < allocated; i++) block_store_release(shared_device, ids[i]);
+    }
+    state.SetItemsProcessed(state.iterations() * 32);
+    if (state.thread_index() == 0) {
+        block_store_destroy(shared_device);
+    }
+}
+BENCHMARK(block_store_concurrent_churn)->ArgName("stats")->Arg(0)->Arg(1)->ThreadRange(1, 16)->UseRealTime();
+
+// Read and write throughput over the whole device, a block at a time.
+// Args: block size, 1 with checksums on
+static void block_store_read(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (64 << 20) / block_size, 0);
+    block_store_set_checksums(bs, state.range(1) != 0);
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    std::vector<uint8_t> buffer(block_size);
+    size_t block = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block_store_read(bs, block, buffer.data()));
+        block = block + 1 < user_blocks ? block + 1 : 0;
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) block_size);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_store_read)->ArgNames({"block_size", "checksums"})->ArgsProduct({{256, 4096, 65536}, {0, 1}});
+
+static void block_store_write(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (64 << 20) / block_size, 0);
+    block_store_set_checksums(bs, state.range(1) != 0);
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    std::vector<uint8_t> buffer(block_size, 0xA5);
+    size_t block = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block_store_write(bs, block, buffer.data()));
+        block = block + 1 < user_blocks ? block + 1 : 0;
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) block_size);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_store_write)->ArgNames({"block_size", "checksums"})->ArgsProduct({{256, 4096, 65536}, {0, 1}});
+
+// 64 neighbouring blocks per call, into one buffer so they go as a single run
+static void block_store_readv(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (64 << 20) / block_size, 0);
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    std::vector<uint8_t> buffer(64 * block_size);
+    std::vector<size_t> ids(64);
+    std::vector<struct iovec> iov(64);
+    for (size_t i = 0; i < 64; i++) iov[i] = {buffer.data() + i * block_size, block_size};
+    size_t block = 0;
+    for (auto _ : state) {
+        for (size_t i = 0; i < 64; i++) ids[i] = block + i;
+        benchmark::DoNotOptimize(block_store_readv(bs, ids.data(), 64, iov.data()));
+        block = block + 128 < user_blocks ? block + 64 : 0;
+    }
+    state.SetBytesProcessed(state.iterations() * 64 * (int64_t) block_size);
+    block_store_destroy(bs);
+}
+BENCHMARK(block_store_readv)->ArgName("block_size")->Arg(256)->Arg(4096);
+
+// Whole images to and from a file. Args: block size, device size in MiB
+static void device_args(benchmark::internal::Benchmark *bench) {
+    bench->ArgNames({"block_size", "MiB"})->ArgsProduct({{256, 4096}, {1, 64}})->Unit(benchmark::kMillisecond);
+}
+
+static void block_store_serialize(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (state.range(1) << 20) / block_size, 50);
+    size_t written          = 0;
+    for (auto _ : state) {
+        written = block_store_serialize(bs, BENCH_IMAGE);
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) written);
+    block_store_destroy(bs);
+    unlink(BENCH_IMAGE);
+}
+BENCHMARK(block_store_serialize)->Apply(device_args);
+
+static void block_store_deserialize(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (state.range(1) << 20) / block_size, 50);
+    const size_t written    = block_store_serialize(bs, BENCH_IMAGE);
+    block_store_destroy(bs);
+    for (auto _ : state) {
+        block_store_destroy(block_store_deserialize(BENCH_IMAGE));
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) written);
+    unlink(BENCH_IMAGE);
+}
+BENCHMARK(block_store_deserialize)->Apply(device_args);
+
+static void block_store_serialize_compressed(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (state.range(1) << 20) / block_size, 50);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(block_store_serialize_compressed(bs, BENCH_IMAGE));
+    }
+    // Measured against the device, not the (much smaller) file
+    state.SetBytesProcessed(state.iterations() * (state.range(1) << 20));
+    block_store_destroy(bs);
+    unlink(BENCH_IMAGE);
+    unlink(BENCH_IMAGE ".crc");
+}
+BENCHMARK(block_store_serialize_compressed)->Apply(device_args);
+
+static void block_store_deserialize_compressed(benchmark::State &state) {
+    const size_t block_size = (size_t) state.range(0);
+    block_store_t *bs       = filled_device(block_size, (state.range(1) << 20) / block_size, 50);
+    block_store_serialize_compressed(bs, BENCH_IMAGE);
+    block_store_destroy(bs);
+    for (auto _ : state) {
+        block_store_destroy(block_store_deserialize(BENCH_IMAGE));
+    }
+    state.SetBytesProcessed(state.iterations() * (state.range(1) << 20));
+    unlink(BENCH_IMAGE);
+}
+BENCHMARK(block_store_deserialize_compressed)->Apply(device_args);
+
+// BENCHMARK_MAIN, plus the build type of the libraries in the results' context
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::AddCustomContext("build_type", *BENCH_BUILD_TYPE ? BENCH_BUILD_TYPE : "none");
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -46,12 +46,100 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Sets every bit in [start, start + length)
+///  Full words in the middle are written in bulk (one atomic per word in concurrent mode).
+///  Ranges that don't fit in the bitmap are ignored.
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param length The number of bits to set
+/// \return The number of bits that were clear before the call, 0 on error
+///
+size_t bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t length);
+
+///
+/// Clears every bit in [start, start + length), the same way as bitmap_set_range
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param length The number of bits to clear
+/// \return The number of bits that were set before the call, 0 on error
+///
+size_t bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t length);
+
+///
+/// Counts the set bits in [start, start + length)
+/// \param bitmap The bitmap
+/// \param start The first bit to count
+/// \param length The number of bits to look at
+/// \return The number of them that are set, 0 on error
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t length);
+
+///
+/// Checks every bit in [start, start + length) is set
+/// \param bitmap The bitmap
+/// \param start The first bit to check
+/// \param length The number of bits to check
+/// \return Whether they're all set (true for an empty range), false on error
+///
+bool bitmap_all_set_range(const bitmap_t *const bitmap, const size_t start, const size_t length);
+
+///
+/// Sets requested bit in bitmap, reporting what it was before
+///  (a single atomic step in concurrent mode)
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return State of requested bit before the call
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Clears requested bit in bitmap, reporting what it was before
+///  (a single atomic step in concurrent mode)
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return State of requested bit before the call
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Switches concurrent mode on or off
+///  In concurrent mode set, reset, flip, test, test_and_set/reset, ffs, ffz, total_set
+///  and the claim functions are atomic, so threads can share the bitmap without a lock.
+///  Everything else (invert, format, for_each, import/export...) still needs the caller
+///  to keep the writers out. Switch before sharing the bitmap, not while it's in use.
+/// \param bitmap The bitmap
+/// \param enable Concurrent mode on or off
+/// \return boolean indicating success, the data must be 8-byte aligned to turn it on
+///
+bool bitmap_set_concurrent(bitmap_t *const bitmap, const bool enable);
+
 ///
 /// Flips all bits in the bitmap
 /// \param bitmap The bitmap to invert
 ///
 void bitmap_invert(bitmap_t *const bitmap);
 
+///
+/// Bulk operations, dst = dst op src word by word
+///  Both bitmaps must have the same bit count, and neither can be changed by another thread meanwhile
+///  (src may be dst)
+/// \param dst The bitmap to combine into
+/// \param src The bitmap to combine with
+/// \return boolean indicating success, false if either is NULL or the sizes differ
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src);
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src);
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Clears every bit in dst that's set in src, dst = dst & ~src
+/// \param dst The bitmap to clear bits in
+/// \param src The bits to clear
+/// \return boolean indicating success, false if either is NULL or the sizes differ
+///
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src);
+
 ///
 /// Find first set
 /// \param bitmap The bitmap
@@ -66,6 +154,57 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first zero, and set it
+///  In concurrent mode two callers never get the same bit
+/// \param bitmap The bitmap
+/// \return The claimed bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_claim_zero(bitmap_t *const bitmap);
+
+///
+/// Find first zero at or after start, wrapping around to the beginning
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from (anything past the end starts at 0)
+/// \return The first zero bit address from start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first zero at or after start (wrapping around to the beginning), and set it
+///  In concurrent mode two callers never get the same bit
+/// \param bitmap The bitmap
+/// \param start The bit to start searching from (anything past the end starts at 0)
+/// \return The claimed bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_claim_zero_from(bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find first run of consecutive zeros
+/// \param bitmap The bitmap
+/// \param length The length of the run wanted
+/// \return The address of the first bit of the first long enough run, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t length);
+
+///
+/// Find first zeros, and set them
+///  Makes a single pass over the bitmap, claiming zeros in order until it has enough
+/// \param bitmap The bitmap
+/// \param count The number of zeros wanted
+/// \param bits Array of at least count entries, receives the claimed bit addresses in ascending order
+/// \return The number of bits claimed, less than count if the bitmap filled up
+///
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t count, size_t *const bits);
+
+///
+/// Words the calling thread's zero searches have looked at so far
+///  (ffz, ffz_from, find_zero_run, the claim functions and hier_ffz). It only ever goes up,
+///  so take the difference around a call to see what that call cost
+/// \return The running total for this thread
+///
+size_t bitmap_scanned_words(void);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -81,6 +220,35 @@ size_t bitmap_total_set(const bitmap_t *const bitmap);
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+///
+/// Iterator over the set bits, for callers that want the loop body inline instead of a callback
+///  Each word is read once, when the iterator reaches it. What's inside is private, it's only
+///  here so the iterator can live on the stack.
+///
+///  bitmap_iter_t it;
+///  bitmap_iter_init(&it, bitmap);
+///  for (size_t bit; (bit = bitmap_next_set(&it)) != SIZE_MAX;) { ... }
+///
+typedef struct {
+    const bitmap_t *bitmap;
+    size_t word;    // Word we're in
+    uint64_t bits;  // Its set bits that haven't been returned yet
+} bitmap_iter_t;
+
+///
+/// Starts an iteration at the beginning of the bitmap
+/// \param it The iterator to set up
+/// \param bitmap The bitmap to iterate over (NULL is an empty iteration)
+///
+void bitmap_iter_init(bitmap_iter_t *const it, const bitmap_t *const bitmap);
+
+///
+/// Gets the next set bit, in ascending order
+/// \param it The iterator
+/// \return The next set bit address, SIZE_MAX when there are no more
+///
+size_t bitmap_next_set(bitmap_iter_t *const it);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -99,6 +267,7 @@ size_t bitmap_get_bits(const bitmap_t *const bitmap);
 
 ///
 /// Gets total number of bytes in bitmap
+///  (our own storage is padded to whole 64-bit words, but only these bytes are part of the bitmap)
 /// \param bitmap The bitmap
 /// \return number of bytes used by bitmap storage array
 ///
@@ -133,6 +302,9 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  Only (n_bits + 7) / 8 bytes are touched, so no padding is needed. Bit n is bit (n % 8) of byte n / 8.
+///  The whole 8-byte words at the front are accessed as words, any bytes after them one at a time.
+///  Keep the data 8-byte aligned for the word accesses to be aligned (concurrent mode requires it).
 /// \param n_bits The number of bits in the bitmap
 /// \param bitmap_data The data to import
 /// \return New bitmap pointer, NULL on error
@@ -141,10 +313,142 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
 ///
 /// Destructs and destroys bitmap object
+///  (for one from bitmap_create_inline or an arena that's nothing, the memory is still the owner's)
 /// \param bitmap The bitmap
 ///
 void bitmap_destroy(bitmap_t *bitmap);
 
+///
+/// Bytes a bitmap of n bits takes with its data inline: the header, then the data padded to whole words
+///  bitmap_create and bitmap_import are a single allocation of this size
+/// \param n_bits The number of bits in the bitmap
+/// \return The size, SIZE_MAX if it's too big to ever allocate
+///
+size_t bitmap_footprint(const size_t n_bits);
+
+///
+/// Creates a bitmap (zero initialized) in the given memory, its data right after the header
+///  For embedding a bitmap in something else's allocation. bitmap_destroy leaves the memory alone,
+///  it's free to reuse once the bitmap isn't
+/// \param memory At least bitmap_footprint(n_bits) bytes, 8-byte aligned
+/// \param n_bits The number of bits in the bitmap
+/// \return New bitmap pointer (memory), NULL on error
+///
+bitmap_t *bitmap_create_inline(void *const memory, const size_t n_bits);
+
+///
+/// An arena to create short-lived bitmaps in, instead of allocating each one
+///  Bitmaps come off the front of a chunk of memory and only go back all at once, on reset.
+///  One thread at a time
+///
+typedef struct bitmap_arena bitmap_arena_t;
+
+///
+/// Creates an arena
+/// \param bytes Size of its chunks, bitmap_footprint of whatever it's for (a bitmap that doesn't fit
+///  in what's left gets a new chunk)
+/// \return New arena pointer, NULL on error
+///
+bitmap_arena_t *bitmap_arena_create(const size_t bytes);
+
+///
+/// Creates a bitmap to contain n bits (zero initialized) in the arena
+///  bitmap_destroy on it does nothing, it lasts until the arena is reset or destroyed
+/// \param arena The arena
+/// \param n_bits The number of bits in the bitmap
+/// \return New bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create_in(bitmap_arena_t *const arena, const size_t n_bits);
+
+///
+/// Gives back every bitmap created in the arena at once, they can't be used after this
+///  The first chunk stays, so filling it again doesn't allocate
+/// \param arena The arena
+///
+void bitmap_arena_reset(bitmap_arena_t *const arena);
+
+///
+/// Destroys the arena and every bitmap in it
+/// \param arena The arena
+///
+void bitmap_arena_destroy(bitmap_arena_t *arena);
+
+//
+// Hierarchical bitmap
+//
+// A bitmap with a summary tree on top of it. Each summary bit says
+//  "the 64-bit word below me has a zero in it", so ffz is a walk from the top
+//  word down instead of a scan, touching one word per level.
+// Every write has to go through the bitmap_hier_* calls to keep the summary in sync.
+//
+
+typedef struct bitmap_hier bitmap_hier_t;
+
+///
+/// Creates a hierarchical bitmap to contain n bits (zero initialized)
+/// \param n_bits
+/// \return New hierarchical bitmap pointer, NULL on error
+///
+bitmap_hier_t *bitmap_hier_create(const size_t n_bits);
+
+///
+/// Builds a summary on top of an existing bitmap
+/// Note: This uses the given bitmap and does not destroy it on destruction
+///  Any change made to the bitmap directly requires a bitmap_hier_sync
+/// \param bitmap The bitmap to summarize
+/// \return New hierarchical bitmap pointer, NULL on error
+///
+bitmap_hier_t *bitmap_hier_wrap(bitmap_t *const bitmap);
+
+///
+/// Rebuilds the summary from the underlying bitmap
+/// \param hier The hierarchical bitmap
+///
+void bitmap_hier_sync(bitmap_hier_t *const hier);
+
+///
+/// Sets requested bit in the hierarchical bitmap
+/// \param hier The hierarchical bitmap
+/// \param bit The bit to set
+///
+void bitmap_hier_set(bitmap_hier_t *const hier, const size_t bit);
+
+///
+/// Clears requested bit in the hierarchical bitmap
+/// \param hier The hierarchical bitmap
+/// \param bit The bit to clear
+///
+void bitmap_hier_reset(bitmap_hier_t *const hier, const size_t bit);
+
+///
+/// Returns bit in the hierarchical bitmap
+/// \param hier The hierarchical bitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+bool bitmap_hier_test(const bitmap_hier_t *const hier, const size_t bit);
+
+///
+/// Find first zero, using the summary
+/// \param hier The hierarchical bitmap
+/// \return The first zero bit address, SIZE_MAX on error/not found
+///
+size_t bitmap_hier_ffz(const bitmap_hier_t *const hier);
+
+///
+/// Gets the underlying bitmap, for the read-only operations (export, total_set, ...)
+/// \param hier The hierarchical bitmap
+/// \return The underlying bitmap
+///
+const bitmap_t *bitmap_hier_get_bitmap(const bitmap_hier_t *const hier);
+
+///
+/// Destructs and destroys the hierarchical bitmap
+///  (and the underlying bitmap, unless it was wrapped)
+/// \param hier The hierarchical bitmap
+///
+void bitmap_hier_destroy(bitmap_hier_t *hier);
+
 
 #ifdef __cplusplus
 }
@@ -7,6 +7,8 @@ extern "C" {
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 // Declaring the struct but not implementing in the header allows us to prevent users
 //  from using the object directly and monkeying with the contents
@@ -20,6 +22,16 @@ typedef struct block_store block_store_t;
 ///
 block_store_t *block_store_create();
 
+///
+/// This creates a new BS device with the given geometry
+///  The free block map is stored in the last block(s) of the device,
+///  the rest are user-addressable (see block_store_get_total_blocks_ex)
+/// \param block_size Size of each block in bytes, must be a power of two
+/// \param block_count Total number of blocks, including the ones holding the free block map
+/// \return Pointer to a new block storage device, NULL on error
+///
+block_store_t *block_store_create_ex(const size_t block_size, const size_t block_count);
+
 ///
 /// Destroys the provided block storage device
 /// This is an idempotent operation, so there is no return value
@@ -34,6 +46,24 @@ void block_store_destroy(block_store_t *const bs);
 ///
 size_t block_store_allocate(block_store_t *const bs);
 
+///
+/// Searches for up to count free blocks in a single pass, marks them as in use, and returns their ids
+/// \param bs BS device
+/// \param count Number of blocks wanted
+/// \param block_ids Array of at least count entries, receives the allocated ids in ascending order
+/// \return Number of blocks allocated (less than count if the device filled up), 0 on error
+///
+size_t block_store_allocate_n(block_store_t *const bs, const size_t count, size_t *const block_ids);
+
+///
+/// Searches for a run of contiguous free blocks, marks them all as in use
+///  and returns the id of the first one (the rest follow it in order)
+/// \param bs BS device
+/// \param block_count Number of blocks in the run
+/// \return First block id of the run, SIZE_MAX on error/no run long enough
+///
+size_t block_store_allocate_extent(block_store_t *const bs, const size_t block_count);
+
 ///
 /// Attempts to allocate the requested block id
 /// \param bs the block store object
@@ -43,21 +73,37 @@ size_t block_store_allocate(block_store_t *const bs);
 bool block_store_request(block_store_t *const bs, const size_t block_id);
 
 ///
-/// Frees the specified block
+/// Frees the specified block, ids outside the user blocks are ignored
 /// \param bs BS device
 /// \param block_id The block to free
 ///
 void block_store_release(block_store_t *const bs, const size_t block_id);
 
 ///
-/// Counts the number of blocks marked as in use
+/// Frees all the specified blocks
+/// \param bs BS device
+/// \param block_ids The blocks to free (ids outside the device are ignored)
+/// \param count Number of entries in block_ids
+///
+void block_store_release_n(block_store_t *const bs, const size_t *const block_ids, const size_t count);
+
+///
+/// Frees a run of contiguous blocks
+/// \param bs BS device
+/// \param start First block of the run
+/// \param block_count Number of blocks in the run (nothing is freed if it goes past the user blocks)
+///
+void block_store_release_extent(block_store_t *const bs, const size_t start, const size_t block_count);
+
+///
+/// Counts the number of blocks marked as in use (a running count, no scan)
 /// \param bs BS device
 /// \return Total blocks in use, SIZE_MAX on error
 ///
 size_t block_store_get_used_blocks(const block_store_t *const bs);
 
 ///
-/// Counts the number of blocks marked free for use
+/// Counts the number of blocks marked free for use (a running count, no scan)
 /// \param bs BS device
 /// \return Total blocks free, SIZE_MAX on error
 ///
@@ -65,11 +111,25 @@ size_t block_store_get_free_blocks(const block_store_t *const bs);
 
 ///
 /// Returns the total number of user-addressable blocks
-///  (since this is constant, you don't even need the bs object)
+///  of a default device (since this is constant, you don't even need the bs object)
 /// \return Total blocks
 ///
 size_t block_store_get_total_blocks();
 
+///
+/// Returns the total number of user-addressable blocks of the given device
+/// \param bs BS device
+/// \return Total blocks, SIZE_MAX on error
+///
+size_t block_store_get_total_blocks_ex(const block_store_t *const bs);
+
+///
+/// Returns the size of each block of the given device
+/// \param bs BS device
+/// \return Block size in bytes, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs);
+
 ///
 /// Reads data from the specified block and writes it to the designated buffer
 /// \param bs BS device
@@ -88,8 +148,206 @@ size_t block_store_read(const block_store_t *const bs, const size_t block_id, vo
 ///
 size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer);
 
+///
+/// Reads part of the specified block and writes it to the designated buffer
+/// \param bs BS device
+/// \param block_id Source block id
+/// \param offset Byte offset into the block to start at
+/// \param length Number of bytes to read, offset + length can't go past the end of the block
+/// \param buffer Data buffer to write to
+/// \return Number of bytes read, 0 on error
+///
+size_t block_store_pread(const block_store_t *const bs, const size_t block_id, const size_t offset,
+                         const size_t length, void *buffer);
+
+///
+/// Reads data from the specified buffer and writes it to part of the designated block
+/// \param bs BS device
+/// \param block_id Destination block id
+/// \param offset Byte offset into the block to start at
+/// \param length Number of bytes to write, offset + length can't go past the end of the block
+/// \param buffer Data buffer to read from
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_pwrite(block_store_t *const bs, const size_t block_id, const size_t offset,
+                          const size_t length, const void *buffer);
+
+///
+/// Reads several blocks in one call, block ids[i] into iov[i]
+///  Runs of consecutive ids going to back-to-back buffers are copied in one go
+/// \param bs BS device
+/// \param ids The blocks to read
+/// \param n Number of blocks
+/// \param iov One buffer per block, each at least a block long
+/// \return Number of bytes read, 0 on error (nothing is read unless every id and buffer is good)
+///
+size_t block_store_readv(const block_store_t *const bs, const size_t *const ids, const size_t n,
+                         const struct iovec *const iov);
+
+///
+/// Writes several blocks in one call, iov[i] to block ids[i], in order
+///  Runs of consecutive ids coming from back-to-back buffers are copied in one go
+/// \param bs BS device
+/// \param ids The blocks to write
+/// \param n Number of blocks
+/// \param iov One buffer per block, each at least a block long
+/// \return Number of bytes written, 0 on error (nothing is written unless every id and buffer is good)
+///
+size_t block_store_writev(block_store_t *const bs, const size_t *const ids, const size_t n,
+                          const struct iovec *const iov);
+
+///
+/// Gets a read-only pointer straight to the block's data, no copying
+///  The pointer stays valid until it's given back with block_store_unpin
+/// \param bs BS device
+/// \param block_id Block id
+/// \return Pointer to block_size bytes of block data, NULL on error or for a cached device
+///
+const void *block_store_view(block_store_t *const bs, const size_t block_id);
+
+///
+/// Gets a writable pointer straight to the block's data, no copying
+///  The pointer stays valid until it's given back with block_store_unpin
+/// \param bs BS device
+/// \param block_id Block id
+/// \return Pointer to block_size bytes of block data, NULL on error or for a cached device
+///
+void *block_store_mut(block_store_t *const bs, const size_t block_id);
+
+///
+/// Gives back a pointer from block_store_view or block_store_mut
+///  Every view/mut needs exactly one unpin
+/// \param bs BS device
+/// \param block_id Block id the pointer was for
+///
+void block_store_unpin(block_store_t *const bs, const size_t block_id);
+
+///
+/// Free block map implementations
+///  BS_FBM_FLAT scans the map for every allocation (the default)
+///  BS_FBM_HIER keeps a summary on top of the map, allocation stays O(log n) on large stores
+///
+typedef enum { BS_FBM_FLAT = 0, BS_FBM_HIER = 1 } block_store_fbm_t;
+
+///
+/// Selects the free block map implementation, can be switched at any time
+///  (BS_FBM_HIER isn't available in concurrent mode, see block_store_set_concurrent)
+/// \param bs BS device
+/// \param fbm The implementation to use
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_fbm(block_store_t *const bs, const block_store_fbm_t fbm);
+
+///
+/// Allocation policies for block_store_allocate
+///  BS_ALLOC_FIRST_FIT hands out the lowest free block id (the default)
+///  BS_ALLOC_NEXT_FIT resumes searching after the last block it handed out, wrapping around at the end,
+///  so it doesn't rescan a full prefix of the device on every call
+///
+typedef enum { BS_ALLOC_FIRST_FIT = 0, BS_ALLOC_NEXT_FIT = 1 } block_store_alloc_policy_t;
+
+///
+/// Selects how block_store_allocate picks a free block, can be switched at any time
+///  (concurrent mode always uses its per-thread regions instead, see block_store_set_concurrent)
+/// \param bs BS device
+/// \param policy The policy to use
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_alloc_policy(block_store_t *const bs, const block_store_alloc_policy_t policy);
+
+///
+/// Switches the device in or out of concurrent mode
+///  In concurrent mode the free block map is updated with atomics, so allocate, allocate_n,
+///  allocate_extent, request, release (and the _n/_extent variants), the block counts, read, write and
+///  the view/mut/unpin calls can all be used from several threads at once without a lock.
+///  Two threads never get the same block. Access to the data of a single block is still up to the caller.
+///  block_store_allocate shards the device: each thread starts in its own region of the free block map
+///  (so ids don't come out lowest-first anymore), moves on to the others only when its own is full,
+///  and blocks freed in a region are the first to be handed out there again.
+///  Switch before sharing the device, not while it's in use. Can't be combined with BS_FBM_HIER.
+/// \param bs BS device
+/// \param enable Concurrent mode on or off
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_concurrent(block_store_t *const bs, const bool enable);
+
+///
+/// Turns per-block checksums on or off
+///  With checksums on, the device keeps a CRC32C of every user block. Writes update it, and reads
+///  (read, pread, readv, view/mut, async reads) check it first and fail if the block doesn't match.
+///  Whatever is in the blocks when they're turned on is taken to be good. The checksum is hardware
+///  accelerated where the CPU has CRC32C instructions (SSE4.2, ARMv8 CRC).
+///  block_store_serialize (and journal checkpoints, and block_store_sync) write them to <filename>.crc,
+///  and deserialize/open_mmap/open_lazy turn them back on when that file is there and matches the device.
+///  block_store_serialize_incremental doesn't update the file. Not available on a cached device,
+///  and opening one removes the file, since its writes would make the checksums wrong
+/// \param bs BS device
+/// \param enable Checksums on or off
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_checksums(block_store_t *const bs, const bool enable);
+
+///
+/// Gets the checksum kept for a block
+/// \param bs BS device
+/// \param block_id Block id
+/// \param checksum Receives the CRC32C of the block's data as of its last write
+/// \return boolean indicating succes of operation, false if checksums are off
+///
+bool block_store_get_checksum(const block_store_t *const bs, const size_t block_id, uint32_t *const checksum);
+
+///
+/// Checks every block against its checksum, for a periodic scrub
+///  It reads every block, so it's a reader like any other as far as concurrent writes go
+/// \param bs BS device
+/// \param bad_ids Receives the ids of the first max_ids blocks that don't match, can be NULL
+/// \param max_ids Number of entries in bad_ids
+/// \return Number of blocks that don't match (all of them, even past max_ids), 0 if checksums are off
+///
+size_t block_store_scrub(const block_store_t *const bs, size_t *const bad_ids, const size_t max_ids);
+
+///
+/// Size of a device's cold tier
+///  blocks is the number of blocks that are only held compressed, bytes what their compressed data takes up
+///
+typedef struct {
+    size_t blocks;
+    size_t bytes;
+} block_store_cold_stats_t;
+
+///
+/// Turns the cold tier on or off
+///  With the cold tier on, block_store_compact_cold compresses the blocks that haven't been used
+///  since it last ran, and hands the memory of every page that only holds cold blocks back to the system.
+///  A cold block is decompressed the next time anything uses it. Every block access takes the tier's lock.
+///  Turning it off decompresses everything. Not for mapped or cached devices
+/// \param bs BS device
+/// \param enable Cold tier on or off
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_cold_tier(block_store_t *const bs, const bool enable);
+
+///
+/// Compresses every block that hasn't been used (read, written, viewed...) since the last call
+///  (or since the cold tier was turned on), and starts the next round. Blocks that don't compress
+///  to three quarters of their size or less stay as they are. Call it every so often, from one thread,
+///  while nothing else is using the device. Does nothing while block_store_view/mut pointers are out
+/// \param bs BS device
+/// \return Number of blocks compressed by this call
+///
+size_t block_store_compact_cold(block_store_t *const bs);
+
+///
+/// Gets the size of the cold tier
+/// \param bs BS device
+/// \param stats Receives the sizes
+/// \return boolean indicating succes of operation, false if the cold tier is off
+///
+bool block_store_get_cold_stats(block_store_t *const bs, block_store_cold_stats_t *const stats);
+
 ///
 /// Imports BS device from the given file - for grads/bonus
+///  (any geometry, the image header describes the device)
 /// \param filename The file to load
 /// \return Pointer to new BS device, NULL on error
 ///
@@ -97,12 +355,314 @@ block_store_t *block_store_deserialize(const char *const filename);
 
 ///
 /// Writes the entirety of the BS device to file, overwriting it if it exists - for grads/bonus
+///  The image is a versioned header, the free block map, and then every user block
 /// \param bs BS device
 /// \param filename The file to write to
-/// \return Number of bytes written, 0 on error
+/// \return Number of bytes written (header and padding included), 0 on error
 ///
 size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+///
+/// Writes the entirety of the BS device to file like block_store_serialize, with every block compressed
+///  Each block is compressed on its own (zlib) and an index of where each one starts follows the
+///  free block map, so block_store_open_lazy can still load single blocks. block_store_deserialize
+///  and block_store_open_lazy read either kind of image, mmap and cached devices need a plain one.
+///  Blocks that don't compress are stored as they are
+/// \param bs BS device
+/// \param filename The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename);
+
+///
+/// Writes only what changed since the last call to an image that's already on disk
+///  Every block written (or handed out by block_store_mut) since the device was created or loaded,
+///  or since the last call, is written at its offset in the image with pwrite, followed by the
+///  free block map. Runs of neighbouring blocks go out in one pwrite. If fd isn't an image of
+///  this device yet (say, an empty file) the whole image is written instead.
+///  Nothing is fsynced, that's up to the caller
+/// \param bs BS device
+/// \param fd A file descriptor open for reading and writing
+/// \return Number of bytes written, 0 on error
+///
+size_t block_store_serialize_incremental(block_store_t *const bs, const int fd);
+
+///
+/// Opens a file written by block_store_serialize in place, without reading it in
+///  The image is memory mapped, reads and writes go straight to the mapped pages
+///  and reach the file when the kernel gets to them (or on block_store_sync)
+///  Destroying the device unmaps it
+/// \param filename The file to open
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_open_mmap(const char *const filename);
+
+///
+/// Loads a file written by block_store_serialize like block_store_deserialize, but without reading the blocks
+///  Only the header and free block map are read (and the journal replayed, if there is one),
+///  so it's ready in about the same time whatever the size of the image. Each block is read in
+///  the first time anything needs it, except a block that's being overwritten whole.
+///  Anything needing the whole device at once (serializing, a journal checkpoint) reads in the rest first.
+///  The image has to stay put until everything is loaded or the device is destroyed
+/// \param filename The file to load
+/// \param prefetch Start a thread that reads in the blocks in use at open in block order,
+///  then everything else, so they're loaded before they're asked for
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_open_lazy(const char *const filename, const bool prefetch);
+
+///
+/// Counters of a device opened with block_store_open_cached
+///  hits and misses count block lookups, evictions the frames given up for another block,
+///  and writebacks the dirty frames written to the file (on eviction or block_store_sync)
+///
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t writebacks;
+} block_store_cache_stats_t;
+
+///
+/// Opens a file written by block_store_serialize with at most cache_blocks of its blocks in memory
+///  For images bigger than RAM. Only the free block map is read in, blocks are loaded into a fixed pool
+///  of frames on first use and stay there until CLOCK eviction needs the frame for another block.
+///  Writes stay in their frame until it's evicted or the device is synced (or destroyed).
+///  read/write, pread/pwrite and readv/writev go through the cache. view/mut, serialize, journaling and
+///  the async calls aren't available, since they'd need the blocks in memory or would go around the cache.
+///  A journal next to the image isn't replayed, use block_store_deserialize for that
+/// \param filename The file to open
+/// \param cache_blocks Number of frames in the cache
+/// \return Pointer to new BS device, NULL on error
+///
+block_store_t *block_store_open_cached(const char *const filename, const size_t cache_blocks);
+
+///
+/// Gets the cache counters of a device opened with block_store_open_cached
+/// \param bs BS device
+/// \param stats Receives the counters
+/// \return boolean indicating succes of operation, false for devices that aren't cached
+///
+bool block_store_get_cache_stats(block_store_t *const bs, block_store_cache_stats_t *const stats);
+
+///
+/// Flushes everything written to a device opened by block_store_open_mmap or block_store_open_cached
+///  to its file (a cached device writes back its dirty frames and the free block map, then fdatasyncs)
+/// \param bs BS device
+/// \return boolean indicating succes of operation, false for heap devices
+///
+bool block_store_sync(block_store_t *const bs);
+
+///
+/// Starts a write-ahead journal for the device, so changes are durable without rewriting the image
+///  The device is written to filename first, then every change to it (allocations, releases and
+///  block_store_write/pwrite) is recorded in filename.journal, in order, with a checksum.
+///  block_store_deserialize(filename) replays the journal on top of the image.
+///  Changes only become durable on block_store_journal_commit. Writes made through block_store_mut
+///  aren't journaled. While journaled, changes to the device take the journal's lock, one at a time.
+///  A checkpoint moves the journal to filename.journal.old while it writes the image, and starts a new one
+/// \param bs BS device (not a mapped one)
+/// \param filename The image to checkpoint to
+/// \param checkpoint_bytes Journal size at which a background thread checkpoints, 0 to only checkpoint
+///  on block_store_journal_checkpoint. The device can be used as usual while it does
+/// \return boolean indicating succes of operation
+///
+bool block_store_journal_open(block_store_t *const bs, const char *const filename, const size_t checkpoint_bytes);
+
+///
+/// Makes every change journaled so far durable
+///  Commits from several threads are grouped: one writes and fsyncs all their changes
+///  at once while the others wait for it
+/// \param bs BS device
+/// \return boolean indicating succes of operation, false once a journal write has failed
+///
+bool block_store_journal_commit(block_store_t *const bs);
+
+///
+/// Writes the whole device to its image (atomically, with a rename) and empties the journal
+///  Changes and commits go on meanwhile: the journal's lock is only held to copy the free block map,
+///  and then the blocks a chunk at a time, and commits only wait while the journal is moved to a new file.
+///  Changes made during the checkpoint stay in the new journal. After a checkpoint that didn't finish,
+///  the next one holds the lock the whole time
+/// \param bs BS device
+/// \return boolean indicating succes of operation
+///
+bool block_store_journal_checkpoint(block_store_t *const bs);
+
+///
+/// Commits whatever is left and stops journaling, block_store_destroy does this too
+/// \param bs BS device
+/// \return boolean indicating whether the final commit succeeded
+///
+bool block_store_journal_close(block_store_t *const bs);
+
+
+///
+/// Called when an asynchronous request completes
+/// \param block_id The block the request was for
+/// \param bytes The number of bytes transferred (the block size), 0 on error
+/// \param arg The pointer given with the request
+///
+typedef void (*block_store_io_callback_t)(size_t block_id, size_t bytes, void *arg);
+
+///
+/// Queues an asynchronous read of a whole block into buffer
+///  Nothing happens until block_store_poll, which submits every queued request at once
+///  (so queue a batch, then poll). A device opened with block_store_open_mmap reads its file
+///  directly, through io_uring where available and a small thread pool otherwise
+///  (or if BLOCK_STORE_NO_IO_URING is set in the environment), so many requests can be
+///  outstanding at the device. A heap device just copies the block during the poll.
+///  The async calls and block_store_poll are for one thread at a time.
+///  Destroying the device finishes outstanding requests without calling their callbacks.
+/// \param bs BS device
+/// \param block_id The block to read
+/// \param buffer Where the block goes, untouched until the callback runs
+/// \param callback Called from block_store_poll once the read is done
+/// \param arg Passed on to the callback
+/// \return boolean indicating the request was queued, false on error or when too many are outstanding
+///
+bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *const buffer,
+                            const block_store_io_callback_t callback, void *const arg);
+
+///
+/// Queues an asynchronous write of a whole block from buffer, the same way as block_store_read_async
+///  On a journaled device the write is journaled when block_store_poll does it, with the journal's lock
+///  held, just like block_store_write. It's durable once a block_store_journal_commit comes after that poll
+///  On a file device the block's checksum (and dirty mark) only moves to the new data once the poll sees the
+///  whole block written, so a write that fails leaves the block's checksum as it was
+/// \param bs BS device
+/// \param block_id The block to write
+/// \param buffer The data to write, has to stay valid until the callback runs
+/// \param callback Called from block_store_poll once the write is done
+/// \param arg Passed on to the callback
+/// \return boolean indicating the request was queued, false on error or when too many are outstanding
+///
+bool block_store_write_async(block_store_t *const bs, const size_t block_id, const void *const buffer,
+                             const block_store_io_callback_t callback, void *const arg);
+
+///
+/// Submits every queued request and runs the callbacks of the ones that have completed
+/// \param bs BS device
+/// \param wait Block until at least one request completes (if any are outstanding)
+/// \return The number of callbacks run
+///
+size_t block_store_poll(block_store_t *const bs, const bool wait);
+
+///
+/// Takes a point-in-time snapshot of the device without copying its blocks
+///  The snapshot is a device of its own, with a copy of the free block map (and checksums, if on).
+///  It shares the device's blocks until one of the two writes a block, then the snapshot gets a copy of
+///  just that block. Writing a block on the device takes a lock the first time after a snapshot, after
+///  that it's as fast as it was. Snapshots can be read, written, allocated from and serialized while the
+///  device is in use, and either can be destroyed first. A snapshot's reads take a lock shared with the
+///  device's first writes, so serializing a snapshot holds those up until it's done.
+///  view/mut, the async calls, journaling, incremental serializing, set_checksums and the cold tier
+///  aren't available on a snapshot, and the device can't turn its cold tier on while it has snapshots.
+///  Nothing else can be using the device while the snapshot is taken
+/// \param bs BS device (a heap or lazy one, no cold tier, and no view/mut pointers outstanding,
+///  a lazy device is loaded in full first)
+/// \return Pointer to the snapshot, NULL on error (or for a snapshot of a snapshot)
+///
+block_store_t *block_store_snapshot(block_store_t *const bs);
+
+///
+/// Lists the user blocks that differ between two snapshots of the same device (or the device itself)
+///  A block differs if it's allocated in one and not the other, or if it has been written in either of
+///  them since the older one was taken (even if it was written with the same data). Neither's free block
+///  map can be changing meanwhile
+/// \param a BS device or one of its snapshots
+/// \param b Another one of those, in either order
+/// \param block_ids Receives the ids that differ, in order (may be NULL if max_ids is 0)
+/// \param max_ids How many ids block_ids can hold
+/// \return The number of blocks that differ (can be more than max_ids), SIZE_MAX on error or if they
+///  aren't snapshots of the same device
+///
+size_t block_store_diff(const block_store_t *const a, const block_store_t *const b, size_t *const block_ids,
+                        const size_t max_ids);
+
+///
+/// Operations counted by block_store_get_stats
+///  ALLOCATE covers allocate, allocate_n and allocate_extent, RELEASE the three release calls,
+///  READ read, pread and readv, WRITE write, pwrite and writev, and SERIALIZE serialize,
+///  serialize_incremental and serialize_compressed
+///
+typedef enum {
+    BS_STAT_ALLOCATE = 0,
+    BS_STAT_RELEASE,
+    BS_STAT_READ,
+    BS_STAT_WRITE,
+    BS_STAT_SERIALIZE,
+    BS_STAT_OPS
+} block_store_stat_op_t;
+
+///
+/// Number of buckets in a latency histogram
+///  Buckets below 8 hold exactly that many nanoseconds. After that every power of two is split into
+///  8 equal buckets: bucket b (b >= 8) starts at (8 + b % 8) << (b / 8 - 1) ns, so a bucket is never
+///  wider than an eighth of its values. The last bucket also holds everything from 2^40 ns up
+///
+#define BS_LATENCY_BUCKETS 304
+
+///
+/// Latency histogram of one operation, in nanoseconds
+///  min_ns and max_ns are exact, percentiles come out of the buckets (see block_store_latency_percentile)
+///
+typedef struct {
+    size_t total_ns;
+    size_t min_ns;
+    size_t max_ns;
+    size_t buckets[BS_LATENCY_BUCKETS];
+} block_store_latency_t;
+
+///
+/// Counters of a device with stats on, see block_store_set_stats
+///  calls and failures are per block_store_stat_op_t. A failure is an allocation that got fewer blocks
+///  than it asked for, or a read, write or serialize that returned 0. Calls rejected for their parameters
+///  aren't counted at all. The bytes are what successful calls returned, ffz_words the free block map
+///  words allocations looked at to find their blocks
+///
+typedef struct {
+    size_t calls[BS_STAT_OPS];
+    size_t failures[BS_STAT_OPS];
+    size_t bytes_read;
+    size_t bytes_written;
+    size_t bytes_serialized;
+    size_t ffz_words;
+    block_store_latency_t latency[BS_STAT_OPS];
+} block_store_stats_t;
+
+///
+/// Turns operation stats on or off
+///  With stats on, every counted call (see block_store_stat_op_t) reads the clock twice and bumps a few
+///  counters. Each thread counts into one of 16 shards, picked by the order threads first used the library
+///  (slots aren't reused, so the 1st and 17th threads share one). Threads that share a shard contend on its
+///  counters, threads that don't never touch each other's. Turning stats on starts every counter from zero,
+///  turning them off throws them away. Nothing else can be using the device
+/// \param bs BS device
+/// \param enable Stats on or off
+/// \return boolean indicating succes of operation
+///
+bool block_store_set_stats(block_store_t *const bs, const bool enable);
+
+///
+/// Gets the counters of a device with stats on
+///  Can be called while the device is in use, calls still in progress may or may not be in it yet
+/// \param bs BS device
+/// \param stats Receives the counters, added up over every thread
+/// \return boolean indicating succes of operation, false if stats are off
+///
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const stats);
+
+///
+/// Reads a percentile off a latency histogram
+///  The result is the highest latency in the bucket the percentile falls in (kept within min_ns and max_ns),
+///  so it's at most an eighth over the real value
+/// \param latency The histogram, from block_store_get_stats
+/// \param percentile Which one, from 0 to 100 (50 for the median)
+/// \return The latency in nanoseconds, 0 if the histogram is empty or on error
+///
+size_t block_store_latency_percentile(const block_store_latency_t *const latency, const double percentile);
+
 
 #ifdef __cplusplus
 }
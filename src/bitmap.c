@@ -1,15 +1,26 @@
 #include "bitmap.h"
 #include <string.h>
+#include <stdatomic.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_DISPATCH 1
+#endif
 
-// Just the one for now. Indicates we're an overlay and should not free
+// OVERLAY indicates we're an overlay and should not free
+// CONCURRENT means every access to the data is atomic (see bitmap_set_concurrent)
+// BORROWED means the header (and its data) is in somebody else's memory, so nothing gets freed
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum { NONE = 0x00, OVERLAY = 0x01, CONCURRENT = 0x02, BORROWED = 0x04, ALL = 0xFF } BITMAP_FLAGS;
 
+// Storage is 64-bit words in byte order, so the bytes are the same ones export/import/overlay always used
+// (bit n is bit (n & 7) of byte n >> 3). Our own storage is padded out to whole, aligned words,
+// so every bit is in a full word. An overlay's storage is the caller's: only its whole words are
+// accessed as words, a partial word at the end is done a byte at a time.
 struct bitmap {
-    unsigned leftover_bits;  // Packing will increase this to an int anyway
-    BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
+    BITMAP_FLAGS flags;  // Generic place to store flags. Not enough flags to worry about width yet.
     uint8_t *data;
     size_t bit_count, byte_count;
+    size_t word_count;  // Whole words in storage
 };
 
 
@@ -18,81 +29,434 @@ struct bitmap {
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
-// lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
-static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
-// Inverted mask
-static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
-
-// Total bits set in the given byte in a handy lookup table
-// Macros, man...
-// http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetTable
-#define B2(n) n, n + 1, n + 1, n + 2
-#define B4(n) B2(n), B2(n + 1), B2(n + 1), B2(n + 2)
-#define B6(n) B4(n), B4(n + 1), B4(n + 1), B4(n + 2)
-static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
-#undef B6
-#undef B4
-#undef B2
-// There is an alternative for getting bit count that only loops as many times as there are bits set
-// but that's still a loop and this table is 256B.
-/*
-   unsigned int v; // count the number of bits set in v
-   unsigned int c; // c accumulates the total bits set in v
-
-   for (c = 0; v; v >>= 1)
-   {
-   c += v & 1;
-   }
-   */
+// Bit totals used to come out of a 256 byte lookup table, one byte at a time.
+// popcount does a whole word in one instruction (see popcount_words below).
 
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
+// Same, in memory that's already there (bitmap_footprint bytes), with the data right after the header
+static bitmap_t *bitmap_initialize_at(void *const memory, size_t n_bits, BITMAP_FLAGS flags);
+
+// Storage is byte-ordered, so big endian needs a swap to keep bit n at word bit (n & 63)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define STORAGE_ORDER(bits) __builtin_bswap64(bits)
+#else
+#define STORAGE_ORDER(bits) (bits)
+#endif
+
+// Words looked at by this thread's zero searches, see bitmap_scanned_words
+static _Thread_local size_t scanned_words;
+
+// In concurrent mode the full words are only ever accessed as 64-bit atomics,
+// and the bytes of the partial tail word (if any) as 8-bit atomics. Never mixed.
+static inline _Atomic uint64_t *atomic_word(const bitmap_t *const bitmap, const size_t word) {
+    return (_Atomic uint64_t *) (bitmap->data + (word << 3));
+}
+
+static inline _Atomic uint8_t *atomic_byte(const bitmap_t *const bitmap, const size_t byte) {
+    return (_Atomic uint8_t *) (bitmap->data + byte);
+}
+
+// Word-at-a-time access to the byte array, for the scans that want to skip whole words
+// memcpy keeps us safe from alignment issues and compiles to a single load.
+static inline uint64_t load_word(const bitmap_t *const bitmap, const size_t word) {
+    uint64_t bits;
+    if (FLAG_CHECK(bitmap, CONCURRENT)) {
+        bits = atomic_load_explicit(atomic_word(bitmap, word), memory_order_acquire);
+    } else {
+        memcpy(&bits, bitmap->data + (word << 3), sizeof(bits));
+    }
+    return STORAGE_ORDER(bits);
+}
+
+// Loads the partial word at the end of an overlay (if any), zero-filled past byte_count
+static inline uint64_t load_tail_word(const bitmap_t *const bitmap) {
+    uint64_t bits = 0;
+    const size_t offset = bitmap->word_count << 3;
+    for (size_t byte = offset; byte < bitmap->byte_count; ++byte) {
+        const uint8_t value = FLAG_CHECK(bitmap, CONCURRENT)
+                                  ? atomic_load_explicit(atomic_byte(bitmap, byte), memory_order_acquire)
+                                  : bitmap->data[byte];
+        bits |= (uint64_t) value << ((byte - offset) << 3);
+    }
+    return bits;
+}
+
+// Either of the above, whichever the word index needs
+static inline uint64_t get_word(const bitmap_t *const bitmap, const size_t word) {
+    return (word < bitmap->word_count) ? load_word(bitmap, word) : load_tail_word(bitmap);
+}
+
+// Writes a word back, the inverse of get_word (the tail only writes the bytes that exist)
+// Not for concurrent mode, that has to claim bits with atomic_bit_op or a CAS instead
+static inline void put_word(bitmap_t *const bitmap, const size_t word, uint64_t bits) {
+    if (word < bitmap->word_count) {
+        bits = STORAGE_ORDER(bits);
+        memcpy(bitmap->data + (word << 3), &bits, sizeof(bits));
+    } else {
+        for (size_t byte = word << 3; byte < bitmap->byte_count; ++byte, bits >>= 8) {
+            bitmap->data[byte] = (uint8_t) bits;
+        }
+    }
+}
+
+// Mask of the bits in the given word that are within bit_count
+static inline uint64_t valid_mask(const bitmap_t *const bitmap, const size_t word) {
+    const size_t valid = bitmap->bit_count - (word << 6);
+    return valid >= 64 ? UINT64_MAX : ((UINT64_C(1) << valid) - 1);
+}
+
+// Total set bits in the given number of whole words, the hot loop of total_set.
+// Unaligned data is fine, everything goes through memcpy/loadu.
+static size_t popcount_words_generic(const uint8_t *const data, const size_t words) {
+    size_t total = 0;
+    for (size_t word = 0; word < words; ++word) {
+        uint64_t bits;
+        memcpy(&bits, data + (word << 3), sizeof(bits));
+        total += __builtin_popcountll(bits);
+    }
+    return total;
+}
+
+#ifdef HAVE_X86_DISPATCH
+// Same loop, but built so __builtin_popcountll is the popcnt instruction and not a libgcc call
+__attribute__((target("popcnt"))) static size_t popcount_words_popcnt(const uint8_t *const data, const size_t words) {
+    size_t total = 0;
+    for (size_t word = 0; word < words; ++word) {
+        uint64_t bits;
+        memcpy(&bits, data + (word << 3), sizeof(bits));
+        total += __builtin_popcountll(bits);
+    }
+    return total;
+}
+
+// 32 bytes at a time: split each byte into nibbles, look both up in a 16 entry table with a shuffle,
+// and sum the byte counts into four 64-bit lanes with sad. A byte counter gains at most 8
+// per round, so they're flushed every 31 rounds before they can overflow.
+__attribute__((target("avx2,popcnt"))) static size_t popcount_words_avx2(const uint8_t *const data,
+                                                                         const size_t words) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,  //
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0F);
+    const __m256i zero        = _mm256_setzero_si256();
+    __m256i lanes             = zero;
+    size_t word               = 0;
+    while (word + 4 <= words) {
+        __m256i counts = zero;
+        for (unsigned round = 0; round < 31 && word + 4 <= words; ++round, word += 4) {
+            const __m256i bits = _mm256_loadu_si256((const __m256i *) (data + (word << 3)));
+            const __m256i low  = _mm256_shuffle_epi8(lookup, _mm256_and_si256(bits, low_nibbles));
+            const __m256i high =
+                _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(bits, 4), low_nibbles));
+            counts = _mm256_add_epi8(counts, _mm256_add_epi8(low, high));
+        }
+        lanes = _mm256_add_epi64(lanes, _mm256_sad_epu8(counts, zero));
+    }
+    size_t total = (size_t) _mm256_extract_epi64(lanes, 0) + (size_t) _mm256_extract_epi64(lanes, 1)
+                   + (size_t) _mm256_extract_epi64(lanes, 2) + (size_t) _mm256_extract_epi64(lanes, 3);
+    return total + popcount_words_popcnt(data + (word << 3), words - word);
+}
+#endif
+
+// Picks the fastest of the above the CPU can run. The vector loop needs a few words to pay off.
+static size_t popcount_words(const uint8_t *const data, const size_t words) {
+#ifdef HAVE_X86_DISPATCH
+    if (words >= 16 && __builtin_cpu_supports("avx2")) {
+        return popcount_words_avx2(data, words);
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return popcount_words_popcnt(data, words);
+    }
+#endif
+    return popcount_words_generic(data, words);
+}
+
+typedef enum { BULK_AND, BULK_OR, BULK_XOR, BULK_ANDNOT } BULK_OP;
+
+// Combines src into dst word by word, the bitmaps have to be the same size
+static bool bulk_op(bitmap_t *const dst, const bitmap_t *const src, const BULK_OP op) {
+    if (!dst || !src || dst->bit_count != src->bit_count) {
+        return false;
+    }
+    const size_t words = (dst->bit_count + 63) >> 6;
+    for (size_t word = 0; word < words; ++word) {
+        const uint64_t a = get_word(dst, word), b = get_word(src, word);
+        switch (op) {
+            case BULK_AND:
+                put_word(dst, word, a & b);
+                break;
+            case BULK_OR:
+                put_word(dst, word, a | b);
+                break;
+            case BULK_XOR:
+                put_word(dst, word, a ^ b);
+                break;
+            case BULK_ANDNOT:
+                put_word(dst, word, a & ~b);
+                break;
+        }
+    }
+    return true;
+}
+
+typedef enum { OP_SET, OP_RESET, OP_FLIP } ATOMIC_OP;
+
+// Atomically applies op to the bit, returns the bit's previous state
+static bool atomic_bit_op(bitmap_t *const bitmap, const size_t bit, const ATOMIC_OP op) {
+    if ((bit >> 6) < bitmap->word_count) {
+        _Atomic uint64_t *const word = atomic_word(bitmap, bit >> 6);
+        const uint64_t bit_mask      = STORAGE_ORDER(UINT64_C(1) << (bit & 63));
+        switch (op) {
+            case OP_SET:
+                return atomic_fetch_or_explicit(word, bit_mask, memory_order_acq_rel) & bit_mask;
+            case OP_RESET:
+                return atomic_fetch_and_explicit(word, ~bit_mask, memory_order_acq_rel) & bit_mask;
+            default:
+                return atomic_fetch_xor_explicit(word, bit_mask, memory_order_acq_rel) & bit_mask;
+        }
+    }
+    _Atomic uint8_t *const byte = atomic_byte(bitmap, bit >> 3);
+    const uint8_t bit_mask      = (uint8_t) (1u << (bit & 0x07));
+    switch (op) {
+        case OP_SET:
+            return atomic_fetch_or_explicit(byte, bit_mask, memory_order_acq_rel) & bit_mask;
+        case OP_RESET:
+            return atomic_fetch_and_explicit(byte, (uint8_t) ~bit_mask, memory_order_acq_rel) & bit_mask;
+        default:
+            return atomic_fetch_xor_explicit(byte, bit_mask, memory_order_acq_rel) & bit_mask;
+    }
+}
+
+// Applies op to the bit with a read-modify-write of its whole word (only a tail byte for an overlay's
+// partial word), returns the bit's previous state. Atomic in concurrent mode.
+static inline bool bit_op(bitmap_t *const bitmap, const size_t bit, const ATOMIC_OP op) {
+    if (FLAG_CHECK(bitmap, CONCURRENT)) {
+        return atomic_bit_op(bitmap, bit, op);
+    }
+    const uint64_t word     = get_word(bitmap, bit >> 6);
+    const uint64_t bit_mask = UINT64_C(1) << (bit & 63);
+    switch (op) {
+        case OP_SET:
+            put_word(bitmap, bit >> 6, word | bit_mask);
+            break;
+        case OP_RESET:
+            put_word(bitmap, bit >> 6, word & ~bit_mask);
+            break;
+        default:
+            put_word(bitmap, bit >> 6, word ^ bit_mask);
+            break;
+    }
+    return word & bit_mask;
+}
 
 // Sets requested bit in bitmap
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    bit_op(bitmap, bit, OP_SET);
 }
 
 // Clears requested bit in bitmap
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    bit_op(bitmap, bit, OP_RESET);
 }
 
 // Returns bit in bitmap
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    return (get_word(bitmap, bit >> 6) >> (bit & 63)) & 1;
 }
 
 // Flips bit in bitmap
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    bit_op(bitmap, bit, OP_FLIP);
+}
+
+// Sets requested bit, returns what it was before
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) {
+    return bit_op(bitmap, bit, OP_SET);
+}
+
+// Clears requested bit, returns what it was before
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) {
+    return bit_op(bitmap, bit, OP_RESET);
+}
+
+// Bits of the given word that fall inside [start, end), the word has to overlap the range
+static inline uint64_t range_mask(const size_t word, const size_t start, const size_t end) {
+    const size_t low    = word << 6;
+    const uint64_t head = start > low ? UINT64_MAX << (start - low) : UINT64_MAX;
+    const uint64_t tail = end - low < 64 ? (UINT64_C(1) << (end - low)) - 1 : UINT64_MAX;
+    return head & tail;
+}
+
+// Sets or clears the masked bits of one word, returns how many of them actually changed
+static size_t range_word(bitmap_t *const bitmap, const size_t word, const uint64_t bits, const bool set) {
+    if (!FLAG_CHECK(bitmap, CONCURRENT)) {
+        const uint64_t previous = get_word(bitmap, word);
+        const uint64_t updated  = set ? previous | bits : previous & ~bits;
+        put_word(bitmap, word, updated);
+        return (size_t) __builtin_popcountll(previous ^ updated);
+    }
+    if (word < bitmap->word_count) {
+        _Atomic uint64_t *const target = atomic_word(bitmap, word);
+        const uint64_t previous =
+            STORAGE_ORDER(set ? atomic_fetch_or_explicit(target, STORAGE_ORDER(bits), memory_order_acq_rel)
+                              : atomic_fetch_and_explicit(target, ~STORAGE_ORDER(bits), memory_order_acq_rel));
+        return (size_t) __builtin_popcountll((set ? ~previous : previous) & bits);
+    }
+    // The tail word is bytes as far as the atomics are concerned
+    size_t changed = 0;
+    for (size_t byte = word << 3; byte < bitmap->byte_count; ++byte) {
+        const uint8_t byte_bits = (uint8_t) (bits >> ((byte - (word << 3)) << 3));
+        if (byte_bits) {
+            const uint8_t previous = set ? atomic_fetch_or_explicit(atomic_byte(bitmap, byte), byte_bits,
+                                                                    memory_order_acq_rel)
+                                         : atomic_fetch_and_explicit(atomic_byte(bitmap, byte),
+                                                                     (uint8_t) ~byte_bits, memory_order_acq_rel);
+            changed += (size_t) __builtin_popcount((uint8_t) (set ? ~previous : previous) & byte_bits);
+        }
+    }
+    return changed;
+}
+
+// Checks a range is entirely inside the bitmap (and not empty)
+static inline bool range_valid(const bitmap_t *const bitmap, const size_t start, const size_t length) {
+    return bitmap && length && start < bitmap->bit_count && length <= bitmap->bit_count - start;
+}
+
+// Masks the head and tail words, the whole words in between are memset (or done one atomic at a time)
+static size_t range_op(bitmap_t *const bitmap, const size_t start, const size_t length, const bool set) {
+    if (!range_valid(bitmap, start, length)) {
+        return 0;
+    }
+    const size_t end = start + length, first = start >> 6, last = (end - 1) >> 6;
+    size_t changed   = range_word(bitmap, first, range_mask(first, start, end), set);
+    if (first == last) {
+        return changed;
+    }
+    const size_t middle = last - first - 1;
+    if (FLAG_CHECK(bitmap, CONCURRENT)) {
+        for (size_t word = first + 1; word < last; ++word) {
+            changed += range_word(bitmap, word, UINT64_MAX, set);
+        }
+    } else if (middle) {
+        // Everything between the head and tail is a full word, so it's all in the array
+        uint8_t *const bytes = bitmap->data + ((first + 1) << 3);
+        const size_t before  = popcount_words(bytes, middle);
+        changed += set ? (middle << 6) - before : before;
+        memset(bytes, set ? 0xFF : 0x00, middle << 3);
+    }
+    return changed + range_word(bitmap, last, range_mask(last, start, end), set);
+}
+
+// Sets a range of bits
+size_t bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t length) {
+    return range_op(bitmap, start, length, true);
+}
+
+// Clears a range of bits
+size_t bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t length) {
+    return range_op(bitmap, start, length, false);
+}
+
+// Counts the set bits in a range
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t length) {
+    if (!range_valid(bitmap, start, length)) {
+        return 0;
+    }
+    const size_t end = start + length, first = start >> 6, last = (end - 1) >> 6;
+    size_t total     = (size_t) __builtin_popcountll(get_word(bitmap, first) & range_mask(first, start, end));
+    if (first == last) {
+        return total;
+    }
+    if (FLAG_CHECK(bitmap, CONCURRENT)) {
+        for (size_t word = first + 1; word < last; ++word) {
+            total += (size_t) __builtin_popcountll(get_word(bitmap, word));
+        }
+    } else {
+        total += popcount_words(bitmap->data + ((first + 1) << 3), last - first - 1);
+    }
+    return total + (size_t) __builtin_popcountll(get_word(bitmap, last) & range_mask(last, start, end));
+}
+
+// Checks every bit in a range is set
+bool bitmap_all_set_range(const bitmap_t *const bitmap, const size_t start, const size_t length) {
+    if (!bitmap || (length && !range_valid(bitmap, start, length))) {
+        return false;
+    }
+    const size_t end = start + length;
+    for (size_t word = start >> 6; length && word <= (end - 1) >> 6; ++word) {
+        const uint64_t bits = range_mask(word, start, end);
+        if ((get_word(bitmap, word) & bits) != bits) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Switches concurrent mode on or off
+bool bitmap_set_concurrent(bitmap_t *const bitmap, const bool enable) {
+    if (bitmap) {
+        if (!enable) {
+            bitmap->flags &= ~CONCURRENT;
+            return true;
+        }
+        // 64-bit atomics need aligned words
+        if (!((uintptr_t) bitmap->data & 0x07)) {
+            bitmap->flags |= CONCURRENT;
+            return true;
+        }
+    }
+    return false;
 }
 
 // Flips all bits in the bitmap
 void bitmap_invert(bitmap_t *const bitmap) {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) {
+    // A word at a time (the compiler vectorizes this), then whatever bytes are left
+    const size_t full_words = bitmap->word_count;
+    for (size_t word = 0; word < full_words; ++word) {
+        uint64_t bits;
+        memcpy(&bits, bitmap->data + (word << 3), sizeof(bits));
+        bits = ~bits;
+        memcpy(bitmap->data + (word << 3), &bits, sizeof(bits));
+    }
+    for (size_t byte = full_words << 3; byte < bitmap->byte_count; ++byte) {
         bitmap->data[byte] = ~bitmap->data[byte];
     }
 }
 
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src) {
+    return bulk_op(dst, src, BULK_AND);
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src) {
+    return bulk_op(dst, src, BULK_OR);
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src) {
+    return bulk_op(dst, src, BULK_XOR);
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src) {
+    return bulk_op(dst, src, BULK_ANDNOT);
+}
+
 // Find first set
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) {
+        // Skip clear words, then let the bit scan find the bit inside the first non-empty one
+        // Anything past bit_count in the last word is undetermined, which the bounds check handles:
+        //  it's the last word, so a stray bit past the end means there's nothing real to find
+        const size_t full_words = bitmap->word_count;
+        size_t word             = 0;
+        uint64_t bits           = 0;
+        for (; word < full_words && !(bits = load_word(bitmap, word)); ++word) {
+        }
+        if (word == full_words) {
+            bits = load_tail_word(bitmap);
+        }
+        if (bits) {
+            const size_t result = (word << 6) + __builtin_ctzll(bits);
+            return (result < bitmap->bit_count ? result : SIZE_MAX);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
@@ -100,29 +464,214 @@ size_t bitmap_ffs(const bitmap_t *const bitmap) {
 // Find first zero
 size_t bitmap_ffz(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+        // Same as ffs, just skipping full words instead of empty ones
+        // (the tail word is zero-filled, so it always has a zero. Might just be past the end)
+        const size_t full_words = bitmap->word_count;
+        size_t word             = 0;
+        uint64_t bits           = 0;
+        for (; word < full_words && !(bits = ~load_word(bitmap, word)); ++word) {
+        }
+        if (word == full_words) {
+            bits = ~load_tail_word(bitmap);
+        }
+        scanned_words += word < full_words ? word + 1 : (bitmap->bit_count + 63) >> 6;
+        const size_t result = (word << 6) + __builtin_ctzll(bits);
+        return (result < bitmap->bit_count ? result : SIZE_MAX);
+    }
+    return SIZE_MAX;
+}
+
+// Find first run of zeros
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t length) {
+    if (bitmap && length && length <= bitmap->bit_count) {
+        // Hop from run to run with the bit scan, so empty and full words take one step each
+        // Bits past the end count as set, so no run can go past bit_count
+        const size_t words = (bitmap->bit_count + 63) >> 6;
+        size_t start = 0, run = 0;
+        for (size_t word = 0; word < words; ++word) {
+            ++scanned_words;
+            const uint64_t value = get_word(bitmap, word) | ~valid_mask(bitmap, word);
+            for (unsigned pos = 0; pos < 64;) {
+                const uint64_t rest = value >> pos;
+                if (!(rest & 1)) {
+                    const unsigned zeros = rest ? (unsigned) __builtin_ctzll(rest) : 64 - pos;
+                    if (!run) {
+                        start = (word << 6) + pos;
+                    }
+                    run += zeros;
+                    if (run >= length) {
+                        return start;
+                    }
+                    pos += zeros;
+                } else {
+                    run = 0;
+                    pos += (~rest) ? (unsigned) __builtin_ctzll(~rest) : 64 - pos;
+                }
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Find first zero and set it
+size_t bitmap_claim_zero(bitmap_t *const bitmap) {
+    if (bitmap) {
+        if (!FLAG_CHECK(bitmap, CONCURRENT)) {
+            const size_t bit = bitmap_ffz(bitmap);
+            if (bit != SIZE_MAX) {
+                bitmap_set(bitmap, bit);
+            }
+            return bit;
+        }
+        // Find a candidate the same way ffz does, then try to take it with fetch_or
+        // If the bit was already set someone beat us to it, so look at the same word again
+        const size_t words = (bitmap->bit_count + 63) >> 6;
+        for (size_t word = 0; word < words;) {
+            ++scanned_words;
+            const uint64_t zeros = ~get_word(bitmap, word) & valid_mask(bitmap, word);
+            if (!zeros) {
+                ++word;
+                continue;
+            }
+            const size_t bit = (word << 6) + __builtin_ctzll(zeros);
+            if (!atomic_bit_op(bitmap, bit, OP_SET)) {
+                return bit;
+            }
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
+// First zero at or after start, wrapping around to the beginning. SIZE_MAX if there isn't one
+static size_t find_zero_from(const bitmap_t *const bitmap, size_t start) {
+    if (start >= bitmap->bit_count) {
+        start = 0;
+    }
+    // The start word gets looked at twice: first from start up, then all of it after wrapping around
+    const size_t words = (bitmap->bit_count + 63) >> 6;
+    size_t word        = start >> 6;
+    uint64_t zeros     = ~get_word(bitmap, word) & valid_mask(bitmap, word) & (UINT64_MAX << (start & 63));
+    for (size_t scanned = 0; scanned < words; ++scanned) {
+        if (zeros) {
+            scanned_words += scanned + 1;
+            return (word << 6) + __builtin_ctzll(zeros);
+        }
+        word  = (word + 1 == words) ? 0 : word + 1;
+        zeros = ~get_word(bitmap, word) & valid_mask(bitmap, word);
+    }
+    scanned_words += words + 1;
+    return zeros ? (word << 6) + __builtin_ctzll(zeros) : SIZE_MAX;
+}
+
+// Find first zero from start
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) {
+    return bitmap ? find_zero_from(bitmap, start) : SIZE_MAX;
+}
+
+// Find first zero from start, and set it
+size_t bitmap_claim_zero_from(bitmap_t *const bitmap, const size_t start) {
+    if (bitmap) {
+        size_t bit = find_zero_from(bitmap, start);
+        if (!FLAG_CHECK(bitmap, CONCURRENT)) {
+            if (bit != SIZE_MAX) {
+                bitmap_set(bitmap, bit);
+            }
+            return bit;
+        }
+        // Same fetch_or and check as claim_zero. Losing a bit means it's set now, so search on from it
+        while (bit != SIZE_MAX && atomic_bit_op(bitmap, bit, OP_SET)) {
+            bit = find_zero_from(bitmap, bit);
+        }
+        return bit;
+    }
+    return SIZE_MAX;
+}
+
+// Claims up to count zeros in one word in concurrent mode, returns the bits it got
+static uint64_t claim_word_concurrent(bitmap_t *const bitmap, const size_t word, const size_t count) {
+    if (word < bitmap->word_count) {
+        // Full words take everything they can in one CAS, retrying with whatever's left if it moved
+        _Atomic uint64_t *const target = atomic_word(bitmap, word);
+        const uint64_t valid           = valid_mask(bitmap, word);
+        uint64_t expected              = atomic_load_explicit(target, memory_order_acquire);
+        uint64_t claim;
+        do {
+            const uint64_t zeros = ~STORAGE_ORDER(expected) & valid;
+            uint64_t remaining   = zeros;
+            for (size_t taken = 0; remaining && taken < count; ++taken) {
+                remaining &= remaining - 1;
+            }
+            claim = zeros & ~remaining;
+            if (!claim) {
+                break;
+            }
+        } while (!atomic_compare_exchange_weak_explicit(target, &expected, expected | STORAGE_ORDER(claim),
+                                                        memory_order_acq_rel, memory_order_acquire));
+        return claim;
+    }
+    // The tail is bytes, so go one bit at a time
+    uint64_t claim = 0, zeros = ~get_word(bitmap, word) & valid_mask(bitmap, word);
+    for (size_t taken = 0; zeros && taken < count; zeros &= zeros - 1) {
+        const unsigned bit = __builtin_ctzll(zeros);
+        if (!atomic_bit_op(bitmap, (word << 6) + bit, OP_SET)) {
+            claim |= UINT64_C(1) << bit;
+            ++taken;
+        }
+    }
+    return claim;
+}
+
+// Find and set up to count zeros
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t count, size_t *const bits) {
+    size_t claimed = 0;
+    if (bitmap && bits && FLAG_CHECK(bitmap, CONCURRENT)) {
+        const size_t words = (bitmap->bit_count + 63) >> 6;
+        for (size_t word = 0; word < words && claimed < count; ++word) {
+            ++scanned_words;
+            for (uint64_t claim = claim_word_concurrent(bitmap, word, count - claimed); claim; claim &= claim - 1) {
+                bits[claimed++] = (word << 6) + __builtin_ctzll(claim);
+            }
+        }
+    } else if (bitmap && bits) {
+        // Collect the zeros a word at a time, then write the word back once with all of them set
+        const size_t words = (bitmap->bit_count + 63) >> 6;
+        for (size_t word = 0; word < words && claimed < count; ++word) {
+            ++scanned_words;
+            const uint64_t value = get_word(bitmap, word);
+            const uint64_t zeros = ~value & valid_mask(bitmap, word);
+            uint64_t remaining   = zeros;
+            for (; remaining && claimed < count; remaining &= remaining - 1) {
+                bits[claimed++] = (word << 6) + __builtin_ctzll(remaining);
+            }
+            if (zeros) {
+                put_word(bitmap, word, value | (zeros & ~remaining));
+            }
+        }
+    }
+    return claimed;
+}
+
+// Words this thread's zero searches looked at
+size_t bitmap_scanned_words(void) {
+    return scanned_words;
+}
+
 // Count all bits set
 size_t bitmap_total_set(const bitmap_t *const bitmap) {
     size_t total = 0;
-    if (bitmap) {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) {
-            total += bit_totals[bitmap->data[idx]];
+    if (bitmap && FLAG_CHECK(bitmap, CONCURRENT)) {
+        // Has to go through the atomic loads, the table would read bytes out from under them
+        const size_t words = (bitmap->bit_count + 63) >> 6;
+        for (size_t word = 0; word < words; ++word) {
+            total += __builtin_popcountll(get_word(bitmap, word) & valid_mask(bitmap, word));
         }
-        if (bitmap->leftover_bits) {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+    } else if (bitmap) {
+        // Every word but a partial last one can be counted straight off the array,
+        // the last one has to be masked so we don't count the undetermined bits past bit_count
+        const size_t whole_words = bitmap->bit_count >> 6;
+        total                    = popcount_words(bitmap->data, whole_words);
+        if (bitmap->bit_count & 63) {
+            total += __builtin_popcountll(get_word(bitmap, whole_words) & valid_mask(bitmap, whole_words));
         }
     }
     return total;
@@ -131,16 +680,45 @@ size_t bitmap_total_set(const bitmap_t *const bitmap) {
 // For each loop for all set bits
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
     if (bitmap && func) {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) {
-            if (bitmap_test(bitmap, idx)) {
-                func(idx, arg);
-            }
+        bitmap_iter_t it;
+        bitmap_iter_init(&it, bitmap);
+        for (size_t idx; (idx = bitmap_next_set(&it)) != SIZE_MAX;) {
+            func(idx, arg);
         }
     }
 }
 
+// Starts an iteration over the set bits, loading the first word
+void bitmap_iter_init(bitmap_iter_t *const it, const bitmap_t *const bitmap) {
+    if (it) {
+        it->bitmap = bitmap;
+        it->word   = 0;
+        it->bits   = (bitmap && bitmap->bit_count) ? get_word(bitmap, 0) & valid_mask(bitmap, 0) : 0;
+    }
+}
+
+// Next set bit: skip empty words, ctz the lowest bit out of the current one and clear it (blsr)
+size_t bitmap_next_set(bitmap_iter_t *const it) {
+    if (!it || !it->bitmap) {
+        return SIZE_MAX;
+    }
+    const size_t words = (it->bitmap->bit_count + 63) >> 6;
+    while (!it->bits) {
+        if (it->word + 1 >= words) {
+            it->word = words;
+            return SIZE_MAX;
+        }
+        ++it->word;
+        it->bits = get_word(it->bitmap, it->word) & valid_mask(it->bitmap, it->word);
+    }
+    const size_t bit = (it->word << 6) + (unsigned) __builtin_ctzll(it->bits);
+    it->bits &= it->bits - 1;
+    return bit;
+}
+
 // Resets bitmap contents to desired pattern
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) {
+    // libc's memset is already vectorized
     memset(bitmap->data, pattern, bitmap->byte_count);
 }
 
@@ -183,12 +761,263 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
 }
 
 void bitmap_destroy(bitmap_t *bitmap) {
+    // don't free memory that isn't ours! (and inline data goes with the header)
+    if (bitmap && !FLAG_CHECK(bitmap, BORROWED)) {
+        free(bitmap);
+    }
+}
+
+size_t bitmap_footprint(const size_t n_bits) {
+    // The header is a multiple of 8 bytes, so the words after it stay aligned
+    // (too many bits to ever allocate comes out as SIZE_MAX, so the allocation fails)
+    _Static_assert(!(sizeof(bitmap_t) & 0x07), "inline data has to start on a word");
+    return n_bits > SIZE_MAX - 63 ? SIZE_MAX : sizeof(bitmap_t) + (((n_bits + 63) >> 6) << 3);
+}
+
+bitmap_t *bitmap_create_inline(void *const memory, const size_t n_bits) {
+    // Check the alignment here, concurrent mode would only find out later
+    if (memory && !((uintptr_t) memory & 0x07)) {
+        bitmap_t *bitmap = bitmap_initialize_at(memory, n_bits, BORROWED);
+        if (bitmap) {
+            memset(bitmap->data, 0, bitmap->word_count << 3);
+        }
+        return bitmap;
+    }
+    return NULL;
+}
+
+//
+// Bitmap arena
+//
+// Bitmaps in chunks of memory that are only given back all at once. Each one is bumped off the
+// front of the newest chunk, and a bitmap that doesn't fit gets a new chunk of its own size
+// (at least). Resetting keeps the first chunk, so a steady load settles into no allocations at all.
+//
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;  // The one before it
+    size_t size, used;
+    uint64_t data[];
+} arena_chunk_t;
+
+struct bitmap_arena {
+    arena_chunk_t *chunks;  // Newest first
+    size_t chunk_size;
+};
+
+// A chunk with room for at least size bytes, NULL on error
+static arena_chunk_t *arena_chunk_create(const size_t size) {
+    if (size > SIZE_MAX - sizeof(arena_chunk_t)) {
+        return NULL;
+    }
+    arena_chunk_t *chunk = (arena_chunk_t *) malloc(sizeof(arena_chunk_t) + size);
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+    return chunk;
+}
+
+bitmap_arena_t *bitmap_arena_create(const size_t bytes) {
+    if (bytes) {
+        bitmap_arena_t *arena = (bitmap_arena_t *) malloc(sizeof(bitmap_arena_t));
+        if (arena) {
+            arena->chunk_size = (bytes + 7) & ~(size_t) 7;
+            arena->chunks     = arena_chunk_create(arena->chunk_size);
+            if (arena->chunks) {
+                return arena;
+            }
+            free(arena);
+        }
+    }
+    return NULL;
+}
+
+bitmap_t *bitmap_create_in(bitmap_arena_t *const arena, const size_t n_bits) {
+    if (arena && n_bits) {
+        const size_t size = bitmap_footprint(n_bits);
+        arena_chunk_t *chunk = arena->chunks;
+        if (chunk->size - chunk->used < size) {
+            chunk = arena_chunk_create(size > arena->chunk_size ? size : arena->chunk_size);
+            if (!chunk) {
+                return NULL;
+            }
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+        bitmap_t *bitmap = bitmap_create_inline((uint8_t *) chunk->data + chunk->used, n_bits);
+        chunk->used += size;
+        return bitmap;
+    }
+    return NULL;
+}
+
+void bitmap_arena_reset(bitmap_arena_t *const arena) {
+    if (arena) {
+        // Everything but the first chunk goes
+        while (arena->chunks->next) {
+            arena_chunk_t *next = arena->chunks->next;
+            free(arena->chunks);
+            arena->chunks = next;
+        }
+        arena->chunks->used = 0;
+    }
+}
+
+void bitmap_arena_destroy(bitmap_arena_t *arena) {
+    if (arena) {
+        bitmap_arena_reset(arena);
+        free(arena->chunks);
+        free(arena);
+    }
+}
+
+//
+// Hierarchical bitmap
+//
+
+// 64 words per level, so this covers 2^66 bits. Plenty.
+#define HIER_MAX_LEVELS 10
+
+struct bitmap_hier {
+    bitmap_t *bitmap;  // The actual bits
+    bool wrapped;      // Borrowed bitmap, don't destroy it
+    size_t levels;
+    // Level 0 summarizes the bitmap's words, level n summarizes level n - 1, the top level is one word
+    uint64_t *level[HIER_MAX_LEVELS];
+    size_t level_words[HIER_MAX_LEVELS];
+};
+
+// Does the given bitmap word have a zero within bit_count?
+static bool word_has_zero(const bitmap_t *const bitmap, const size_t word) {
+    // Pretend everything past the end is set
+    return ~get_word(bitmap, word) & valid_mask(bitmap, word);
+}
+
+bitmap_hier_t *bitmap_hier_create(const size_t n_bits) {
+    bitmap_t *bitmap = bitmap_create(n_bits);
     if (bitmap) {
-        if (!FLAG_CHECK(bitmap, OVERLAY)) {
-            // don't free memory that isn't ours!
-            free(bitmap->data);
+        bitmap_hier_t *hier = bitmap_hier_wrap(bitmap);
+        if (hier) {
+            hier->wrapped = false;
+            return hier;
+        }
+        bitmap_destroy(bitmap);
+    }
+    return NULL;
+}
+
+bitmap_hier_t *bitmap_hier_wrap(bitmap_t *const bitmap) {
+    if (bitmap) {
+        bitmap_hier_t *hier = (bitmap_hier_t *) malloc(sizeof(bitmap_hier_t));
+        if (hier) {
+            hier->bitmap  = bitmap;
+            hier->wrapped = true;
+            hier->levels  = 0;
+
+            // Figure out the shape, then grab all the summary words in one go
+            size_t words = (bitmap->bit_count + 63) >> 6;
+            size_t total = 0;
+            do {
+                words = (words + 63) >> 6;
+                hier->level_words[hier->levels++] = words;
+                total += words;
+            } while (words > 1);
+
+            hier->level[0] = (uint64_t *) malloc(total * sizeof(uint64_t));
+            if (hier->level[0]) {
+                for (size_t lvl = 1; lvl < hier->levels; ++lvl) {
+                    hier->level[lvl] = hier->level[lvl - 1] + hier->level_words[lvl - 1];
+                }
+                bitmap_hier_sync(hier);
+                return hier;
+            }
+            free(hier);
         }
-        free(bitmap);
+    }
+    return NULL;
+}
+
+void bitmap_hier_sync(bitmap_hier_t *const hier) {
+    if (hier) {
+        memset(hier->level[0], 0, hier->level_words[0] * sizeof(uint64_t));
+        const size_t words = (hier->bitmap->bit_count + 63) >> 6;
+        for (size_t word = 0; word < words; ++word) {
+            if (word_has_zero(hier->bitmap, word)) {
+                hier->level[0][word >> 6] |= UINT64_C(1) << (word & 63);
+            }
+        }
+        for (size_t lvl = 1; lvl < hier->levels; ++lvl) {
+            memset(hier->level[lvl], 0, hier->level_words[lvl] * sizeof(uint64_t));
+            for (size_t word = 0; word < hier->level_words[lvl - 1]; ++word) {
+                if (hier->level[lvl - 1][word]) {
+                    hier->level[lvl][word >> 6] |= UINT64_C(1) << (word & 63);
+                }
+            }
+        }
+    }
+}
+
+void bitmap_hier_set(bitmap_hier_t *const hier, const size_t bit) {
+    bitmap_set(hier->bitmap, bit);
+    size_t word = bit >> 6;
+    if (!word_has_zero(hier->bitmap, word)) {
+        // Word filled up, clear its summary bit and keep going up while words empty out
+        for (size_t lvl = 0; lvl < hier->levels; ++lvl, word >>= 6) {
+            hier->level[lvl][word >> 6] &= ~(UINT64_C(1) << (word & 63));
+            if (hier->level[lvl][word >> 6]) {
+                break;
+            }
+        }
+    }
+}
+
+void bitmap_hier_reset(bitmap_hier_t *const hier, const size_t bit) {
+    bitmap_reset(hier->bitmap, bit);
+    // There's a zero now, mark the path up to the top (stop once we hit a marked one)
+    size_t word = bit >> 6;
+    for (size_t lvl = 0; lvl < hier->levels; ++lvl, word >>= 6) {
+        const uint64_t before = hier->level[lvl][word >> 6];
+        hier->level[lvl][word >> 6] |= UINT64_C(1) << (word & 63);
+        if (before) {
+            break;
+        }
+    }
+}
+
+bool bitmap_hier_test(const bitmap_hier_t *const hier, const size_t bit) {
+    return bitmap_test(hier->bitmap, bit);
+}
+
+size_t bitmap_hier_ffz(const bitmap_hier_t *const hier) {
+    if (hier) {
+        size_t word = 0;
+        for (size_t lvl = hier->levels; lvl-- > 0;) {
+            const uint64_t summary = hier->level[lvl][word];
+            if (!summary) {
+                return SIZE_MAX;  // Only possible at the top, the summary says everything's full
+            }
+            word = (word << 6) + __builtin_ctzll(summary);
+        }
+        // Summary guarantees this word has a real zero in it
+        scanned_words += hier->levels + 1;
+        return (word << 6) + __builtin_ctzll(~get_word(hier->bitmap, word));
+    }
+    return SIZE_MAX;
+}
+
+const bitmap_t *bitmap_hier_get_bitmap(const bitmap_hier_t *const hier) {
+    return hier->bitmap;
+}
+
+void bitmap_hier_destroy(bitmap_hier_t *hier) {
+    if (hier) {
+        if (!hier->wrapped) {
+            bitmap_destroy(hier->bitmap);
+        }
+        free(hier->level[0]);
+        free(hier);
     }
 }
 
@@ -200,33 +1029,37 @@ void bitmap_destroy(bitmap_t *bitmap) {
 
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
     if (n_bits) {  // must be non-zero
-        bitmap_t *bitmap = (bitmap_t *) malloc(sizeof(bitmap_t));
-        if (bitmap) {
-            bitmap->flags         = flags;
-            bitmap->bit_count     = n_bits;
-            bitmap->byte_count    = n_bits >> 3;
-            bitmap->leftover_bits = n_bits & 0x07;
-            bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
-
-            // FLAG HANDLING HERE
-
-            // This logic will need to be reworked when we have more than one flag, haha
-            // Maybe something like if (flags) and then contain a giant if/else-if for each flag
-            // Then a return at the end
-
-            if (FLAG_CHECK(bitmap, OVERLAY)) {
+        // An overlay's data is the caller's, ours goes in the same allocation as the header (zeroed)
+        if (flags & OVERLAY) {
+            bitmap_t *bitmap = (bitmap_t *) malloc(sizeof(bitmap_t));
+            if (bitmap) {
+                bitmap->flags      = flags;
+                bitmap->bit_count  = n_bits;
+                bitmap->byte_count = (n_bits + 7) >> 3;
+                // An overlay can only count on byte_count bytes being there, ours get padded to whole words
+                bitmap->word_count = bitmap->byte_count >> 3;
                 // don't mess with data, caller will set it
                 bitmap->data = NULL;
-                return bitmap;
-            } else {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
-                if (bitmap->data) {
-                    return bitmap;
-                }
             }
-
-            free(bitmap);
+            return bitmap;
+        }
+        void *memory = calloc(1, bitmap_footprint(n_bits));
+        if (memory) {
+            return bitmap_initialize_at(memory, n_bits, flags);
         }
     }
     return NULL;
 }
+
+static bitmap_t *bitmap_initialize_at(void *const memory, size_t n_bits, BITMAP_FLAGS flags) {
+    if (n_bits) {
+        bitmap_t *bitmap   = (bitmap_t *) memory;
+        bitmap->flags      = flags;
+        bitmap->bit_count  = n_bits;
+        bitmap->byte_count = (n_bits + 7) >> 3;
+        bitmap->word_count = (n_bits + 63) >> 6;
+        bitmap->data       = (uint8_t *) (bitmap + 1);
+        return bitmap;
+    }
+    return NULL;
+}
@@ -1,195 +1,4169 @@
+// For open/writev/mmap and friends, and syscall (io_uring has no libc wrapper)
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <zlib.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_DISPATCH 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC32 1
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+// linux/fs.h (by way of io_uring.h) has a BLOCK_SIZE of its own, ours is below
+#undef BLOCK_SIZE
+#endif
 #include "block_store.h"
 #include "bitmap.h"
 
-// Define these here instead of hardcoding to keep program scalable
-#define BLOCK_SIZE 256
-#define BLOCK_COUNT 256
+// Define these here instead of hardcoding to keep program scalable
+// (these are just the defaults for block_store_create, see block_store_create_ex)
+#define BLOCK_SIZE 256
+#define BLOCK_COUNT 256
+
+// The slab is aligned to a cache line, so with block sizes >= 64 every block starts on one
+#define SLAB_ALIGNMENT 64
+
+// Concurrent mode splits the fbm into (at most) this many allocation regions, see thread_region
+// A region is at least a cache line of fbm words so neighbouring regions don't fight over one
+#define ALLOC_REGIONS 64
+#define REGION_MIN_BITS 512
+
+// Define block_store_t
+typedef struct block_store {
+    size_t block_size;
+    size_t block_count;   // Every block id, including the ones holding the fbm
+    size_t total_blocks;  // User-addressable blocks, the fbm takes up the rest at the end
+    unsigned block_shift;  // log2(block_size), block n lives at data + (n << block_shift)
+    // One contiguous slab for the whole device, the fbm's data is overlaid on its last block(s)
+    // When mapped, this points into the image and the fbm overlays the image's copy instead
+    uint8_t* data;
+    bitmap_t* fbm;             // Free block map
+    bitmap_hier_t* fbm_index;  // Summary over the fbm when using BS_FBM_HIER, NULL when flat
+    // The whole image when opened with block_store_open_mmap, NULL for heap devices
+    uint8_t* map;
+    size_t map_size;
+    atomic_size_t dirty_start, dirty_end;  // Range of data written since the last sync (mapped only)
+    // Outstanding block_store_view/mut pointers. Anything that would move blocks has to wait for zero
+    atomic_size_t pins;
+    bool concurrent;  // See block_store_set_concurrent, the fbm is atomic and allocation is lock-free
+    // Concurrent mode allocation regions, and where in each one its threads start searching
+    atomic_size_t* region_hints;
+    size_t region_count, region_bits;
+    block_store_alloc_policy_t alloc_policy;
+    size_t alloc_cursor;  // Where the next BS_ALLOC_NEXT_FIT search starts
+    // User blocks in use, kept up to date by the fbm helpers so nobody has to count the bitmap
+    atomic_size_t used_blocks;
+    struct journal* journal;  // See block_store_journal_open, NULL when not journaled
+    bitmap_t* dirty;          // User blocks written since the last block_store_serialize_incremental
+    int fd;                   // The image a mapped or cached device was opened from, -1 for heap devices
+    struct async_io* async;   // Set up by the first block_store_read_async/write_async
+    struct block_cache* cache;  // See block_store_open_cached, NULL when the blocks are all in memory
+    struct lazy_load* lazy;     // See block_store_open_lazy, NULL once destroyed or when not lazy
+    uint32_t* checksums;        // CRC32C of every user block, see block_store_set_checksums, NULL when off
+    char* image_path;           // The image a mapped device was opened from, its checksums go next to it
+    struct cold_tier* cold;     // See block_store_set_cold_tier, NULL when off
+    struct shared_slab* share;  // The slab shared with snapshots of the device, NULL until the first one
+    struct snapshot* snapshot;  // Set when this is a snapshot, see block_store_snapshot
+    struct stats* stats;        // See block_store_set_stats, NULL when off
+} block_store_t;
+
+// Every thread gets a slot the first time it allocates in concurrent mode (or counts stats),
+// which picks the region it starts in and the stats shard it counts in on every device
+static atomic_size_t next_thread_slot;
+static _Thread_local size_t thread_slot = SIZE_MAX;
+
+static inline size_t thread_index(void) {
+    if (thread_slot == SIZE_MAX) {
+        thread_slot = atomic_fetch_add_explicit(&next_thread_slot, 1, memory_order_relaxed);
+    }
+    return thread_slot;
+}
+
+static inline size_t thread_region(const block_store_t* const bs) {
+    return thread_index() % bs->region_count;
+}
+
+// CAS loops to move a shared value only one way
+static inline void atomic_size_min(atomic_size_t* const target, const size_t value) {
+    size_t current = atomic_load_explicit(target, memory_order_relaxed);
+    while (value < current && !atomic_compare_exchange_weak_explicit(target, &current, value, memory_order_relaxed,
+                                                                     memory_order_relaxed)) {
+    }
+}
+
+static inline void atomic_size_max(atomic_size_t* const target, const size_t value) {
+    size_t current = atomic_load_explicit(target, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(target, &current, value, memory_order_relaxed,
+                                                                     memory_order_relaxed)) {
+    }
+}
+
+//
+// Operation stats, see block_store_set_stats
+// Each thread counts in the shard its slot picks (slot % STATS_SHARDS), and slots aren't reused, so threads
+// STATS_SHARDS slots apart share counters and contend on them. The counters are relaxed atomics for that.
+// block_store_get_stats adds the shards up.
+//
+
+#define STATS_SHARDS 16
+
+typedef struct {
+    atomic_size_t total_ns, min_ns, max_ns;
+    atomic_size_t buckets[BS_LATENCY_BUCKETS];
+} stats_latency_t;
+
+typedef struct {
+    _Alignas(SLAB_ALIGNMENT) atomic_size_t calls[BS_STAT_OPS];
+    atomic_size_t failures[BS_STAT_OPS];
+    atomic_size_t bytes_read, bytes_written, bytes_serialized, ffz_words;
+    stats_latency_t latency[BS_STAT_OPS];
+} stats_shard_t;
+
+typedef struct stats {
+    stats_shard_t shards[STATS_SHARDS];
+} stats_t;
+
+static inline void stats_add(atomic_size_t* const counter, const size_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline size_t stats_load(const atomic_size_t* const counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// When a counted call started, in nanoseconds. Stats off doesn't read the clock
+static inline uint64_t stats_start(const block_store_t* const bs) {
+    struct timespec now = {0, 0};
+    if (bs->stats) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+// Histogram bucket of a latency, see BS_LATENCY_BUCKETS
+static inline size_t latency_bucket(const uint64_t ns) {
+    if (ns < 8) {
+        return ns;
+    }
+    const unsigned octave = 63 - __builtin_clzll(ns);
+    const size_t bucket   = ((size_t)(octave - 2) << 3) + ((ns >> (octave - 3)) & 7);
+    return bucket < BS_LATENCY_BUCKETS ? bucket : BS_LATENCY_BUCKETS - 1;
+}
+
+// The lowest latency that goes in a bucket
+static inline size_t latency_bucket_floor(const size_t bucket) {
+    return bucket < 8 ? bucket : (8 + (bucket & 7)) << ((bucket >> 3) - 1);
+}
+
+// Counts a call of op that started at start, returned bytes (for the ops that move any) and maybe failed
+static void stats_record(const block_store_t* const bs, const block_store_stat_op_t op, const uint64_t start,
+                         const size_t bytes, const bool failed) {
+    if (!bs->stats) {
+        return;
+    }
+    const uint64_t ns           = stats_start(bs) - start;
+    stats_shard_t* const shard  = &bs->stats->shards[thread_index() % STATS_SHARDS];
+    stats_latency_t* const hist = &shard->latency[op];
+    stats_add(&shard->calls[op], 1);
+    if (failed) {
+        stats_add(&shard->failures[op], 1);
+    }
+    if (op == BS_STAT_READ) {
+        stats_add(&shard->bytes_read, bytes);
+    } else if (op == BS_STAT_WRITE) {
+        stats_add(&shard->bytes_written, bytes);
+    } else if (op == BS_STAT_SERIALIZE) {
+        stats_add(&shard->bytes_serialized, bytes);
+    }
+    stats_add(&hist->total_ns, ns);
+    atomic_size_min(&hist->min_ns, ns);
+    atomic_size_max(&hist->max_ns, ns);
+    stats_add(&hist->buckets[latency_bucket(ns)], 1);
+}
+
+// Same for an allocation, which also counts the fbm words this thread searched since scanned
+static void stats_record_alloc(const block_store_t* const bs, const uint64_t start, const size_t scanned,
+                               const bool failed) {
+    if (bs->stats) {
+        stats_add(&bs->stats->shards[thread_index() % STATS_SHARDS].ffz_words, bitmap_scanned_words() - scanned);
+        stats_record(bs, BS_STAT_ALLOCATE, start, 0, failed);
+    }
+}
+
+// Number of bytes in the fbm for the given block count
+static inline size_t fbm_bytes(const size_t block_count) {
+    return (block_count >> 3) + ((block_count & 0x07) ? 1 : 0);
+}
+
+// Number of blocks it takes to hold the fbm at the end of the device
+static inline size_t fbm_blocks(const size_t block_size, const size_t block_count) {
+    return (fbm_bytes(block_count) / block_size) + ((fbm_bytes(block_count) % block_size) ? 1 : 0);
+}
+
+// Block size has to be a power of two, and the fbm has to leave room for user blocks
+// (also leave room to round the slab up to the alignment)
+static bool geometry_valid(const size_t block_size, const size_t block_count) {
+    return block_size && !(block_size & (block_size - 1))
+           && block_count <= (SIZE_MAX - SLAB_ALIGNMENT) / block_size
+           && block_count > fbm_blocks(block_size, block_count);
+}
+
+// Allocates the device header for the given geometry, storage is up to the caller
+// The dirty map lives right after the header, in the same allocation
+static block_store_t* block_store_alloc(const size_t block_size, const size_t block_count) {
+    const size_t total_blocks = block_count - fbm_blocks(block_size, block_count);
+    const size_t dirty_bytes  = bitmap_footprint(total_blocks);
+    block_store_t* bs = dirty_bytes <= SIZE_MAX - sizeof(block_store_t)
+                            ? calloc(1, sizeof(block_store_t) + dirty_bytes)
+                            : NULL;
+    if (bs) {
+        bs->block_size   = block_size;
+        bs->block_count  = block_count;
+        bs->total_blocks = total_blocks;
+        bs->block_shift  = __builtin_ctzll(block_size);
+        atomic_init(&bs->dirty_start, SIZE_MAX);
+        atomic_init(&bs->dirty_end, 0);
+        atomic_init(&bs->pins, 0);
+        bs->fd    = -1;
+        bs->dirty = bitmap_create_inline(bs + 1, total_blocks);
+    }
+    return bs;
+}
+
+//
+// Snapshots, see block_store_snapshot
+// A device and its snapshots share the device's slab. A snapshot reads every block from it until the
+// block would change, then gets a page (a copy of the block) instead. When the device writes a block,
+// its old data goes to one page shared by every snapshot that was still reading it from the slab.
+// When a snapshot writes one, it makes the page its own first, copying it if anybody else has it.
+// Pages are refcounted, and so is the slab: it outlives the device until the last snapshot is gone.
+// Snapshot reads hold the lock for reading, handing out pages takes it for writing. The device only
+// takes it the first time it writes each block since the last snapshot, everything after is free.
+//
+
+// Most iovecs a snapshot's image_write hands writev at once
+#define SNAPSHOT_BATCH 64
+
+typedef struct snapshot_page {
+    atomic_size_t refs;  // Snapshots with this page, the block's data starts SLAB_ALIGNMENT bytes in
+} snapshot_page_t;
+
+typedef struct shared_slab {
+    pthread_rwlock_t lock;
+    atomic_size_t refs;  // The device (until it's destroyed) and each of its snapshots
+    uint8_t* data;
+    // Blocks some snapshot may still read from the slab. Concurrent mode, the device tests it without the lock
+    bitmap_t* shared;
+    struct snapshot* snapshots;  // Every live snapshot of the device
+} shared_slab_t;
+
+typedef struct snapshot {
+    shared_slab_t* slab;
+    struct snapshot* next;
+    snapshot_page_t** pages;  // Each user block's page, NULL while it's read from the slab
+    bitmap_t* copied;         // Blocks with a page, as many bits as the fbm so the two line up (stored after us)
+} snapshot_t;
+
+static inline uint8_t* page_data(snapshot_page_t* const page) {
+    return (uint8_t*) page + SLAB_ALIGNMENT;
+}
+
+// A page with one reference, or NULL
+static snapshot_page_t* page_alloc(const block_store_t* const bs) {
+    const size_t size = (SLAB_ALIGNMENT + bs->block_size + SLAB_ALIGNMENT - 1) & ~(size_t)(SLAB_ALIGNMENT - 1);
+    snapshot_page_t* const page = aligned_alloc(SLAB_ALIGNMENT, size);
+    if (page) {
+        atomic_init(&page->refs, 1);
+    }
+    return page;
+}
+
+static void page_put(snapshot_page_t* const page) {
+    if (page && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+static inline uint8_t* snapshot_address(const block_store_t* const bs, const size_t block_id) {
+    snapshot_page_t* const page = bs->snapshot->pages[block_id];
+    return page ? page_data(page) : bs->data + (block_id << bs->block_shift);
+}
+
+// Snapshot reads happen between these, so the device can't change a block they still share meanwhile
+static inline void snapshot_read_begin(const block_store_t* const bs) {
+    if (bs->snapshot) {
+        pthread_rwlock_rdlock(&bs->snapshot->slab->lock);
+    }
+}
+
+static inline void snapshot_read_end(const block_store_t* const bs) {
+    if (bs->snapshot) {
+        pthread_rwlock_unlock(&bs->snapshot->slab->lock);
+    }
+}
+
+// Hands the block's current data to every snapshot still reading it from the slab, before the device changes it
+static bool snapshot_preserve(const block_store_t* const bs, const size_t block_id) {
+    shared_slab_t* const slab = bs->share;
+    if (!slab || !bitmap_test(slab->shared, block_id)) {
+        return true;
+    }
+    pthread_rwlock_wrlock(&slab->lock);
+    snapshot_page_t* page = NULL;
+    bool success          = true;
+    for (snapshot_t* snapshot = slab->snapshots; success && snapshot; snapshot = snapshot->next) {
+        if (snapshot->pages[block_id]) {
+            continue;
+        }
+        if (page) {
+            atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+        } else if ((page = page_alloc(bs))) {
+            memcpy(page_data(page), bs->data + (block_id << bs->block_shift), bs->block_size);
+        } else {
+            success = false;
+            break;
+        }
+        snapshot->pages[block_id] = page;
+        bitmap_set(snapshot->copied, block_id);
+    }
+    if (success) {
+        bitmap_reset(slab->shared, block_id);
+    }
+    pthread_rwlock_unlock(&slab->lock);
+    return success;
+}
+
+// Gives a snapshot a page of its own for the block before it writes it, with the block's data if need_data
+static bool snapshot_own(const block_store_t* const bs, const size_t block_id, const bool need_data) {
+    snapshot_t* const snapshot = bs->snapshot;
+    shared_slab_t* const slab  = snapshot->slab;
+    // Once a page is only ours nobody else can get at it, so there's nothing to do
+    pthread_rwlock_rdlock(&slab->lock);
+    snapshot_page_t* page = snapshot->pages[block_id];
+    bool owned            = page && atomic_load_explicit(&page->refs, memory_order_acquire) == 1;
+    pthread_rwlock_unlock(&slab->lock);
+    if (owned) {
+        return true;
+    }
+    pthread_rwlock_wrlock(&slab->lock);
+    page  = snapshot->pages[block_id];
+    owned = page && atomic_load_explicit(&page->refs, memory_order_acquire) == 1;
+    if (!owned) {
+        snapshot_page_t* const own = page_alloc(bs);
+        if ((owned = own != NULL)) {
+            if (need_data) {
+                memcpy(page_data(own), snapshot_address(bs, block_id), bs->block_size);
+            }
+            page_put(page);
+            snapshot->pages[block_id] = own;
+            bitmap_set(snapshot->copied, block_id);
+        }
+    }
+    pthread_rwlock_unlock(&slab->lock);
+    return owned;
+}
+
+// Everything that changes a block goes through here first, once it's faulted in
+static inline bool snapshot_write(const block_store_t* const bs, const size_t block_id, const bool need_data) {
+    return bs->snapshot ? snapshot_own(bs, block_id, need_data) : snapshot_preserve(bs, block_id);
+}
+
+static void slab_put(shared_slab_t* const slab) {
+    if (atomic_fetch_sub_explicit(&slab->refs, 1, memory_order_acq_rel) == 1) {
+        bitmap_destroy(slab->shared);
+        pthread_rwlock_destroy(&slab->lock);
+        free(slab->data);
+        free(slab);
+    }
+}
+
+// Lets go of a snapshot's pages and its share of the slab
+static void snapshot_destroy(block_store_t* const bs) {
+    snapshot_t* const snapshot = bs->snapshot;
+    shared_slab_t* const slab  = snapshot->slab;
+    pthread_rwlock_wrlock(&slab->lock);
+    snapshot_t** link = &slab->snapshots;
+    while (*link != snapshot) {
+        link = &(*link)->next;
+    }
+    *link = snapshot->next;
+    // The device doesn't have to look for snapshots to give its blocks to anymore
+    if (!slab->snapshots) {
+        bitmap_reset_range(slab->shared, 0, bs->block_count);
+    }
+    pthread_rwlock_unlock(&slab->lock);
+    for (size_t i = 0; i < bs->total_blocks; i++) {
+        page_put(snapshot->pages[i]);
+    }
+    free(snapshot->pages);
+    free(snapshot);
+    bs->snapshot = NULL;
+    bs->data     = NULL;
+    slab_put(slab);
+}
+
+// Number of live snapshots of the device
+static size_t snapshot_count(const block_store_t* const bs) {
+    shared_slab_t* const slab = bs->share;
+    size_t count              = 0;
+    if (slab) {
+        pthread_rwlock_rdlock(&slab->lock);
+        for (const snapshot_t* snapshot = slab->snapshots; snapshot; snapshot = snapshot->next) {
+            count++;
+        }
+        pthread_rwlock_unlock(&slab->lock);
+    }
+    return count;
+}
+
+// Address of the given block in the slab (a snapshot's may be in a page of its own)
+static inline uint8_t* block_address(const block_store_t* const bs, const size_t block_id) {
+    if (bs->snapshot) {
+        return snapshot_address(bs, block_id);
+    }
+    return bs->data + (block_id << bs->block_shift);
+}
+
+//
+// Serialized image format
+//  [header][fbm][zero padding][user blocks]
+// The block data starts on an IMAGE_ALIGNMENT boundary so it can be mapped or read directly.
+// Fields are written in native byte order.
+//
+
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGNMENT 4096
+
+static const char image_magic[8] = "BSIMAGE";
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t block_size;
+    uint64_t block_count;  // Including the fbm's blocks, same as block_store_create_ex
+    uint64_t fbm_offset;
+    uint64_t fbm_bytes;
+    uint64_t data_offset;
+    uint64_t data_bytes;  // User blocks only, the fbm's blocks are not stored
+} image_header_t;
+
+// The header describing a device of the given geometry
+static void image_header_fill(image_header_t* const header, const size_t block_size, const size_t block_count) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, image_magic, sizeof(header->magic));
+    header->version     = IMAGE_VERSION;
+    header->header_size = sizeof(*header);
+    header->block_size  = block_size;
+    header->block_count = block_count;
+    header->fbm_offset  = sizeof(*header);
+    header->fbm_bytes   = fbm_bytes(block_count);
+    header->data_offset = header->fbm_offset + header->fbm_bytes;
+    header->data_offset = (header->data_offset + IMAGE_ALIGNMENT - 1) & ~(uint64_t)(IMAGE_ALIGNMENT - 1);
+    header->data_bytes  = (uint64_t)(block_count - fbm_blocks(block_size, block_count)) * block_size;
+}
+
+// Moves the iovec array past the first done bytes, dropping anything that's complete (or was empty)
+static void iov_advance(struct iovec** iov, int* iovcnt, size_t done) {
+    while (*iovcnt && done >= (*iov)->iov_len) {
+        done -= (*iov)->iov_len;
+        ++*iov;
+        --*iovcnt;
+    }
+    if (*iovcnt) {
+        (*iov)->iov_base = (uint8_t*) (*iov)->iov_base + done;
+        (*iov)->iov_len -= done;
+    }
+}
+
+// writev/readv until it's all done, they're allowed to stop short (and will past 2GiB on Linux)
+static bool write_all(const int fd, struct iovec* iov, int iovcnt) {
+    for (iov_advance(&iov, &iovcnt, 0); iovcnt;) {
+        const ssize_t done = writev(fd, iov, iovcnt);
+        if (done <= 0) {
+            return false;
+        }
+        iov_advance(&iov, &iovcnt, done);
+    }
+    return true;
+}
+
+static bool read_all(const int fd, struct iovec* iov, int iovcnt) {
+    for (iov_advance(&iov, &iovcnt, 0); iovcnt;) {
+        const ssize_t done = readv(fd, iov, iovcnt);
+        if (done <= 0) {
+            return false;  // Error or the file is short
+        }
+        iov_advance(&iov, &iovcnt, done);
+    }
+    return true;
+}
+
+// Reads the header and makes sure it's ours, describes a device we can make,
+// and that the file is big enough before anyone allocates or maps whatever it claims to need
+static bool image_header_read(const int fd, image_header_t* const header) {
+    struct iovec iov = {header, sizeof(*header)};
+    if (!read_all(fd, &iov, 1) || memcmp(header->magic, image_magic, sizeof(header->magic)) != 0
+        || header->version != IMAGE_VERSION || header->block_size > SIZE_MAX || header->block_count > SIZE_MAX
+        || !geometry_valid(header->block_size, header->block_count)) {
+        return false;
+    }
+    // Every other field follows from the geometry
+    image_header_t expected;
+    image_header_fill(&expected, header->block_size, header->block_count);
+    struct stat info;
+    return memcmp(header, &expected, sizeof(expected)) == 0 && fstat(fd, &info) == 0
+           && (uint64_t) info.st_size >= header->data_offset + header->data_bytes;
+}
+
+// pread until it's all done, same as read_all
+static bool pread_all(const int fd, void* const buffer, const size_t length, const size_t offset) {
+    for (size_t done_total = 0; done_total < length;) {
+        const ssize_t done = pread(fd, (uint8_t*) buffer + done_total, length - done_total, offset + done_total);
+        if (done <= 0) {
+            return false;  // Error or the file is short
+        }
+        done_total += done;
+    }
+    return true;
+}
+
+//
+// Block compression, for compressed images and the cold tier
+// Every block is compressed on its own (zlib at its fastest level), so any one of them can be
+// decompressed without the others. A block that doesn't get smaller is kept as it is,
+// and a frame as long as a block is always one of those.
+//
+// Compressed image format
+//  [header][fbm][index][frames]
+// The index has an offset into the file for every user block plus one past the last frame:
+// block n's frame is [index[n], index[n + 1]). Fields are in native byte order, like the plain image.
+//
+
+#define COMPRESSED_VERSION 1
+// block_store_serialize_compressed collects this much of the frames before writing them out
+#define COMPRESSED_BUFFER (256 * 1024)
+
+static const char compressed_magic[8] = "BSIMGZ";
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t block_size;
+    uint64_t block_count;  // Including the fbm's blocks, same as block_store_create_ex
+    uint64_t fbm_offset;
+    uint64_t fbm_bytes;
+    uint64_t index_offset;
+    uint64_t data_offset;  // The first frame
+} compressed_header_t;
+
+// Room for any block's frame
+static inline size_t frame_bound(const block_store_t* const bs) {
+    return compressBound(bs->block_size);
+}
+
+// Compresses a block into frame (frame_bound bytes), returns the frame's length
+static size_t block_encode(const block_store_t* const bs, const uint8_t* const block, uint8_t* const frame) {
+    uLongf length = frame_bound(bs);
+    if (compress2(frame, &length, block, bs->block_size, Z_BEST_SPEED) != Z_OK || length >= bs->block_size) {
+        memcpy(frame, block, bs->block_size);
+        return bs->block_size;
+    }
+    return length;
+}
+
+// The other way around, false if the frame is damaged
+static bool block_decode(const block_store_t* const bs, const uint8_t* const frame, const size_t length,
+                         uint8_t* const block) {
+    if (length == bs->block_size) {
+        memcpy(block, frame, length);
+        return true;
+    }
+    uLongf block_length = bs->block_size;
+    return length < bs->block_size && uncompress(block, &block_length, frame, length) == Z_OK
+           && block_length == bs->block_size;
+}
+
+// Whether fd holds a compressed image rather than a plain one
+static bool image_compressed(const int fd) {
+    char magic[sizeof(compressed_magic)];
+    return pread(fd, magic, sizeof(magic), 0) == (ssize_t) sizeof(magic)
+           && memcmp(magic, compressed_magic, sizeof(magic)) == 0;
+}
+
+// Reads and checks a compressed image's header and index, the same way image_header_read does
+// Returns the index (caller frees), NULL if it isn't a good image
+static uint64_t* compressed_header_read(const int fd, compressed_header_t* const header) {
+    if (!pread_all(fd, header, sizeof(*header), 0) || memcmp(header->magic, compressed_magic, sizeof(header->magic))
+        || header->version != COMPRESSED_VERSION || header->header_size != sizeof(*header)
+        || header->block_size > SIZE_MAX || header->block_count > SIZE_MAX
+        || !geometry_valid(header->block_size, header->block_count)) {
+        return NULL;
+    }
+    const size_t user_blocks = header->block_count - fbm_blocks(header->block_size, header->block_count);
+    const size_t index_bytes = (user_blocks + 1) * sizeof(uint64_t);
+    struct stat info;
+    if (header->fbm_offset != sizeof(*header) || header->fbm_bytes != fbm_bytes(header->block_count)
+        || header->index_offset != header->fbm_offset + header->fbm_bytes
+        || header->data_offset != header->index_offset + index_bytes || fstat(fd, &info)) {
+        return NULL;
+    }
+    // Every frame has to be in the file, and no longer than a block
+    uint64_t* const index = malloc(index_bytes);
+    bool valid            = index && pread_all(fd, index, index_bytes, header->index_offset)
+                 && index[0] == header->data_offset && index[user_blocks] <= (uint64_t) info.st_size;
+    for (size_t i = 0; valid && i < user_blocks; i++) {
+        valid = index[i] < index[i + 1] && index[i + 1] - index[i] <= header->block_size;
+    }
+    if (!valid) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+//
+// Lazy loading for devices opened with block_store_open_lazy
+// The slab is allocated up front but a block is only read from the image the first time it's needed
+// (or by the prefetch thread, whichever gets there first). The loaded map is only touched under the lock,
+// so the prefetcher and any number of users can fault blocks in at once. Once everything is in,
+// complete is set and the lock is out of the picture.
+//
+
+// Blocks the prefetcher loads per trip through the lock, so a fault never waits long behind it
+#define PREFETCH_RUN 64
+
+typedef struct lazy_load {
+    pthread_mutex_t lock;
+    int fd;              // The image
+    size_t data_offset;  // Where block 0 starts in it
+    uint64_t* index;     // Where each block's frame is, if the image is compressed (NULL if not)
+    uint8_t* frame;      // frame_bound bytes to read a frame into
+    bitmap_t* loaded;    // User blocks that are in the slab
+    size_t remaining;    // User blocks that aren't
+    atomic_bool complete;
+    bitmap_t* order;     // The blocks in use at open, the prefetcher warms those first
+    pthread_t prefetcher;
+    bool prefetching;
+    atomic_bool stop;
+} lazy_load_t;
+
+// Loads whatever isn't loaded yet in [start, end), one pread per run. Call with the lock held
+// (only user blocks are in the image's data, the fbm was read in at open)
+static bool lazy_load_range(const block_store_t* const bs, const size_t start, const size_t end) {
+    lazy_load_t* const lazy = bs->lazy;
+    if (end > bs->total_blocks) {
+        return false;
+    }
+    for (size_t block = start; block < end;) {
+        if (bitmap_test(lazy->loaded, block)) {
+            block++;
+            continue;
+        }
+        // A compressed block is one frame to read and decompress, it can't share a read with the next
+        if (lazy->index) {
+            const size_t length = lazy->index[block + 1] - lazy->index[block];
+            if (!pread_all(lazy->fd, lazy->frame, length, lazy->index[block])
+                || !block_decode(bs, lazy->frame, length, block_address(bs, block))) {
+                return false;
+            }
+            bitmap_set(lazy->loaded, block);
+            lazy->remaining--;
+            block++;
+            continue;
+        }
+        size_t run_end = block + 1;
+        while (run_end < end && !bitmap_test(lazy->loaded, run_end)) {
+            run_end++;
+        }
+        if (!pread_all(lazy->fd, block_address(bs, block), (run_end - block) << bs->block_shift,
+                       lazy->data_offset + (block << bs->block_shift))) {
+            return false;
+        }
+        bitmap_set_range(lazy->loaded, block, run_end - block);
+        lazy->remaining -= run_end - block;
+        block = run_end;
+    }
+    if (!lazy->remaining) {
+        atomic_store_explicit(&lazy->complete, true, memory_order_release);
+    }
+    return true;
+}
+
+// Makes sure a block is in the slab before it's used. A block that's about to be overwritten
+// whole doesn't need what was in the image, it just stops anything else from loading over it
+static bool lazy_fault(const block_store_t* const bs, const size_t block_id, const bool need_data) {
+    lazy_load_t* const lazy = bs->lazy;
+    if (!lazy || atomic_load_explicit(&lazy->complete, memory_order_acquire)) {
+        return true;
+    }
+    pthread_mutex_lock(&lazy->lock);
+    bool success = true;
+    if (need_data) {
+        success = lazy_load_range(bs, block_id, block_id + 1);
+    } else if (!bitmap_test(lazy->loaded, block_id)) {
+        bitmap_set(lazy->loaded, block_id);
+        if (!--lazy->remaining) {
+            atomic_store_explicit(&lazy->complete, true, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&lazy->lock);
+    return success;
+}
+
+// Loads everything, for whatever needs the whole slab at once
+static bool lazy_load_all(const block_store_t* const bs) {
+    lazy_load_t* const lazy = bs->lazy;
+    if (!lazy || atomic_load_explicit(&lazy->complete, memory_order_acquire)) {
+        return true;
+    }
+    pthread_mutex_lock(&lazy->lock);
+    const bool success = lazy_load_range(bs, 0, bs->total_blocks);
+    pthread_mutex_unlock(&lazy->lock);
+    return success;
+}
+
+// Warms the blocks that were in use first, in bitmap order, then everything else
+static void* lazy_prefetcher(void* const arg) {
+    const block_store_t* const bs = arg;
+    lazy_load_t* const lazy       = bs->lazy;
+    bitmap_iter_t it;
+    bitmap_iter_init(&it, lazy->order);
+    for (size_t block = bitmap_next_set(&it); block < bs->total_blocks;) {
+        // The order is a copy of the whole fbm, so a run can't go on into the fbm's own blocks
+        size_t end = block + 1, next;
+        while ((next = bitmap_next_set(&it)) == end && end < bs->total_blocks && end - block < PREFETCH_RUN) {
+            end++;
+        }
+        if (atomic_load_explicit(&lazy->stop, memory_order_relaxed)) {
+            return NULL;
+        }
+        pthread_mutex_lock(&lazy->lock);
+        lazy_load_range(bs, block, end);
+        pthread_mutex_unlock(&lazy->lock);
+        block = next;
+    }
+    for (size_t block = 0; block < bs->total_blocks && !atomic_load_explicit(&lazy->complete, memory_order_acquire)
+                           && !atomic_load_explicit(&lazy->stop, memory_order_relaxed);
+         block += PREFETCH_RUN) {
+        pthread_mutex_lock(&lazy->lock);
+        lazy_load_range(bs, block, block + PREFETCH_RUN < bs->total_blocks ? block + PREFETCH_RUN : bs->total_blocks);
+        pthread_mutex_unlock(&lazy->lock);
+    }
+    return NULL;
+}
+
+// Stops the prefetcher and lets go of the image (whatever wasn't loaded is gone with it)
+static void lazy_destroy(block_store_t* const bs) {
+    lazy_load_t* const lazy = bs->lazy;
+    if (!lazy) {
+        return;
+    }
+    if (lazy->prefetching) {
+        atomic_store_explicit(&lazy->stop, true, memory_order_relaxed);
+        pthread_join(lazy->prefetcher, NULL);
+    }
+    bs->lazy = NULL;
+    bitmap_destroy(lazy->order);
+    bitmap_destroy(lazy->loaded);
+    pthread_mutex_destroy(&lazy->lock);
+    close(lazy->fd);
+    free(lazy->frame);
+    free(lazy->index);
+    free(lazy);
+}
+
+//
+// Cold tier, see block_store_set_cold_tier
+// block_store_compact_cold compresses every block that hasn't been used since the last time it ran.
+// A cold block's data is only its frame, and once every block sharing a page of the slab is cold
+// the page goes back to the system. Using a cold block decompresses it back into the slab.
+// Everything goes through the lock, so with the tier on every access takes it.
+//
+
+typedef struct cold_tier {
+    pthread_mutex_t lock;
+    bitmap_t* cold;      // User blocks that are only held as frames
+    bitmap_t* accessed;  // User blocks used since the last compaction
+    uint8_t** frames;    // Each cold block's frame, NULL for the rest
+    size_t* frame_bytes;
+    block_store_cold_stats_t stats;
+    uint8_t* scratch;  // frame_bound bytes to compress into
+} cold_tier_t;
+
+// Makes sure a block is back in the slab before it's used, like lazy_fault
+static bool cold_fault(const block_store_t* const bs, const size_t block_id, const bool need_data) {
+    cold_tier_t* const cold = bs->cold;
+    if (!cold) {
+        return true;
+    }
+    pthread_mutex_lock(&cold->lock);
+    bitmap_set(cold->accessed, block_id);
+    bool success = true;
+    if (bitmap_test(cold->cold, block_id)) {
+        success = !need_data
+                  || block_decode(bs, cold->frames[block_id], cold->frame_bytes[block_id], block_address(bs, block_id));
+        if (success) {
+            free(cold->frames[block_id]);
+            cold->frames[block_id] = NULL;
+            cold->stats.blocks--;
+            cold->stats.bytes -= cold->frame_bytes[block_id];
+            bitmap_reset(cold->cold, block_id);
+        }
+    }
+    pthread_mutex_unlock(&cold->lock);
+    return success;
+}
+
+// Whether a block is cold right now (it may not be by the time the caller looks)
+static bool cold_test(const block_store_t* const bs, const size_t block_id) {
+    cold_tier_t* const cold = bs->cold;
+    if (!cold) {
+        return false;
+    }
+    pthread_mutex_lock(&cold->lock);
+    const bool result = bitmap_test(cold->cold, block_id);
+    pthread_mutex_unlock(&cold->lock);
+    return result;
+}
+
+// A block's data without warming it up: the slab, or the frame decompressed into scratch (a block long)
+// NULL if the frame is damaged. Call with the lock held if there's a cold tier
+static const uint8_t* cold_peek(const block_store_t* const bs, const size_t block_id, uint8_t* const scratch) {
+    const cold_tier_t* const cold = bs->cold;
+    if (!cold || !bitmap_test(cold->cold, block_id)) {
+        return block_address(bs, block_id);
+    }
+    return block_decode(bs, cold->frames[block_id], cold->frame_bytes[block_id], scratch) ? scratch : NULL;
+}
+
+// Gives back the pages of the slab that only cold blocks live in, in ranges of whole pages
+static void cold_release_pages(const block_store_t* const bs) {
+    const size_t page     = (size_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t base  = (uintptr_t) bs->data;
+    const uintptr_t first = (base + page - 1) & ~(uintptr_t)(page - 1);
+    const uintptr_t last  = (base + (bs->total_blocks << bs->block_shift)) & ~(uintptr_t)(page - 1);
+    uintptr_t run_start   = 0;
+    for (uintptr_t address = first; address <= last; address += page) {
+        const size_t block  = (address - base) >> bs->block_shift;
+        const size_t end    = ((address + page - 1 - base) >> bs->block_shift) + 1;
+        const bool all_cold = address < last && bitmap_all_set_range(bs->cold->cold, block, end - block);
+        if (all_cold && !run_start) {
+            run_start = address;
+        } else if (!all_cold && run_start) {
+            madvise((void*) run_start, address - run_start, MADV_DONTNEED);
+            run_start = 0;
+        }
+    }
+}
+
+static void cold_destroy(block_store_t* const bs) {
+    cold_tier_t* const cold = bs->cold;
+    if (!cold) {
+        return;
+    }
+    bs->cold = NULL;
+    if (cold->frames) {
+        for (size_t i = 0; i < bs->total_blocks; i++) {
+            free(cold->frames[i]);
+        }
+    }
+    free(cold->frames);
+    free(cold->frame_bytes);
+    free(cold->scratch);
+    bitmap_destroy(cold->accessed);
+    bitmap_destroy(cold->cold);
+    pthread_mutex_destroy(&cold->lock);
+    free(cold);
+}
+
+// Every way a block gets used goes through here first
+static inline bool block_fault(const block_store_t* const bs, const size_t block_id, const bool need_data) {
+    return lazy_fault(bs, block_id, need_data) && cold_fault(bs, block_id, need_data);
+}
+
+// And every way a block gets changed goes through here instead
+static inline bool block_fault_write(const block_store_t* const bs, const size_t block_id, const bool need_data) {
+    return block_fault(bs, block_id, need_data) && snapshot_write(bs, block_id, need_data);
+}
+
+// image_write for a snapshot: the first three of iov, then the blocks from wherever they are.
+// The ones still in the slab go in runs, pages a batch at a time
+static bool snapshot_image_write(const block_store_t* const bs, const int fd, struct iovec* const iov) {
+    struct iovec batch[SNAPSHOT_BATCH];
+    int count = 0;
+    snapshot_read_begin(bs);
+    bool success = write_all(fd, iov, 3);
+    for (size_t block = 0; success && block < bs->total_blocks; block++) {
+        uint8_t* const data = block_address(bs, block);
+        if (count && (uint8_t*) batch[count - 1].iov_base + batch[count - 1].iov_len == data) {
+            batch[count - 1].iov_len += bs->block_size;
+            continue;
+        }
+        if (count == SNAPSHOT_BATCH) {
+            success = write_all(fd, batch, count);
+            count   = 0;
+        }
+        batch[count++] = (struct iovec){data, bs->block_size};
+    }
+    success = success && write_all(fd, batch, count);
+    snapshot_read_end(bs);
+    return success;
+}
+
+// Header, fbm, padding and every user block, all in a single writev
+// Returns the image size, 0 if the write failed
+static size_t image_write(const block_store_t* const bs, const int fd) {
+    static const uint8_t padding[IMAGE_ALIGNMENT];
+    if (!lazy_load_all(bs)) {
+        return 0;
+    }
+    image_header_t header;
+    image_header_fill(&header, bs->block_size, bs->block_count);
+    struct iovec iov[4] = {
+        {&header, sizeof(header)},
+        {(void*) bitmap_export(bs->fbm), header.fbm_bytes},
+        {(void*) padding, header.data_offset - header.fbm_offset - header.fbm_bytes},
+        {bs->data, header.data_bytes},
+    };
+    if (bs->snapshot) {
+        return snapshot_image_write(bs, fd, iov) ? header.data_offset + header.data_bytes : 0;
+    }
+    if (!bs->cold) {
+        return write_all(fd, iov, 4) ? header.data_offset + header.data_bytes : 0;
+    }
+
+    // With a cold tier, the runs of warm blocks come from the slab and the cold ones are decompressed
+    // on the way out, without warming them up
+    cold_tier_t* const cold = bs->cold;
+    pthread_mutex_lock(&cold->lock);
+    uint8_t* const scratch = malloc(bs->block_size);
+    bool success           = scratch && write_all(fd, iov, 3);
+    for (size_t block = 0; success && block < bs->total_blocks;) {
+        size_t end = block + 1;
+        if (bitmap_test(cold->cold, block)) {
+            struct iovec data = {(void*) cold_peek(bs, block, scratch), bs->block_size};
+            success           = data.iov_base && write_all(fd, &data, 1);
+        } else {
+            while (end < bs->total_blocks && !bitmap_test(cold->cold, end)) {
+                end++;
+            }
+            struct iovec data = {block_address(bs, block), (end - block) << bs->block_shift};
+            success           = write_all(fd, &data, 1);
+        }
+        block = end;
+    }
+    pthread_mutex_unlock(&cold->lock);
+    free(scratch);
+    return success ? header.data_offset + header.data_bytes : 0;
+}
+
+// pwrite until it's all done, same as write_all
+static bool pwrite_all(const int fd, const void* const buffer, const size_t length, const size_t offset) {
+    for (size_t written = 0; written < length;) {
+        const ssize_t done = pwrite(fd, (const uint8_t*) buffer + written, length - written, offset + written);
+        if (done <= 0) {
+            return false;
+        }
+        written += done;
+    }
+    return true;
+}
+
+// fsyncs the directory holding path, so a rename in it sticks
+static bool sync_parent(const char* const path) {
+    const char* const slash = strrchr(path, '/');
+    char* const dir         = slash ? strndup(path, (size_t)(slash - path) + 1) : strdup(".");
+    if (!dir) {
+        return false;
+    }
+    const int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0) {
+        return false;
+    }
+    const bool success = fsync(fd) == 0;
+    return close(fd) == 0 && success;
+}
+
+// Track what block_store_sync will need to flush, only mapped devices care
+// (writers can race on this in concurrent mode, so it only ever moves outwards)
+// The block goes in the dirty map for block_store_serialize_incremental either way
+static inline void mark_dirty(block_store_t* const bs, const size_t offset, const size_t length) {
+    if (bs->map) {
+        atomic_size_min(&bs->dirty_start, offset);
+        atomic_size_max(&bs->dirty_end, offset + length);
+    }
+    bitmap_set(bs->dirty, offset >> bs->block_shift);
+}
+
+// Adjusts the used block count. Only concurrent mode pays for a locked add,
+// otherwise nobody else is looking and a plain load and store will do
+static inline void used_add(block_store_t* const bs, const size_t count) {
+    if (bs->concurrent) {
+        atomic_fetch_add_explicit(&bs->used_blocks, count, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&bs->used_blocks, atomic_load_explicit(&bs->used_blocks, memory_order_relaxed) + count,
+                              memory_order_relaxed);
+    }
+}
+
+static inline void used_sub(block_store_t* const bs, const size_t count) {
+    if (bs->concurrent) {
+        atomic_fetch_sub_explicit(&bs->used_blocks, count, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&bs->used_blocks, atomic_load_explicit(&bs->used_blocks, memory_order_relaxed) - count,
+                              memory_order_relaxed);
+    }
+}
+
+// Counts the fbm from scratch, for when it's been loaded from somewhere
+static void used_recount(block_store_t* const bs) {
+    atomic_store_explicit(&bs->used_blocks, bitmap_total_set(bs->fbm) - (bs->block_count - bs->total_blocks),
+                          memory_order_relaxed);
+}
+
+// Every change to the fbm goes through these so the summary (if any) and the used count stay in sync
+// Clears a block, returns whether it was in use
+static inline bool fbm_reset(block_store_t* const bs, const size_t block_id) {
+    bool previous;
+    if (bs->fbm_index) {
+        previous = bitmap_hier_test(bs->fbm_index, block_id);
+        bitmap_hier_reset(bs->fbm_index, block_id);
+    } else {
+        previous = bitmap_test_and_reset(bs->fbm, block_id);
+    }
+    if (previous) {
+        used_sub(bs, 1);
+    }
+    return previous;
+}
+
+// Frees a block. In concurrent mode its region's threads go back to it first
+static inline void fbm_release(block_store_t* const bs, const size_t block_id) {
+    if (fbm_reset(bs, block_id) && bs->region_hints) {
+        atomic_size_min(&bs->region_hints[block_id / bs->region_bits], block_id);
+    }
+}
+
+// Finds a free block and marks it in use. The flat map does this atomically in concurrent mode
+static inline size_t fbm_claim(block_store_t* const bs) {
+    if (bs->region_hints) {
+        // Start where this thread's region left off. Running out of room there just wraps around
+        // into the other regions. Only move the hint along if it's ours and nobody moved it meanwhile
+        const size_t region   = thread_region(bs);
+        size_t hint           = atomic_load_explicit(&bs->region_hints[region], memory_order_relaxed);
+        const size_t block_id = bitmap_claim_zero_from(bs->fbm, hint);
+        if (block_id != SIZE_MAX) {
+            used_add(bs, 1);
+            if (block_id / bs->region_bits == region) {
+                atomic_compare_exchange_strong_explicit(&bs->region_hints[region], &hint, block_id,
+                                                        memory_order_relaxed, memory_order_relaxed);
+            }
+        }
+        return block_id;
+    }
+    if (bs->alloc_policy == BS_ALLOC_NEXT_FIT) {
+        // Resume after the last block we handed out (the summary is first-fit only, so scan the map itself)
+        size_t block_id;
+        if (bs->fbm_index) {
+            block_id = bitmap_ffz_from(bs->fbm, bs->alloc_cursor);
+            if (block_id != SIZE_MAX) {
+                bitmap_hier_set(bs->fbm_index, block_id);
+            }
+        } else {
+            block_id = bitmap_claim_zero_from(bs->fbm, bs->alloc_cursor);
+        }
+        if (block_id != SIZE_MAX) {
+            bs->alloc_cursor = block_id + 1;
+            used_add(bs, 1);
+        }
+        return block_id;
+    }
+    const size_t block_id = bs->fbm_index ? bitmap_hier_ffz(bs->fbm_index) : bitmap_claim_zero(bs->fbm);
+    if (block_id != SIZE_MAX) {
+        if (bs->fbm_index) {
+            bitmap_hier_set(bs->fbm_index, block_id);
+        }
+        used_add(bs, 1);
+    }
+    return block_id;
+}
+
+// Marks the block in use, returns whether it already was
+static inline bool fbm_test_and_set(block_store_t* const bs, const size_t block_id) {
+    bool previous;
+    if (bs->fbm_index) {
+        previous = bitmap_hier_test(bs->fbm_index, block_id);
+        bitmap_hier_set(bs->fbm_index, block_id);
+    } else {
+        previous = bitmap_test_and_set(bs->fbm, block_id);
+    }
+    if (!previous) {
+        used_add(bs, 1);
+    }
+    return previous;
+}
+
+//
+// Checksums
+// CRC32C (Castagnoli, the iSCSI/ext4 one) of every user block, see block_store_set_checksums.
+// x86-64 uses the SSE4.2 crc32 instruction when the CPU has it, ARMv8 its crc32c instructions when built
+// for them, everything else slicing-by-8 tables. The instruction has a latency of 3 cycles
+// but takes a new word every cycle, so long buffers are split into three interleaved streams
+// that get stitched back together at the end of every chunk.
+// The checksums of an image live next to it in <image>.crc, so the image format doesn't change.
+//
+
+#define CRC32C_POLY 0x82F63B78  // Reflected
+#define CHECKSUM_SUFFIX ".crc"
+// Bytes per stream in each chunk of the interleaved loop
+#define CRC32C_STRIDE 256
+
+static const char checksum_magic[8] = "BSCRC32";
+
+typedef struct {
+    char magic[8];
+    uint64_t block_size;
+    uint64_t block_count;
+    uint32_t checksum;  // Of the block checksums that follow
+    uint32_t reserved;
+} checksum_header_t;
+
+// Slicing tables, and the tables that move a CRC past CRC32C_STRIDE zero bytes (to stitch streams together)
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_stride_table[4][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Multiplies two polynomials modulo the CRC's, bit-reflected like the CRC itself (bit 31 is x^0)
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+static void crc32c_init(void) {
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        uint32_t crc = byte;
+        for (unsigned bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][byte] = crc;
+    }
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        for (unsigned slice = 1; slice < 8; slice++) {
+            const uint32_t previous     = crc32c_table[slice - 1][byte];
+            crc32c_table[slice][byte] = (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+        }
+    }
+    // x^(8 * CRC32C_STRIDE), squaring x^8 up to it (CRC32C_STRIDE is a power of two)
+    uint32_t shift = 1u << 23;
+    for (size_t bytes = 1; bytes < CRC32C_STRIDE; bytes <<= 1) {
+        shift = crc32c_multiply(shift, shift);
+    }
+    for (uint32_t byte = 0; byte < 256; byte++) {
+        for (unsigned lane = 0; lane < 4; lane++) {
+            crc32c_stride_table[lane][byte] = crc32c_multiply(byte << (lane * 8), shift);
+        }
+    }
+}
+
+// What the CRC register becomes after another CRC32C_STRIDE zero bytes
+static inline uint32_t crc32c_stride(const uint32_t crc) {
+    return crc32c_stride_table[0][crc & 0xFF] ^ crc32c_stride_table[1][(crc >> 8) & 0xFF]
+           ^ crc32c_stride_table[2][(crc >> 16) & 0xFF] ^ crc32c_stride_table[3][crc >> 24];
+}
+
+// These work on the raw register, the caller does the inversions
+static uint32_t crc32c_generic(uint32_t crc, const uint8_t* bytes, size_t length) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF]
+              ^ crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF]
+              ^ crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF]
+              ^ crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+    }
+#endif
+    for (; length; bytes++, length--) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *bytes) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(HAVE_X86_DISPATCH) || defined(HAVE_ARM_CRC32)
+#ifdef HAVE_X86_DISPATCH
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#define CRC32C_WORD(crc, word) ((uint32_t) _mm_crc32_u64((crc), (word)))
+#define CRC32C_BYTE(crc, byte) _mm_crc32_u8((crc), (byte))
+#else
+#define CRC32C_TARGET
+#define CRC32C_WORD(crc, word) __crc32cd((crc), (word))
+#define CRC32C_BYTE(crc, byte) __crc32cb((crc), (byte))
+#endif
+
+CRC32C_TARGET static uint32_t crc32c_hardware(uint32_t crc, const uint8_t* bytes, size_t length) {
+    // Three streams of CRC32C_STRIDE bytes each. Carrying the first past the other two
+    // and folding them in gives the same register as going through all of it in order
+    for (; length >= 3 * CRC32C_STRIDE; bytes += 3 * CRC32C_STRIDE, length -= 3 * CRC32C_STRIDE) {
+        uint32_t crc1 = 0, crc2 = 0;
+        for (size_t offset = 0; offset < CRC32C_STRIDE; offset += 8) {
+            uint64_t word0, word1, word2;
+            memcpy(&word0, bytes + offset, sizeof(word0));
+            memcpy(&word1, bytes + CRC32C_STRIDE + offset, sizeof(word1));
+            memcpy(&word2, bytes + 2 * CRC32C_STRIDE + offset, sizeof(word2));
+            crc  = CRC32C_WORD(crc, word0);
+            crc1 = CRC32C_WORD(crc1, word1);
+            crc2 = CRC32C_WORD(crc2, word2);
+        }
+        crc = crc32c_stride(crc32c_stride(crc) ^ crc1) ^ crc2;
+    }
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = CRC32C_WORD(crc, word);
+    }
+    for (; length; bytes++, length--) {
+        crc = CRC32C_BYTE(crc, *bytes);
+    }
+    return crc;
+}
+#endif
+
+// CRC32C of the data, continuing from crc (0 to start)
+static uint32_t crc32c(const uint32_t crc, const void* const data, const size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+#ifdef HAVE_X86_DISPATCH
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_hardware(~crc, data, length);
+    }
+#elif defined(HAVE_ARM_CRC32)
+    return ~crc32c_hardware(~crc, data, length);
+#endif
+    return ~crc32c_generic(~crc, data, length);
+}
+
+static inline uint32_t block_checksum(const block_store_t* const bs, const size_t block_id) {
+    return crc32c(0, block_address(bs, block_id), bs->block_size);
+}
+
+// After anything writes to a block
+static inline void checksum_update(block_store_t* const bs, const size_t block_id) {
+    if (bs->checksums) {
+        bs->checksums[block_id] = block_checksum(bs, block_id);
+    }
+}
+
+// Before anything reads from one, false if it doesn't match
+static inline bool checksum_verify(const block_store_t* const bs, const size_t block_id) {
+    return !bs->checksums || bs->checksums[block_id] == block_checksum(bs, block_id);
+}
+
+// <image><suffix>, caller frees
+static char* sidecar_path(const char* const image, const char* const suffix) {
+    const size_t length = strlen(image), suffix_length = strlen(suffix);
+    char* const path    = malloc(length + suffix_length + 1);
+    if (path) {
+        memcpy(path, image, length);
+        memcpy(path + length, suffix, suffix_length + 1);
+    }
+    return path;
+}
+
+// Writes the given checksums next to the image (atomically, with a rename), or removes a stale file
+// if there aren't any, so it can't be matched up with the wrong blocks later
+static bool checksum_write(const block_store_t* const bs, const char* const image, const uint32_t* const checksums) {
+    char* const path = sidecar_path(image, CHECKSUM_SUFFIX);
+    char* const temp = path ? sidecar_path(path, ".tmp") : NULL;
+    bool success     = false;
+    if (!temp) {
+        // Fall through to the frees
+    } else if (!checksums) {
+        success = unlink(path) == 0 || errno == ENOENT;
+    } else {
+        const int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            checksum_header_t header = {.block_size = bs->block_size, .block_count = bs->block_count};
+            memcpy(header.magic, checksum_magic, sizeof(header.magic));
+            header.checksum = crc32c(0, checksums, bs->total_blocks * sizeof(uint32_t));
+            struct iovec iov[2] = {
+                {&header, sizeof(header)},
+                {(void*) checksums, bs->total_blocks * sizeof(uint32_t)},
+            };
+            success = write_all(fd, iov, 2) && fdatasync(fd) == 0;
+            success = close(fd) == 0 && success;
+            success = success && rename(temp, path) == 0 && sync_parent(path);
+            if (!success) {
+                unlink(temp);
+            }
+        }
+    }
+    free(temp);
+    free(path);
+    return success;
+}
+
+// The device's own checksums, as they are now
+static bool checksum_save(const block_store_t* const bs, const char* const image) {
+    return checksum_write(bs, image, bs->checksums);
+}
+
+// Picks up the checksums next to the image, if there are any (and they're for this device)
+// Leaves checksums off if the file is missing, damaged or describes a different device
+static void checksum_load(block_store_t* const bs, const char* const image) {
+    char* const path = sidecar_path(image, CHECKSUM_SUFFIX);
+    const int fd     = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0) {
+        return;
+    }
+    checksum_header_t header;
+    uint32_t* const checksums = malloc(bs->total_blocks * sizeof(uint32_t));
+    struct iovec iov[2] = {
+        {&header, sizeof(header)},
+        {checksums, bs->total_blocks * sizeof(uint32_t)},
+    };
+    if (checksums && read_all(fd, iov, 2) && memcmp(header.magic, checksum_magic, sizeof(header.magic)) == 0
+        && header.block_size == bs->block_size && header.block_count == bs->block_count
+        && header.checksum == crc32c(0, checksums, bs->total_blocks * sizeof(uint32_t))) {
+        free(bs->checksums);
+        bs->checksums = checksums;
+    } else {
+        free(checksums);
+    }
+    close(fd);
+}
+
+//
+// Write-ahead journal
+//
+// An append-only file of records next to the image (<image>.journal). Every change to the fbm
+// and every block write is recorded, in the order it happened, while holding the journal lock.
+// Records are buffered in memory and only reach the file on block_store_journal_commit.
+// Whoever commits first writes out everyone's records with a single write and fdatasync
+// (group commit), and the others just wait for it.
+//
+// Records describe the resulting state (these bits are set, these bytes are in the block),
+// so replaying one that the image already has is harmless. That's what makes checkpoints simple:
+// write a new image, rename it over the old one, then truncate the journal. A crash anywhere in
+// between replays to the same device. Replay stops at the first torn or corrupt record.
+//
+// A checkpoint only holds the lock for as long as it takes to copy something. It first moves the
+// journal aside (<image>.journal.old) and starts a new one, so everything that changes from then on
+// is recorded after the old records. Then it copies the fbm, and the blocks a chunk at a time, into
+// a new image. A block may have changed since the fbm was copied, but then the new journal has it too,
+// and replaying that on top puts it right. Once the image is in, the old journal goes.
+// Replay reads the old journal (if it's still there) and then the new one.
+//
+
+#define JOURNAL_MAGIC 0x4C4E524A  // "JRNL"
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_OLD_SUFFIX ".journal.old"
+
+// Most bytes of blocks a checkpoint copies with the lock held, at least one block
+#define CHECKPOINT_CHUNK (1 << 20)
+
+typedef enum { JOURNAL_SET = 1, JOURNAL_RESET = 2, JOURNAL_WRITE = 3 } journal_type_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t block;     // First block
+    uint64_t arg;       // Number of blocks for SET/RESET, offset into the block for WRITE
+    uint32_t length;    // Payload bytes, WRITE only
+    uint32_t checksum;  // CRC32C of the record (with this set to 0) and its payload
+} journal_record_t;
+
+typedef struct journal {
+    int fd;
+    char* image;     // Where checkpoints go
+    char* path;      // The journal, <image>.journal
+    char* old_path;  // Where a checkpoint moves it meanwhile, <image>.journal.old
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;  // A commit or checkpoint finished
+    pthread_cond_t wake;     // Wakes the checkpointer
+    // Records not in the file yet, and a second buffer for the next batch while one is being flushed
+    uint8_t *buffer, *spare;
+    size_t buffer_used, buffer_size, spare_size;
+    uint64_t appended, durable;  // Records logged, and how many of those are safely in the file
+    bool flushing, failed, stop;
+    bool checkpointing;  // A checkpoint is writing the image
+    bool old_segment;    // The old journal may still be needed, so the next checkpoint can't move this one there
+    size_t file_bytes;        // Size of the journal file
+    size_t checkpoint_bytes;  // Journal size that triggers a background checkpoint, 0 for none
+    bool checkpointer_running;
+    pthread_t checkpointer;
+} journal_t;
+
+static uint32_t journal_checksum(const journal_record_t* const record, const void* const payload) {
+    journal_record_t copy = *record;
+    copy.checksum         = 0;
+    return crc32c(crc32c(0, &copy, sizeof(copy)), payload, record->length);
+}
+
+// Every mutation happens between these, so the journal sees changes in the order they were made
+static inline void journal_begin(block_store_t* const bs) {
+    if (bs->journal) {
+        pthread_mutex_lock(&bs->journal->lock);
+    }
+}
+
+static inline void journal_end(block_store_t* const bs) {
+    if (bs->journal) {
+        pthread_mutex_unlock(&bs->journal->lock);
+    }
+}
+
+// Adds a record to the buffer (with the lock held). Running out of memory breaks the journal,
+// since the device has already changed and we can't record it
+static void journal_append(block_store_t* const bs, const journal_type_t type, const size_t block, const size_t arg,
+                           const void* const payload, const size_t length) {
+    journal_t* const journal = bs->journal;
+    if (!journal || journal->failed) {
+        return;
+    }
+    const size_t needed = journal->buffer_used + sizeof(journal_record_t) + length;
+    if (needed > journal->buffer_size) {
+        size_t size = journal->buffer_size ? journal->buffer_size : 4096;
+        while (size < needed) {
+            size <<= 1;
+        }
+        uint8_t* const buffer = realloc(journal->buffer, size);
+        if (!buffer) {
+            journal->failed = true;
+            return;
+        }
+        journal->buffer      = buffer;
+        journal->buffer_size = size;
+    }
+    journal_record_t record = {JOURNAL_MAGIC, type, block, arg, (uint32_t) length, 0};
+    record.checksum         = journal_checksum(&record, payload);
+    memcpy(journal->buffer + journal->buffer_used, &record, sizeof(record));
+    if (length) {
+        memcpy(journal->buffer + journal->buffer_used + sizeof(record), payload, length);
+    }
+    journal->buffer_used = needed;
+    journal->appended++;
+}
+
+static inline void journal_log_bits(block_store_t* const bs, const journal_type_t type, const size_t start,
+                                    const size_t count) {
+    if (bs->journal && count) {
+        journal_append(bs, type, start, count, NULL, 0);
+    }
+}
+
+static inline void journal_log_write(block_store_t* const bs, const size_t block_id, const size_t offset,
+                                     const size_t length, const void* const data) {
+    if (bs->journal) {
+        journal_append(bs, JOURNAL_WRITE, block_id, offset, data, length);
+    }
+}
+
+// New image next to the old one, caller frees
+static char* checkpoint_temp_path(const journal_t* const journal) {
+    return sidecar_path(journal->image, ".tmp");
+}
+
+// Writes a fresh image and empties the journal (and the old one) without ever letting go of the lock,
+// so nothing changes meanwhile. For opening, and for when the old journal is still around
+static bool journal_checkpoint_locked(block_store_t* const bs) {
+    journal_t* const journal = bs->journal;
+    while (journal->flushing || journal->checkpointing) {
+        pthread_cond_wait(&journal->flushed, &journal->lock);
+    }
+    if (journal->failed) {
+        return false;
+    }
+
+    // New image next to the old one, then swapped in whole
+    char* const temp = checkpoint_temp_path(journal);
+    if (!temp) {
+        return false;
+    }
+    bool success = false;
+    const int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        success = image_write(bs, fd) && fdatasync(fd) == 0;
+        success = close(fd) == 0 && success;
+        success = success && rename(temp, journal->image) == 0 && sync_parent(journal->image)
+                  && checksum_save(bs, journal->image);
+        if (!success) {
+            unlink(temp);
+        }
+    }
+    free(temp);
+
+    // Everything logged so far is in the image now, buffered or not
+    if (success && ftruncate(journal->fd, 0) == 0 && fdatasync(journal->fd) == 0
+        && (unlink(journal->old_path) == 0 || errno == ENOENT)) {
+        journal->file_bytes  = 0;
+        journal->buffer_used = 0;
+        journal->durable     = journal->appended;
+        journal->old_segment = false;
+        pthread_cond_broadcast(&journal->flushed);
+        return true;
+    }
+    return false;
+}
+
+// Moves the journal to the old one and starts a new one, called with the lock held
+// Commits are held off meanwhile, changes just go on piling up in the buffer
+static bool journal_rotate(journal_t* const journal) {
+    while (journal->flushing) {
+        pthread_cond_wait(&journal->flushed, &journal->lock);
+    }
+    journal->flushing = true;
+    pthread_mutex_unlock(&journal->lock);
+    bool rotated = rename(journal->path, journal->old_path) == 0, lost = false;
+    int fd       = rotated ? open(journal->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644) : -1;
+    if (rotated && (fd < 0 || !sync_parent(journal->path))) {
+        // Put it back, replay can't lose it in between: the old journal is read too
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        rotated = false;
+        lost    = rename(journal->old_path, journal->path) != 0;
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal->failed = journal->failed || lost;
+    if (rotated) {
+        close(journal->fd);
+        journal->fd          = fd;
+        journal->file_bytes  = 0;
+        journal->old_segment = true;
+    }
+    journal->flushing = false;
+    pthread_cond_broadcast(&journal->flushed);
+    return rotated;
+}
+
+// Copies blocks [start, end) and their checksums, called with the lock held
+// A cold block is decompressed into the copy, without warming it up
+static bool checkpoint_copy(const block_store_t* const bs, const size_t start, const size_t end,
+                            uint8_t* const data, uint32_t* const checksums) {
+    bool success = true;
+    if (bs->cold) {
+        pthread_mutex_lock(&bs->cold->lock);
+        for (size_t block = start; success && block < end; block++) {
+            uint8_t* const copy      = data + ((block - start) << bs->block_shift);
+            const uint8_t* const got = cold_peek(bs, block, copy);
+            success                  = got != NULL;
+            if (got && got != copy) {
+                memcpy(copy, got, bs->block_size);
+            }
+        }
+        pthread_mutex_unlock(&bs->cold->lock);
+    } else {
+        memcpy(data, block_address(bs, start), (end - start) << bs->block_shift);
+    }
+    if (checksums) {
+        memcpy(checksums + start, bs->checksums + start, (end - start) * sizeof(uint32_t));
+    }
+    return success;
+}
+
+// Writes the image for journal_checkpoint, called without the lock. Only the copies need it
+static bool checkpoint_write(block_store_t* const bs, const int fd, uint8_t* const fbm, uint32_t* const checksums,
+                             uint8_t* const chunk, const size_t chunk_blocks) {
+    static const uint8_t padding[IMAGE_ALIGNMENT];
+    journal_t* const journal = bs->journal;
+    image_header_t header;
+    image_header_fill(&header, bs->block_size, bs->block_count);
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {fbm, header.fbm_bytes},
+        {(void*) padding, header.data_offset - header.fbm_offset - header.fbm_bytes},
+    };
+    bool success = write_all(fd, iov, 3);
+    for (size_t block = 0; success && block < bs->total_blocks; block += chunk_blocks) {
+        const size_t end = block + chunk_blocks < bs->total_blocks ? block + chunk_blocks : bs->total_blocks;
+        pthread_mutex_lock(&journal->lock);
+        success = checkpoint_copy(bs, block, end, chunk, checksums);
+        pthread_mutex_unlock(&journal->lock);
+        struct iovec data = {chunk, (end - block) << bs->block_shift};
+        success           = success && write_all(fd, &data, 1);
+    }
+    return success;
+}
+
+// Writes a fresh image and empties the journal, called with the lock held. The lock is let go
+// of for everything but the copies, see the top of the section
+static bool journal_checkpoint(block_store_t* const bs) {
+    journal_t* const journal = bs->journal;
+    while (journal->flushing || journal->checkpointing) {
+        pthread_cond_wait(&journal->flushed, &journal->lock);
+    }
+    if (journal->failed) {
+        return false;
+    }
+    if (journal->old_segment) {
+        return journal_checkpoint_locked(bs);
+    }
+
+    // A lazy device has to be all there first, the loader writes into the slab without our lock
+    journal->checkpointing = true;
+    pthread_mutex_unlock(&journal->lock);
+    const size_t chunk_blocks = bs->block_size < CHECKPOINT_CHUNK ? CHECKPOINT_CHUNK >> bs->block_shift : 1;
+    const size_t fbm_size     = fbm_bytes(bs->block_count);
+    char* const temp          = checkpoint_temp_path(journal);
+    uint8_t* const fbm        = malloc(fbm_size);
+    uint8_t* const chunk      = malloc(chunk_blocks << bs->block_shift);
+    uint32_t* checksums       = NULL;
+    bool success              = temp && fbm && chunk && lazy_load_all(bs);
+    pthread_mutex_lock(&journal->lock);
+
+    // Everything from here on goes in the new journal, so the image only has to be at least this far along
+    success = success && journal_rotate(journal);
+    if (success) {
+        memcpy(fbm, bitmap_export(bs->fbm), fbm_size);
+        if (bs->checksums) {
+            checksums = malloc(bs->total_blocks * sizeof(uint32_t));
+            success   = checksums != NULL;
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    const int fd = success ? open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd >= 0) {
+        success = checkpoint_write(bs, fd, fbm, checksums, chunk, chunk_blocks) && fdatasync(fd) == 0;
+        success = close(fd) == 0 && success;
+        success = success && rename(temp, journal->image) == 0 && sync_parent(journal->image)
+                  && checksum_write(bs, journal->image, checksums);
+        if (!success) {
+            unlink(temp);
+        }
+    } else {
+        success = false;
+    }
+    // The image has everything the old journal did. If it didn't make it, the next checkpoint
+    // has to do it all with the lock held (this journal can't go where the old one is)
+    success = success && unlink(journal->old_path) == 0;
+    free(checksums);
+    free(chunk);
+    free(fbm);
+    free(temp);
+
+    pthread_mutex_lock(&journal->lock);
+    if (success) {
+        journal->old_segment = false;
+    }
+    journal->checkpointing = false;
+    pthread_cond_broadcast(&journal->flushed);
+    return success;
+}
+
+// Background checkpoints, whenever a commit pushes the journal past checkpoint_bytes
+static void* journal_checkpointer(void* const arg) {
+    block_store_t* const bs  = arg;
+    journal_t* const journal = bs->journal;
+    pthread_mutex_lock(&journal->lock);
+    while (!journal->stop) {
+        // Commits go on during a checkpoint, so the new journal may be due already.
+        // One that fails waits for the next commit to try again
+        if (journal->file_bytes >= journal->checkpoint_bytes && journal_checkpoint(bs)) {
+            continue;
+        }
+        if (!journal->stop) {
+            pthread_cond_wait(&journal->wake, &journal->lock);
+        }
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+// Applies the records in one journal next to the image, if there is one
+// Anything from the first bad record on is dropped: that's where a crash cut a write short
+static void journal_replay_segment(block_store_t* const bs, const char* const image, const char* const suffix) {
+    char* const path = sidecar_path(image, suffix);
+    const int fd     = path ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0) {
+        return;
+    }
+    uint8_t* const payload = malloc(bs->block_size);
+    journal_record_t record;
+    for (struct iovec iov = {&record, sizeof(record)}; payload && read_all(fd, &iov, 1);
+         iov = (struct iovec){&record, sizeof(record)}) {
+        if (record.magic != JOURNAL_MAGIC || record.block >= bs->total_blocks) {
+            break;
+        }
+        if (record.type == JOURNAL_WRITE) {
+            struct iovec data = {payload, record.length};
+            if (!record.length || record.arg >= bs->block_size || record.length > bs->block_size - record.arg
+                || !read_all(fd, &data, 1) || journal_checksum(&record, payload) != record.checksum
+                || !block_fault_write(bs, record.block, true)) {
+                break;
+            }
+            memcpy(block_address(bs, record.block) + record.arg, payload, record.length);
+            bitmap_set(bs->dirty, record.block);
+            checksum_update(bs, record.block);
+        } else if ((record.type == JOURNAL_SET || record.type == JOURNAL_RESET) && !record.length
+                   && record.arg && record.arg <= bs->total_blocks - record.block
+                   && journal_checksum(&record, NULL) == record.checksum) {
+            if (record.type == JOURNAL_SET) {
+                bitmap_set_range(bs->fbm, record.block, record.arg);
+            } else {
+                bitmap_reset_range(bs->fbm, record.block, record.arg);
+            }
+        } else {
+            break;
+        }
+    }
+    free(payload);
+    close(fd);
+}
+
+// Applies the old journal a checkpoint didn't get to finish with (if any), then the journal
+static void journal_replay(block_store_t* const bs, const char* const image) {
+    journal_replay_segment(bs, image, JOURNAL_OLD_SUFFIX);
+    journal_replay_segment(bs, image, JOURNAL_SUFFIX);
+}
+
+//
+// Asynchronous I/O
+//
+// Requests are queued by block_store_read_async/write_async and go out together on the next
+// block_store_poll, which also runs the callbacks of whatever has completed.
+// A mapped device reads and writes its image file directly: through io_uring when the kernel
+// lets us have one, otherwise with a small pool of threads doing pread/pwrite. Either way that's
+// the page cache the mapping uses, so both views agree. (That rules out O_DIRECT, it would go
+// around the cache and the mapping wouldn't see the writes.)
+// A heap device has nothing to wait on, its requests are just copied during the poll.
+//
+
+#define ASYNC_QUEUE_DEPTH 256
+#define ASYNC_WORKERS 4
+
+typedef struct async_request {
+    block_store_io_callback_t callback;
+    void* arg;
+    size_t block_id;
+    uint8_t* buffer;
+    bool write;
+    size_t result;  // Bytes transferred, 0 on failure
+    struct async_request* next;
+} async_request_t;
+
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING 1
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned queued;  // Filled in, but not handed to the kernel yet
+} uring_t;
+#endif
+
+typedef struct async_io {
+    async_request_t slots[ASYNC_QUEUE_DEPTH];
+    async_request_t* free;  // Unused slots
+    size_t in_flight;       // Queued or submitted, callback not run yet
+    // Heap devices and the pool keep queued requests here until the poll
+    async_request_t *pending, **pending_tail;
+    // Where the blocks are in the file
+    int file;
+    size_t data_offset, block_size;
+#ifdef HAVE_IO_URING
+    bool have_ring;
+    uring_t ring;
+#endif
+    // Thread pool fallback
+    size_t workers;
+    pthread_t worker[ASYNC_WORKERS];
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    async_request_t *work_list, *done_list;
+    bool stop;
+} async_io_t;
+
+// Does the actual transfer for the pool
+static size_t async_transfer(const async_io_t* const io, const async_request_t* const request) {
+    const off_t offset = (off_t)(io->data_offset + request->block_id * io->block_size);
+    const ssize_t done = request->write ? pwrite(io->file, request->buffer, io->block_size, offset)
+                                        : pread(io->file, request->buffer, io->block_size, offset);
+    return done == (ssize_t) io->block_size ? io->block_size : 0;
+}
+
+static void* async_worker(void* const arg) {
+    async_io_t* const io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->work_list && !io->stop) {
+            pthread_cond_wait(&io->work, &io->lock);
+        }
+        async_request_t* const request = io->work_list;
+        if (!request) {
+            break;
+        }
+        io->work_list = request->next;
+        pthread_mutex_unlock(&io->lock);
+        request->result = async_transfer(io, request);
+        pthread_mutex_lock(&io->lock);
+        request->next = io->done_list;
+        io->done_list = request;
+        pthread_cond_signal(&io->done);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static bool uring_init(uring_t* const ring, const unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes    = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+        if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return false;
+    }
+    uint8_t* const sq = ring->sq_ring;
+    uint8_t* const cq = ring->cq_ring;
+    ring->sq_head     = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail     = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask     = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->cq_head     = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail     = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask     = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes        = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    // Submission slot n always holds sqe n
+    unsigned* const array = (unsigned*) (sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    return true;
+}
+
+static void uring_destroy(uring_t* const ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// The kernel owns the heads of the submission queue and the tail of the completion queue
+static void uring_queue(uring_t* const ring, const async_io_t* const io, async_request_t* const request) {
+    const unsigned tail         = *ring->sq_tail;
+    struct io_uring_sqe* const sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = io->file;
+    sqe->addr      = (uintptr_t) request->buffer;
+    sqe->len       = (unsigned) io->block_size;
+    sqe->off       = io->data_offset + request->block_id * io->block_size;
+    sqe->user_data = (uintptr_t) request;
+    atomic_store_explicit((_Atomic unsigned*) ring->sq_tail, tail + 1, memory_order_release);
+    ring->queued++;
+}
+
+// Hands over everything queued, waiting for min_complete completions too
+static bool uring_enter(uring_t* const ring, const unsigned min_complete) {
+    for (;;) {
+        const int done = (int) syscall(__NR_io_uring_enter, ring->fd, ring->queued, min_complete,
+                                       min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (done >= 0) {
+            ring->queued -= (unsigned) done;
+            if (!ring->queued || min_complete) {
+                return true;
+            }
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+    }
+}
+
+// Takes back whatever the kernel hasn't picked up (it only looks during io_uring_enter) and fails it
+static void uring_unqueue(uring_t* const ring, async_io_t* const io) {
+    const unsigned head = atomic_load_explicit((_Atomic unsigned*) ring->sq_head, memory_order_acquire);
+    for (unsigned tail = head; tail != *ring->sq_tail; tail++) {
+        async_request_t* const request = (async_request_t*) (uintptr_t) ring->sqes[tail & *ring->sq_mask].user_data;
+        request->result = 0;
+        request->next   = io->done_list;
+        io->done_list   = request;
+    }
+    atomic_store_explicit((_Atomic unsigned*) ring->sq_tail, head, memory_order_release);
+    ring->queued = 0;
+}
+
+// Moves finished requests to the done list
+static void uring_reap(uring_t* const ring, async_io_t* const io) {
+    unsigned head       = *ring->cq_head;
+    const unsigned tail = atomic_load_explicit((_Atomic unsigned*) ring->cq_tail, memory_order_acquire);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe* const cqe = &ring->cqes[head & *ring->cq_mask];
+        async_request_t* const request       = (async_request_t*) (uintptr_t) cqe->user_data;
+        request->result = cqe->res == (int) io->block_size ? io->block_size : 0;
+        request->next   = io->done_list;
+        io->done_list   = request;
+    }
+    atomic_store_explicit((_Atomic unsigned*) ring->cq_head, head, memory_order_release);
+}
+#endif
+
+// First async request on the device
+static async_io_t* async_setup(block_store_t* const bs) {
+    async_io_t* const io = calloc(1, sizeof(async_io_t));
+    if (!io) {
+        return NULL;
+    }
+    for (size_t i = 0; i < ASYNC_QUEUE_DEPTH; i++) {
+        io->slots[i].next = io->free;
+        io->free          = &io->slots[i];
+    }
+    io->pending_tail = &io->pending;
+    io->file         = bs->fd;
+    io->block_size   = bs->block_size;
+    io->data_offset  = bs->map ? (size_t)(bs->data - bs->map) : 0;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->work, NULL);
+    pthread_cond_init(&io->done, NULL);
+    if (io->file >= 0) {
+#ifdef HAVE_IO_URING
+        io->have_ring = !getenv("BLOCK_STORE_NO_IO_URING") && uring_init(&io->ring, ASYNC_QUEUE_DEPTH);
+        if (io->have_ring) {
+            return io;
+        }
+#endif
+        for (; io->workers < ASYNC_WORKERS; io->workers++) {
+            if (pthread_create(&io->worker[io->workers], NULL, async_worker, io)) {
+                break;
+            }
+        }
+        if (!io->workers) {
+            free(io);
+            return NULL;
+        }
+    }
+    return io;
+}
+
+// Queues a request, false when every slot is taken
+static bool async_queue(block_store_t* const bs, const size_t block_id, void* const buffer, const bool write,
+                        const block_store_io_callback_t callback, void* const arg) {
+    // Going around a cached device's frames to the file would miss what they hold,
+    // and a snapshot's blocks can only be read with its lock held
+    if (bs->cache || bs->snapshot || (!bs->async && !(bs->async = async_setup(bs)))) {
+        return false;
+    }
+    async_io_t* const io = bs->async;
+    async_request_t* const request = io->free;
+    if (!request) {
+        return false;
+    }
+    io->free          = request->next;
+    request->callback = callback;
+    request->arg      = arg;
+    request->block_id = block_id;
+    request->buffer   = buffer;
+    request->write    = write;
+    request->result   = 0;
+    request->next     = NULL;
+    io->in_flight++;
+#ifdef HAVE_IO_URING
+    if (io->have_ring) {
+        uring_queue(&io->ring, io, request);
+        return true;
+    }
+#endif
+    *io->pending_tail = request;
+    io->pending_tail  = &request->next;
+    return true;
+}
+
+// Sends the queued requests on their way (or just does them, for a heap device)
+static void async_submit(block_store_t* const bs, async_io_t* const io, const bool wait) {
+#ifdef HAVE_IO_URING
+    if (io->have_ring) {
+        // If the ring fails on us, fail whatever it didn't take instead of waiting on it forever
+        if (!uring_enter(&io->ring, wait && io->in_flight ? 1 : 0)) {
+            uring_unqueue(&io->ring, io);
+        }
+        uring_reap(&io->ring, io);
+        return;
+    }
+#endif
+    async_request_t* const batch = io->pending;
+    io->pending                  = NULL;
+    io->pending_tail             = &io->pending;
+    if (io->file < 0) {
+        for (async_request_t *request = batch, *next; request; request = next) {
+            next            = request->next;
+            request->result = 0;
+            if (request->write ? block_fault_write(bs, request->block_id, false)
+                               : block_fault(bs, request->block_id, true)) {
+                if (request->write) {
+                    // Same as block_store_write, journal and all (only a heap device can have one)
+                    journal_begin(bs);
+                    memcpy(block_address(bs, request->block_id), request->buffer, bs->block_size);
+                    mark_dirty(bs, request->block_id << bs->block_shift, bs->block_size);
+                    checksum_update(bs, request->block_id);
+                    journal_log_write(bs, request->block_id, 0, bs->block_size, request->buffer);
+                    journal_end(bs);
+                } else {
+                    memcpy(request->buffer, block_address(bs, request->block_id), bs->block_size);
+                }
+                request->result = bs->block_size;
+            }
+            request->next   = io->done_list;
+            io->done_list   = request;
+        }
+        return;
+    }
+    pthread_mutex_lock(&io->lock);
+    if (batch) {
+        // The whole batch goes on the work list at once
+        async_request_t** tail = &io->work_list;
+        while (*tail) {
+            tail = &(*tail)->next;
+        }
+        *tail = batch;
+        pthread_cond_broadcast(&io->work);
+    }
+    while (wait && io->in_flight && !io->done_list) {
+        pthread_cond_wait(&io->done, &io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+}
+
+// Takes the finished requests, the pool's workers add to the list under the lock
+static async_request_t* async_take_done(async_io_t* const io) {
+    if (io->workers) {
+        pthread_mutex_lock(&io->lock);
+    }
+    async_request_t* const done = io->done_list;
+    io->done_list               = NULL;
+    if (io->workers) {
+        pthread_mutex_unlock(&io->lock);
+    }
+    return done;
+}
+
+// Finishes whatever is still queued or in flight (no callbacks) and tears it all down
+static void async_destroy(block_store_t* const bs) {
+    async_io_t* const io = bs->async;
+    if (!io) {
+        return;
+    }
+    async_submit(bs, io, false);
+#ifdef HAVE_IO_URING
+    if (io->have_ring) {
+        for (;;) {
+            for (async_request_t* request = async_take_done(io); request; request = request->next) {
+                io->in_flight--;
+            }
+            if (!io->in_flight || !uring_enter(&io->ring, 1)) {
+                break;
+            }
+            uring_reap(&io->ring, io);
+        }
+        uring_destroy(&io->ring);
+    }
+#endif
+    if (io->workers) {
+        pthread_mutex_lock(&io->lock);
+        io->stop = true;
+        pthread_cond_broadcast(&io->work);
+        pthread_mutex_unlock(&io->lock);
+        for (size_t i = 0; i < io->workers; i++) {
+            pthread_join(io->worker[i], NULL);
+        }
+    }
+    pthread_cond_destroy(&io->done);
+    pthread_cond_destroy(&io->work);
+    pthread_mutex_destroy(&io->lock);
+    free(io);
+}
+
+//
+// Block cache for devices opened with block_store_open_cached
+// A fixed pool of frames, each holding one block of the image. A hash (chained through the frames)
+// finds the frame holding a block, CLOCK picks which one to give up when the pool is full,
+// and dirty frames are only written back when they're evicted or synced.
+// One lock covers all of it, the frames are too small for anything finer to pay off.
+//
+
+typedef struct block_cache {
+    pthread_mutex_t lock;
+    int fd;                // The image
+    size_t block_size;
+    unsigned block_shift;
+    size_t data_offset;    // Where block 0 starts in the image
+    size_t frames;         // Frames in the pool
+    uint8_t* pool;         // Frame f lives at pool + (f << block_shift)
+    size_t* frame_block;   // Block held by each occupied frame
+    size_t* frame_next;    // Next frame in the same bucket, SIZE_MAX ends the chain
+    size_t* buckets;       // First frame of each bucket, SIZE_MAX when empty
+    size_t bucket_mask;    // Bucket count - 1, it's a power of two
+    bitmap_t* occupied;    // Frames holding a block
+    bitmap_t* dirty;       // Frames written since they were loaded
+    bitmap_t* referenced;  // CLOCK reference bits, cleared as the hand passes
+    size_t hand;           // Where the next eviction search starts
+    block_store_cache_stats_t stats;
+} block_cache_t;
+
+static inline uint8_t* frame_address(const block_cache_t* const cache, const size_t frame) {
+    return cache->pool + (frame << cache->block_shift);
+}
+
+// Fibonacci hashing, so runs of block ids spread over the buckets
+static inline size_t cache_bucket(const block_cache_t* const cache, const size_t block_id) {
+    const uint64_t hash = (uint64_t) block_id * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash ^ (hash >> 32)) & cache->bucket_mask;
+}
+
+// The frame holding the block, SIZE_MAX if it isn't cached
+static size_t cache_find(const block_cache_t* const cache, const size_t block_id) {
+    size_t frame = cache->buckets[cache_bucket(cache, block_id)];
+    while (frame != SIZE_MAX && cache->frame_block[frame] != block_id) {
+        frame = cache->frame_next[frame];
+    }
+    return frame;
+}
+
+// Takes the frame out of its bucket's chain
+static void cache_unlink(block_cache_t* const cache, const size_t frame) {
+    size_t* link = &cache->buckets[cache_bucket(cache, cache->frame_block[frame])];
+    while (*link != frame) {
+        link = &cache->frame_next[*link];
+    }
+    *link = cache->frame_next[frame];
+}
+
+// Writes a dirty frame back to its block in the image
+static bool cache_writeback(block_cache_t* const cache, const size_t frame) {
+    if (!pwrite_all(cache->fd, frame_address(cache, frame), cache->block_size,
+                    cache->data_offset + (cache->frame_block[frame] << cache->block_shift))) {
+        return false;
+    }
+    bitmap_reset(cache->dirty, frame);
+    cache->stats.writebacks++;
+    return true;
+}
+
+// A frame to load a block into: a free one if there is one, otherwise the CLOCK victim
+// Returns SIZE_MAX if the victim was dirty and couldn't be written back
+static size_t cache_victim(block_cache_t* const cache) {
+    size_t frame = bitmap_ffz(cache->occupied);
+    if (frame != SIZE_MAX) {
+        return frame;
+    }
+
+    // The first frame from the hand on that hasn't been used since the hand last passed it,
+    // everything the hand skips on the way there loses its reference bit
+    frame = bitmap_ffz_from(cache->referenced, cache->hand);
+    if (frame == SIZE_MAX) {
+        // Everything was used, so it all gets a second chance and the hand takes what it's on
+        bitmap_format(cache->referenced, 0x00);
+        frame = cache->hand;
+    } else if (frame >= cache->hand) {
+        bitmap_reset_range(cache->referenced, cache->hand, frame - cache->hand);
+    } else {
+        bitmap_reset_range(cache->referenced, cache->hand, cache->frames - cache->hand);
+        bitmap_reset_range(cache->referenced, 0, frame);
+    }
+    cache->hand = frame + 1 < cache->frames ? frame + 1 : 0;
+
+    if (bitmap_test(cache->dirty, frame) && !cache_writeback(cache, frame)) {
+        return SIZE_MAX;
+    }
+    cache_unlink(cache, frame);
+    bitmap_reset(cache->occupied, frame);
+    cache->stats.evictions++;
+    return frame;
+}
+
+// The frame holding the block, loading it on a miss (unless it's about to be overwritten anyway)
+// NULL if the block couldn't be loaded or nothing could be evicted for it
+static uint8_t* cache_frame(block_cache_t* const cache, const size_t block_id, const bool load) {
+    size_t frame = cache_find(cache, block_id);
+    if (frame != SIZE_MAX) {
+        cache->stats.hits++;
+        bitmap_set(cache->referenced, frame);
+        return frame_address(cache, frame);
+    }
+
+    cache->stats.misses++;
+    frame = cache_victim(cache);
+    if (frame == SIZE_MAX
+        || (load && !pread_all(cache->fd, frame_address(cache, frame), cache->block_size,
+                               cache->data_offset + (block_id << cache->block_shift)))) {
+        return NULL;
+    }
+    const size_t bucket       = cache_bucket(cache, block_id);
+    cache->frame_block[frame] = block_id;
+    cache->frame_next[frame]  = cache->buckets[bucket];
+    cache->buckets[bucket]    = frame;
+    bitmap_set(cache->occupied, frame);
+    bitmap_set(cache->referenced, frame);
+    return frame_address(cache, frame);
+}
+
+// Copies part of a block in or out through the cache, returns length or 0 on error
+static size_t cache_access(block_cache_t* const cache, const size_t block_id, const size_t offset,
+                           const size_t length, void* const buffer, const bool write) {
+    pthread_mutex_lock(&cache->lock);
+    // A write of the whole block doesn't need what was there before
+    uint8_t* const frame = cache_frame(cache, block_id, !write || length != cache->block_size);
+    if (frame) {
+        if (write) {
+            memcpy(frame + offset, buffer, length);
+            bitmap_set(cache->dirty, (size_t)(frame - cache->pool) >> cache->block_shift);
+        } else {
+            memcpy(buffer, frame + offset, length);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return frame ? length : 0;
+}
+
+static void cache_destroy(block_cache_t* const cache) {
+    if (!cache) {
+        return;
+    }
+    bitmap_destroy(cache->referenced);
+    bitmap_destroy(cache->dirty);
+    bitmap_destroy(cache->occupied);
+    free(cache->buckets);
+    free(cache->frame_next);
+    free(cache->frame_block);
+    free(cache->pool);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static block_cache_t* cache_create(const block_store_t* const bs, const size_t frames, const size_t data_offset) {
+    block_cache_t* const cache = calloc(1, sizeof(block_cache_t));
+    if (!cache) {
+        return NULL;
+    }
+    // At least two buckets per frame keeps the chains short
+    size_t buckets = 2;
+    while (buckets < frames * 2) {
+        buckets <<= 1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->fd          = bs->fd;
+    cache->block_size  = bs->block_size;
+    cache->block_shift = bs->block_shift;
+    cache->data_offset = data_offset;
+    cache->frames      = frames;
+    cache->bucket_mask = buckets - 1;
+    // Frames are aligned the same way as the slab's blocks
+    const size_t pool_size = ((frames << bs->block_shift) + SLAB_ALIGNMENT - 1) & ~(size_t)(SLAB_ALIGNMENT - 1);
+    cache->pool        = aligned_alloc(SLAB_ALIGNMENT, pool_size);
+    cache->frame_block = malloc(frames * sizeof(size_t));
+    cache->frame_next  = malloc(frames * sizeof(size_t));
+    cache->buckets     = malloc(buckets * sizeof(size_t));
+    cache->occupied    = bitmap_create(frames);
+    cache->dirty       = bitmap_create(frames);
+    cache->referenced  = bitmap_create(frames);
+    if (!cache->pool || !cache->frame_block || !cache->frame_next || !cache->buckets || !cache->occupied
+        || !cache->dirty || !cache->referenced) {
+        cache_destroy(cache);
+        return NULL;
+    }
+    memset(cache->buckets, 0xFF, buckets * sizeof(size_t));
+    return cache;
+}
+
+// Writes back every dirty frame and the fbm, then syncs the image
+static bool cache_sync(block_store_t* const bs) {
+    block_cache_t* const cache = bs->cache;
+    image_header_t header;
+    image_header_fill(&header, bs->block_size, bs->block_count);
+    pthread_mutex_lock(&cache->lock);
+    bool success = true;
+    bitmap_iter_t it;
+    bitmap_iter_init(&it, cache->dirty);
+    for (size_t frame = bitmap_next_set(&it); frame != SIZE_MAX; frame = bitmap_next_set(&it)) {
+        success = cache_writeback(cache, frame) && success;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return success && pwrite_all(bs->fd, bitmap_export(bs->fbm), header.fbm_bytes, header.fbm_offset)
+           && fdatasync(bs->fd) == 0;
+}
+
+/*
+ *  This creates a new BS device, ready to go
+ */
+block_store_t* block_store_create() {
+    return block_store_create_ex(BLOCK_SIZE, BLOCK_COUNT);
+}
+
+/*
+ *  This creates a new BS device with the given geometry
+ */
+block_store_t* block_store_create_ex(const size_t block_size, const size_t block_count) {
+    // Check params
+    if (!geometry_valid(block_size, block_count)) {
+        return NULL;
+    }
+
+    block_store_t* bs = block_store_alloc(block_size, block_count);
+    if (!bs) {
+        return NULL;
+    }
+
+    // Allocate every block in one go. aligned_alloc wants a multiple of the alignment
+    const size_t slab_size  = block_count * block_size;
+    const size_t slab_alloc = (slab_size + SLAB_ALIGNMENT - 1) & ~(size_t)(SLAB_ALIGNMENT - 1);
+    bs->data = aligned_alloc(SLAB_ALIGNMENT, slab_alloc);
+    if (!bs->data) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    // Create the bitmap in the blocks it lives in and set their bits
+    // User blocks are left as-is, the fbm's blocks need to start out zeroed
+    uint8_t* const fbm_data = block_address(bs, bs->total_blocks);
+    memset(fbm_data, 0, slab_size - (size_t)(fbm_data - bs->data));
+    bs->fbm = bitmap_overlay(block_count, fbm_data);
+    if (!bs->fbm) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    for (size_t i = bs->total_blocks; i < block_count; i++) {
+        bitmap_set(bs->fbm, i);
+    }
+    return bs;
+}
+
+/*
+ * Destroys the provided block storage devices
+ */
+void block_store_destroy(block_store_t* const bs) {
+    // Check param
+    if (!bs) {
+        return;
+    }
+
+    // Whatever's logged should make it to the journal, and whatever's in flight or cached to the file
+    block_store_journal_close(bs);
+    async_destroy(bs);
+    lazy_destroy(bs);
+    cold_destroy(bs);
+    if (bs->cache) {
+        cache_sync(bs);
+        cache_destroy(bs->cache);
+    }
+    free(bs->region_hints);
+    // Destroy the summary first, it only borrows the bitmap
+    bitmap_hier_destroy(bs->fbm_index);
+    // Destroy bitmap (it's an overlay, the slab still owns the data)
+    bitmap_destroy(bs->fbm);
+    bitmap_destroy(bs->dirty);
+    free(bs->checksums);
+    free(bs->image_path);
+    free(bs->stats);
+
+    // Deallocate all the blocks (or let go of the image, or our share of the slab)
+    if (bs->map) {
+        munmap(bs->map, bs->map_size);
+    } else if (bs->snapshot) {
+        snapshot_destroy(bs);
+    } else if (bs->share) {
+        slab_put(bs->share);
+    } else {
+        free(bs->data);
+    }
+    if (bs->fd >= 0) {
+        close(bs->fd);
+    }
+
+    // Finally, deallocate the device itself
+    free(bs);
+    return;
+}
+
+/*
+ * Searches for a free block, marks it as in use
+ * and returns the block's id
+ */
+size_t block_store_allocate(block_store_t* const bs) {
+    // Check param
+    if (!bs) {
+        return SIZE_MAX;
+    }
+
+    // Find index of first zero and set it (through the summary, if we have one)
+    // SIZE_MAX means there are no free blocks
+    const uint64_t start = stats_start(bs);
+    const size_t scanned = bitmap_scanned_words();
+    journal_begin(bs);
+    const size_t block_id = fbm_claim(bs);
+    if (block_id != SIZE_MAX) {
+        journal_log_bits(bs, JOURNAL_SET, block_id, 1);
+    }
+    journal_end(bs);
+    stats_record_alloc(bs, start, scanned, block_id == SIZE_MAX);
+    return block_id;
+}
+
+// Claims up to count free blocks, block_store_allocate_n without the journal
+static size_t claim_n(block_store_t* const bs, const size_t count, size_t* const block_ids) {
+    // The summary already makes each search cheap, so it just repeats those
+    if (bs->fbm_index) {
+        size_t allocated = 0;
+        for (; allocated < count && (block_ids[allocated] = fbm_claim(bs)) != SIZE_MAX; ++allocated) {
+        }
+        return allocated;
+    }
+    // The fbm's own blocks are always set, so they can't be handed out
+    const size_t allocated = bitmap_claim_zeros(bs->fbm, count, block_ids);
+    used_add(bs, allocated);
+    return allocated;
+}
+
+/*
+ * Allocates up to count free blocks in a single pass
+ */
+size_t block_store_allocate_n(block_store_t* const bs, const size_t count, size_t* const block_ids) {
+    // Check params
+    if (!bs || !block_ids) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t scanned = bitmap_scanned_words();
+    journal_begin(bs);
+    const size_t allocated = claim_n(bs, count, block_ids);
+    for (size_t i = 0; i < allocated; i++) {
+        journal_log_bits(bs, JOURNAL_SET, block_ids[i], 1);
+    }
+    journal_end(bs);
+    stats_record_alloc(bs, start, scanned, allocated < count);
+    return allocated;
+}
+
+// Claims a run of free blocks, block_store_allocate_extent without the journal
+static size_t claim_extent(block_store_t* const bs, const size_t block_count) {
+    // The fbm's own blocks are always set, so a run can't reach into them
+    for (;;) {
+        const size_t start = bitmap_find_zero_run(bs->fbm, block_count);
+        if (start == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        // Nobody can get to the run first on a flat map outside concurrent mode, so it's taken in one go
+        if (!bs->concurrent && !bs->fbm_index) {
+            used_add(bs, bitmap_set_range(bs->fbm, start, block_count));
+            return start;
+        }
+        size_t claimed = 0;
+        for (; claimed < block_count && !fbm_test_and_set(bs, start + claimed); claimed++) {
+        }
+        if (claimed == block_count) {
+            return start;
+        }
+        // Another thread got part of the run first, give back our part and look again
+        for (size_t i = start; i < start + claimed; i++) {
+            fbm_reset(bs, i);
+        }
+    }
+}
+
+/*
+ * Allocates a run of contiguous free blocks
+ */
+size_t block_store_allocate_extent(block_store_t* const bs, const size_t block_count) {
+    // Check param
+    if (!bs) {
+        return SIZE_MAX;
+    }
+
+    const uint64_t began = stats_start(bs);
+    const size_t scanned = bitmap_scanned_words();
+    journal_begin(bs);
+    const size_t start = claim_extent(bs, block_count);
+    if (start != SIZE_MAX) {
+        journal_log_bits(bs, JOURNAL_SET, start, block_count);
+    }
+    journal_end(bs);
+    stats_record_alloc(bs, began, scanned, start == SIZE_MAX);
+    return start;
+}
+
+/*
+ * Attempts to allocate the requested block id
+ */
+bool block_store_request(block_store_t* const bs, const size_t block_id) {
+    // Check params
+    if (!bs || block_id >= bs->total_blocks) {
+        return false;
+    }
+
+    // Set the requested block, it was available if it wasn't already set
+    journal_begin(bs);
+    const bool available = !fbm_test_and_set(bs, block_id);
+    if (available) {
+        journal_log_bits(bs, JOURNAL_SET, block_id, 1);
+    }
+    journal_end(bs);
+    return available;
+}
+
+/*
+ * Frees the specified block
+ */
+void block_store_release(block_store_t* const bs, const size_t block_id) {
+    // Check params, the fbm's own blocks can't be freed
+    if (!bs || block_id >= bs->total_blocks) {
+        return;
+    }
+
+    // Freeing a block that's already free leaves the used count alone
+    const uint64_t start = stats_start(bs);
+    journal_begin(bs);
+    fbm_release(bs, block_id);
+    journal_log_bits(bs, JOURNAL_RESET, block_id, 1);
+    journal_end(bs);
+    stats_record(bs, BS_STAT_RELEASE, start, 0, false);
+}
+
+/*
+ * Frees all the specified blocks
+ */
+void block_store_release_n(block_store_t* const bs, const size_t* const block_ids, const size_t count) {
+    // Check params
+    if (!bs || !block_ids) {
+        return;
+    }
+
+    // Same as release, but ids that don't belong to a user block are skipped
+    const uint64_t start = stats_start(bs);
+    journal_begin(bs);
+    for (size_t i = 0; i < count; i++) {
+        if (block_ids[i] < bs->total_blocks) {
+            fbm_release(bs, block_ids[i]);
+            journal_log_bits(bs, JOURNAL_RESET, block_ids[i], 1);
+        }
+    }
+    journal_end(bs);
+    stats_record(bs, BS_STAT_RELEASE, start, 0, false);
+}
+
+// Frees a run of blocks, block_store_release_extent without the journal
+static void release_extent(block_store_t* const bs, const size_t start, const size_t block_count) {
+    // The summary has to hear about every block, the flat map can clear the whole run at once
+    if (bs->fbm_index) {
+        for (size_t i = start; i < start + block_count; i++) {
+            fbm_release(bs, i);
+        }
+        return;
+    }
+    const size_t released = bitmap_reset_range(bs->fbm, start, block_count);
+    used_sub(bs, released);
+    if (released && bs->region_hints) {
+        // Every region the run touched has room from where the run entered it
+        const size_t last = (start + block_count - 1) / bs->region_bits;
+        for (size_t region = start / bs->region_bits; region <= last; region++) {
+            const size_t region_start = region * bs->region_bits;
+            atomic_size_min(&bs->region_hints[region], start > region_start ? start : region_start);
+        }
+    }
+}
+
+/*
+ * Frees a run of contiguous blocks
+ */
+void block_store_release_extent(block_store_t* const bs, const size_t start, const size_t block_count) {
+    // Check params (the whole run has to be user blocks)
+    if (!bs || start >= bs->total_blocks || block_count > bs->total_blocks - start) {
+        return;
+    }
+
+    const uint64_t began = stats_start(bs);
+    journal_begin(bs);
+    release_extent(bs, start, block_count);
+    journal_log_bits(bs, JOURNAL_RESET, start, block_count);
+    journal_end(bs);
+    stats_record(bs, BS_STAT_RELEASE, began, 0, false);
+}
+
+/*
+ * Counts the number of blocks marked as in use
+ */
+size_t block_store_get_used_blocks(const block_store_t* const bs) {
+    // Check param
+    if (!bs) {
+        return SIZE_MAX;
+    }
+
+    // The fbm helpers keep count, the fbm's own blocks were never in it
+    return atomic_load_explicit(&bs->used_blocks, memory_order_relaxed);
+}
+
+/*
+ * Counts the number of blocks marked free for use
+ */
+size_t block_store_get_free_blocks(const block_store_t* const bs) {
+    // Check param
+    if (!bs) {
+        return SIZE_MAX;
+    }
+
+    // This number is just the difference of the user blocks and the ones in use
+    return bs->total_blocks - atomic_load_explicit(&bs->used_blocks, memory_order_relaxed);
+}
+
+/*
+ * Returns the total number of user-addressable blocks
+ * (since this is constant, you don't even need bs object)
+ */
+size_t block_store_get_total_blocks() {
+    // This is constant. Easy!
+    return BLOCK_COUNT - fbm_blocks(BLOCK_SIZE, BLOCK_COUNT);
+}
+
+/*
+ * Returns the total number of user-addressable blocks of the given device
+ */
+size_t block_store_get_total_blocks_ex(const block_store_t* const bs) {
+    // Check param
+    if (!bs) {
+        return SIZE_MAX;
+    }
+
+    return bs->total_blocks;
+}
+
+/*
+ * Returns the block size of the given device
+ */
+size_t block_store_get_block_size(const block_store_t* const bs) {
+    // Check param
+    if (!bs) {
+        return 0;
+    }
+
+    return bs->block_size;
+}
+
+// Reads a block, block_store_read without the stats
+static size_t read_block(const block_store_t* const bs, const size_t block_id, void* buffer) {
+    // Simply copy the memory and return success (a cached device may have to load it first)
+    if (bs->cache) {
+        return cache_access(bs->cache, block_id, 0, bs->block_size, buffer, false);
+    }
+    if (!block_fault(bs, block_id, true)) {
+        return 0;
+    }
+    snapshot_read_begin(bs);
+    const bool good = checksum_verify(bs, block_id);
+    if (good) {
+        memcpy(buffer, block_address(bs, block_id), bs->block_size);
+    }
+    snapshot_read_end(bs);
+    return good ? bs->block_size : 0;
+}
+
+/*
+ * Reads data from the specified block and writes it to designated buffer
+ */
+size_t block_store_read(const block_store_t* const bs, const size_t block_id, void* buffer) {
+    // Check params
+    if (!bs || block_id >= bs->total_blocks || !buffer) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t read    = read_block(bs, block_id, buffer);
+    stats_record(bs, BS_STAT_READ, start, read, !read);
+    return read;
+}
+
+// Writes a block, block_store_write without the stats
+static size_t write_block(block_store_t* const bs, const size_t block_id, const void* buffer) {
+    // block_id is already tested in tests.cpp, so we can assume block is free
+    // Simply copy the memory and return success
+    if (bs->cache) {
+        return cache_access(bs->cache, block_id, 0, bs->block_size, (void*) buffer, true);
+    }
+    if (!block_fault_write(bs, block_id, false)) {
+        return 0;
+    }
+    journal_begin(bs);
+    memcpy(block_address(bs, block_id), buffer, bs->block_size);
+    mark_dirty(bs, block_id << bs->block_shift, bs->block_size);
+    checksum_update(bs, block_id);
+    journal_log_write(bs, block_id, 0, bs->block_size, buffer);
+    journal_end(bs);
+    return bs->block_size;
+}
+
+/*
+ * Reads data from buffer and writes it to designated block
+ */
+size_t block_store_write(block_store_t* const bs, const size_t block_id, const void* buffer) {
+    // Check params
+    if (!bs || block_id >= bs->total_blocks || !buffer) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t written = write_block(bs, block_id, buffer);
+    stats_record(bs, BS_STAT_WRITE, start, written, !written);
+    return written;
+}
+
+// Reads part of a block, block_store_pread without the stats
+static size_t pread_block(const block_store_t* const bs, const size_t block_id, const size_t offset,
+                          const size_t length, void* buffer) {
+    if (bs->cache) {
+        return cache_access(bs->cache, block_id, offset, length, buffer, false);
+    }
+    if (!block_fault(bs, block_id, true)) {
+        return 0;
+    }
+    snapshot_read_begin(bs);
+    const bool good = checksum_verify(bs, block_id);
+    if (good) {
+        memcpy(buffer, block_address(bs, block_id) + offset, length);
+    }
+    snapshot_read_end(bs);
+    return good ? length : 0;
+}
+
+/*
+ * Reads part of the specified block into the designated buffer
+ */
+size_t block_store_pread(const block_store_t* const bs, const size_t block_id, const size_t offset,
+                         const size_t length, void* buffer) {
+    // Check params (the range has to fit in the block, written so it can't overflow)
+    if (!bs || block_id >= bs->total_blocks || !buffer || !length || offset >= bs->block_size
+        || length > bs->block_size - offset) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t read    = pread_block(bs, block_id, offset, length, buffer);
+    stats_record(bs, BS_STAT_READ, start, read, !read);
+    return read;
+}
+
+// Writes part of a block, block_store_pwrite without the stats
+static size_t pwrite_block(block_store_t* const bs, const size_t block_id, const size_t offset,
+                           const size_t length, const void* buffer) {
+    if (bs->cache) {
+        return cache_access(bs->cache, block_id, offset, length, (void*) buffer, true);
+    }
+    // The rest of the block has to be good, or its new checksum would cover for the damage
+    if (!block_fault_write(bs, block_id, true) || !checksum_verify(bs, block_id)) {
+        return 0;
+    }
+    journal_begin(bs);
+    memcpy(block_address(bs, block_id) + offset, buffer, length);
+    mark_dirty(bs, (block_id << bs->block_shift) + offset, length);
+    checksum_update(bs, block_id);
+    journal_log_write(bs, block_id, offset, length, buffer);
+    journal_end(bs);
+    return length;
+}
+
+/*
+ * Writes the buffer to part of the specified block
+ */
+size_t block_store_pwrite(block_store_t* const bs, const size_t block_id, const size_t offset,
+                          const size_t length, const void* buffer) {
+    // Check params (the range has to fit in the block, written so it can't overflow)
+    if (!bs || block_id >= bs->total_blocks || !buffer || !length || offset >= bs->block_size
+        || length > bs->block_size - offset) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t written = pwrite_block(bs, block_id, offset, length, buffer);
+    stats_record(bs, BS_STAT_WRITE, start, written, !written);
+    return written;
+}
+
+// Checks every id is a user block and every buffer can hold one
+static bool vector_valid(const block_store_t* const bs, const size_t* const ids, const size_t n,
+                         const struct iovec* const iov) {
+    if (!bs || !ids || !iov || !n) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (ids[i] >= bs->total_blocks || !iov[i].iov_base || iov[i].iov_len < bs->block_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// How many entries from i on form a run: consecutive blocks and buffers that follow on from each other
+static size_t vector_run(const block_store_t* const bs, const size_t* const ids, const size_t n,
+                         const struct iovec* const iov, const size_t i) {
+    // A snapshot's blocks aren't next to each other once it has pages
+    size_t run = 1;
+    if (bs->snapshot) {
+        return run;
+    }
+    while (i + run < n && ids[i + run] == ids[i] + run
+           && iov[i + run].iov_base == (uint8_t*) iov[i].iov_base + (run << bs->block_shift)) {
+        run++;
+    }
+    return run;
+}
+
+// Reads several blocks, block_store_readv without the stats
+static size_t read_blocks(const block_store_t* const bs, const size_t* const ids, const size_t n,
+                          const struct iovec* const iov) {
+    // A cached device's blocks aren't next to each other, they go one at a time
+    if (bs->cache) {
+        for (size_t i = 0; i < n; i++) {
+            if (!cache_access(bs->cache, ids[i], 0, bs->block_size, iov[i].iov_base, false)) {
+                return 0;
+            }
+        }
+        return n << bs->block_shift;
+    }
+    // Fault everything in first, so nothing is read unless all of it can be
+    for (size_t i = 0; i < n; i++) {
+        if (!block_fault(bs, ids[i], true)) {
+            return 0;
+        }
+    }
+    snapshot_read_begin(bs);
+    bool good = true;
+    for (size_t i = 0; good && i < n; i++) {
+        good = checksum_verify(bs, ids[i]);
+    }
+    for (size_t i = 0, run; good && i < n; i += run) {
+        run = vector_run(bs, ids, n, iov, i);
+        memcpy(iov[i].iov_base, block_address(bs, ids[i]), run << bs->block_shift);
+    }
+    snapshot_read_end(bs);
+    return good ? n << bs->block_shift : 0;
+}
+
+/*
+ * Reads several blocks into their buffers
+ */
+size_t block_store_readv(const block_store_t* const bs, const size_t* const ids, const size_t n,
+                         const struct iovec* const iov) {
+    // Check params
+    if (!vector_valid(bs, ids, n, iov)) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t read    = read_blocks(bs, ids, n, iov);
+    stats_record(bs, BS_STAT_READ, start, read, !read);
+    return read;
+}
+
+// Writes several blocks, block_store_writev without the stats
+static size_t write_blocks(block_store_t* const bs, const size_t* const ids, const size_t n,
+                           const struct iovec* const iov) {
+    if (bs->cache) {
+        for (size_t i = 0; i < n; i++) {
+            if (!cache_access(bs->cache, ids[i], 0, bs->block_size, iov[i].iov_base, true)) {
+                return 0;
+            }
+        }
+        return n << bs->block_shift;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (!block_fault_write(bs, ids[i], false)) {
+            return 0;
+        }
+    }
+    journal_begin(bs);
+    for (size_t i = 0, run; i < n; i += run) {
+        run = vector_run(bs, ids, n, iov, i);
+        memcpy(block_address(bs, ids[i]), iov[i].iov_base, run << bs->block_shift);
+        for (size_t block = 0; block < run; block++) {
+            const uint8_t* const data = (const uint8_t*) iov[i].iov_base + (block << bs->block_shift);
+            mark_dirty(bs, (ids[i] + block) << bs->block_shift, bs->block_size);
+            checksum_update(bs, ids[i] + block);
+            journal_log_write(bs, ids[i] + block, 0, bs->block_size, data);
+        }
+    }
+    journal_end(bs);
+    return n << bs->block_shift;
+}
+
+/*
+ * Writes several buffers to their blocks
+ */
+size_t block_store_writev(block_store_t* const bs, const size_t* const ids, const size_t n,
+                          const struct iovec* const iov) {
+    // Check params
+    if (!vector_valid(bs, ids, n, iov)) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t written = write_blocks(bs, ids, n, iov);
+    stats_record(bs, BS_STAT_WRITE, start, written, !written);
+    return written;
+}
+
+/*
+ * Gets a read-only pointer to the block's data, pinned until block_store_unpin
+ */
+const void* block_store_view(block_store_t* const bs, const size_t block_id) {
+    // Check params (a cached device's frames can be evicted out from under a pointer,
+    // and a snapshot's block can move to a page)
+    if (!bs || block_id >= bs->total_blocks || bs->cache || bs->snapshot) {
+        return NULL;
+    }
+
+    if (!block_fault(bs, block_id, true) || !checksum_verify(bs, block_id)) {
+        return NULL;
+    }
+    atomic_fetch_add_explicit(&bs->pins, 1, memory_order_relaxed);
+    return block_address(bs, block_id);
+}
+
+/*
+ * Gets a writable pointer to the block's data, pinned until block_store_unpin
+ */
+void* block_store_mut(block_store_t* const bs, const size_t block_id) {
+    // Check params (same as view)
+    if (!bs || block_id >= bs->total_blocks || bs->cache || bs->snapshot) {
+        return NULL;
+    }
+
+    // We can't see what gets written through it, so assume all of it (the checksum catches up on unpin)
+    if (!block_fault_write(bs, block_id, true) || !checksum_verify(bs, block_id)) {
+        return NULL;
+    }
+    mark_dirty(bs, block_id << bs->block_shift, bs->block_size);
+    atomic_fetch_add_explicit(&bs->pins, 1, memory_order_relaxed);
+    return block_address(bs, block_id);
+}
+
+/*
+ * Releases a pointer from block_store_view/mut
+ */
+void block_store_unpin(block_store_t* const bs, const size_t block_id) {
+    // Check params
+    if (!bs || block_id >= bs->total_blocks) {
+        return;
+    }
+
+    // Whatever was written through the pointer is in now
+    checksum_update(bs, block_id);
+
+    // Don't let a stray unpin wrap the count
+    size_t pins = atomic_load_explicit(&bs->pins, memory_order_relaxed);
+    while (pins && !atomic_compare_exchange_weak_explicit(&bs->pins, &pins, pins - 1, memory_order_relaxed,
+                                                          memory_order_relaxed)) {
+    }
+}
+
+/*
+ * Selects the free block map implementation
+ */
+bool block_store_set_fbm(block_store_t* const bs, const block_store_fbm_t fbm) {
+    // Check params
+    if (!bs) {
+        return false;
+    }
+
+    if (fbm == BS_FBM_HIER) {
+        // The summary isn't atomic, so it can't be used in concurrent mode
+        if (bs->concurrent) {
+            return false;
+        }
+        // The summary is built from the current map, so this can happen at any time
+        if (!bs->fbm_index) {
+            bs->fbm_index = bitmap_hier_wrap(bs->fbm);
+        }
+        return bs->fbm_index != NULL;
+    } else if (fbm == BS_FBM_FLAT) {
+        // The bitmap itself is always up to date, just drop the summary
+        bitmap_hier_destroy(bs->fbm_index);
+        bs->fbm_index = NULL;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Selects how block_store_allocate picks a free block
+ */
+bool block_store_set_alloc_policy(block_store_t* const bs, const block_store_alloc_policy_t policy) {
+    // Check params
+    if (!bs || (policy != BS_ALLOC_FIRST_FIT && policy != BS_ALLOC_NEXT_FIT)) {
+        return false;
+    }
+
+    bs->alloc_policy = policy;
+    bs->alloc_cursor = 0;
+    return true;
+}
+
+/*
+ * Switches the device in or out of concurrent mode
+ */
+bool block_store_set_concurrent(block_store_t* const bs, const bool enable) {
+    // Check params (the summary isn't atomic, so it has to go first)
+    if (!bs || (enable && bs->fbm_index)) {
+        return false;
+    }
+
+    if (!enable) {
+        free(bs->region_hints);
+        bs->region_hints = NULL;
+    } else if (!bs->region_hints) {
+        // Split the fbm into regions of whole words, every region's threads start at its beginning
+        const size_t words = (bs->block_count + 63) >> 6;
+        size_t region_words = (words + ALLOC_REGIONS - 1) / ALLOC_REGIONS;
+        if (region_words < (REGION_MIN_BITS >> 6)) {
+            region_words = REGION_MIN_BITS >> 6;
+        }
+        bs->region_bits  = region_words << 6;
+        bs->region_count = (bs->block_count + bs->region_bits - 1) / bs->region_bits;
+        bs->region_hints = malloc(bs->region_count * sizeof(atomic_size_t));
+        if (!bs->region_hints) {
+            return false;
+        }
+        for (size_t region = 0; region < bs->region_count; region++) {
+            atomic_init(&bs->region_hints[region], region * bs->region_bits);
+        }
+    }
+
+    // The dirty map is ours, so it's always aligned
+    if (bitmap_set_concurrent(bs->fbm, enable)) {
+        bitmap_set_concurrent(bs->dirty, enable);
+        bs->concurrent = enable;
+        return true;
+    }
+    free(bs->region_hints);
+    bs->region_hints = NULL;
+    return false;
+}
+
+/*
+ * Turns per-block checksums on or off
+ */
+bool block_store_set_checksums(block_store_t* const bs, const bool enable) {
+    // Check params (a cached device doesn't have its blocks at hand to checksum,
+    // and a snapshot keeps whatever checksums it was taken with)
+    if (!bs || bs->cache || bs->snapshot) {
+        return false;
+    }
+
+    if (!enable) {
+        free(bs->checksums);
+        bs->checksums = NULL;
+        return true;
+    }
+    // Whatever is in the blocks now is taken to be good (cold ones stay cold)
+    if (!bs->checksums) {
+        uint32_t* const checksums = malloc(bs->total_blocks * sizeof(uint32_t));
+        uint8_t* const scratch    = malloc(bs->block_size);
+        bool success              = checksums && scratch && lazy_load_all(bs);
+        if (success) {
+            if (bs->cold) {
+                pthread_mutex_lock(&bs->cold->lock);
+            }
+            for (size_t i = 0; success && i < bs->total_blocks; i++) {
+                const uint8_t* const data = cold_peek(bs, i, scratch);
+                success                   = data != NULL;
+                checksums[i]              = success ? crc32c(0, data, bs->block_size) : 0;
+            }
+            if (bs->cold) {
+                pthread_mutex_unlock(&bs->cold->lock);
+            }
+        }
+        free(scratch);
+        if (!success) {
+            free(checksums);
+            return false;
+        }
+        bs->checksums = checksums;
+    }
+    return true;
+}
+
+/*
+ * Gets the checksum kept for a block
+ */
+bool block_store_get_checksum(const block_store_t* const bs, const size_t block_id, uint32_t* const checksum) {
+    // Check params
+    if (!bs || !bs->checksums || block_id >= bs->total_blocks || !checksum) {
+        return false;
+    }
+
+    *checksum = bs->checksums[block_id];
+    return true;
+}
+
+/*
+ * Checks every block against its checksum
+ */
+size_t block_store_scrub(const block_store_t* const bs, size_t* const bad_ids, const size_t max_ids) {
+    // Check params
+    if (!bs || !bs->checksums) {
+        return 0;
+    }
+
+    // Cold blocks were checked on their way into the cold tier, and their frames carry a check of their own
+    size_t bad = 0;
+    for (size_t i = 0; i < bs->total_blocks; i++) {
+        if (cold_test(bs, i)) {
+            continue;
+        }
+        // Not a use as far as the cold tier goes, so it doesn't keep everything warm
+        bool good = lazy_fault(bs, i, true);
+        if (good) {
+            snapshot_read_begin(bs);
+            good = checksum_verify(bs, i);
+            snapshot_read_end(bs);
+        }
+        if (!good) {
+            if (bad_ids && bad < max_ids) {
+                bad_ids[bad] = i;
+            }
+            bad++;
+        }
+    }
+    return bad;
+}
+
+/*
+ * Turns the cold tier on or off
+ */
+bool block_store_set_cold_tier(block_store_t* const bs, const bool enable) {
+    // Check params (a mapped or cached device's blocks are already the kernel's or the cache's to evict,
+    // and snapshots read blocks straight from the slab)
+    if (!bs || bs->map || bs->cache || bs->snapshot || (enable && snapshot_count(bs))) {
+        return false;
+    }
+
+    if (!enable) {
+        // Everything has to be warm again before the frames can go
+        for (size_t i = 0; bs->cold && i < bs->total_blocks; i++) {
+            if (!cold_fault(bs, i, true)) {
+                return false;
+            }
+        }
+        cold_destroy(bs);
+        return true;
+    }
+    if (bs->cold) {
+        return true;
+    }
+    cold_tier_t* const cold = calloc(1, sizeof(cold_tier_t));
+    if (!cold || !lazy_load_all(bs)) {
+        free(cold);
+        return false;
+    }
+    pthread_mutex_init(&cold->lock, NULL);
+    cold->cold        = bitmap_create(bs->total_blocks);
+    cold->accessed    = bitmap_create(bs->total_blocks);
+    cold->frames      = calloc(bs->total_blocks, sizeof(uint8_t*));
+    cold->frame_bytes = calloc(bs->total_blocks, sizeof(size_t));
+    cold->scratch     = malloc(frame_bound(bs));
+    bs->cold          = cold;
+    if (!cold->cold || !cold->accessed || !cold->frames || !cold->frame_bytes || !cold->scratch) {
+        cold_destroy(bs);
+        return false;
+    }
+    // Every block starts out used, so none goes cold before it has had a whole round to be used in
+    bitmap_set_range(cold->accessed, 0, bs->total_blocks);
+    return true;
+}
+
+/*
+ * Compresses the blocks that haven't been used since the last call
+ */
+size_t block_store_compact_cold(block_store_t* const bs) {
+    // Check param, and a pinned pointer would see its block go away
+    if (!bs || !bs->cold || atomic_load_explicit(&bs->pins, memory_order_relaxed)) {
+        return 0;
+    }
+
+    cold_tier_t* const cold = bs->cold;
+    pthread_mutex_lock(&cold->lock);
+    size_t compacted = 0;
+    for (size_t i = 0; i < bs->total_blocks; i++) {
+        // Damaged blocks stay where block_store_scrub can find them
+        if (bitmap_test(cold->cold, i) || bitmap_test(cold->accessed, i) || !checksum_verify(bs, i)) {
+            continue;
+        }
+        // Not worth a frame unless it saves at least a quarter of the block
+        const size_t length = block_encode(bs, block_address(bs, i), cold->scratch);
+        uint8_t* const frame = length <= bs->block_size - bs->block_size / 4 ? malloc(length) : NULL;
+        if (frame) {
+            memcpy(frame, cold->scratch, length);
+            cold->frames[i]      = frame;
+            cold->frame_bytes[i] = length;
+            cold->stats.blocks++;
+            cold->stats.bytes += length;
+            bitmap_set(cold->cold, i);
+            compacted++;
+        }
+    }
+    // Start the next round, and let go of whatever is only cold blocks now
+    bitmap_format(cold->accessed, 0x00);
+    cold_release_pages(bs);
+    pthread_mutex_unlock(&cold->lock);
+    return compacted;
+}
+
+/*
+ * Gets the size of the cold tier
+ */
+bool block_store_get_cold_stats(block_store_t* const bs, block_store_cold_stats_t* const stats) {
+    // Check params
+    if (!bs || !bs->cold || !stats) {
+        return false;
+    }
+
+    pthread_mutex_lock(&bs->cold->lock);
+    *stats = bs->cold->stats;
+    pthread_mutex_unlock(&bs->cold->lock);
+    return true;
+}
 
-// Define block_store_t
-typedef struct block_store {
-    void* block;
-} block_store_t;
+/*
+ * Imports BS device from the given file
+ */
+block_store_t* block_store_deserialize(const char* const filename) {
+    // Check param
+    if (!filename) {
+        return NULL;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // A compressed image is decompressed a frame at a time, which the lazy loader already does
+    if (image_compressed(fd)) {
+        close(fd);
+        block_store_t* const bs = block_store_open_lazy(filename, false);
+        if (bs && !lazy_load_all(bs)) {
+            block_store_destroy(bs);
+            return NULL;
+        }
+        if (bs) {
+            lazy_destroy(bs);
+        }
+        return bs;
+    }
+
+    // Everything about the device comes from the header
+    image_header_t header;
+    block_store_t* bs = NULL;
+    if (image_header_read(fd, &header)) {
+        bs = block_store_create_ex(header.block_size, header.block_count);
+    }
+
+    if (bs) {
+        // Then the rest in one go, straight into the slab. The padding goes nowhere useful.
+        uint8_t padding[IMAGE_ALIGNMENT];
+        struct iovec iov[3] = {
+            {block_address(bs, bs->total_blocks), header.fbm_bytes},
+            {padding, header.data_offset - header.fbm_offset - header.fbm_bytes},
+            {bs->data, header.data_bytes},
+        };
+        if (read_all(fd, iov, 3)) {
+            // Anything journaled since the image was written goes on top (checksums first, so they keep up)
+            checksum_load(bs, filename);
+            journal_replay(bs, filename);
+            // The fbm's own blocks are always in use, no matter what the file says
+            for (size_t i = bs->total_blocks; i < bs->block_count; i++) {
+                bitmap_set(bs->fbm, i);
+            }
+            used_recount(bs);
+            close(fd);
+            return bs;
+        }
+        block_store_destroy(bs);
+    }
+    close(fd);
+    return NULL;
+}
+
+// Writes the whole device to a file, block_store_serialize without the stats
+static size_t serialize_image(const block_store_t* const bs, const char* const filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+
+    const size_t written = image_write(bs, fd);
+
+    // Close can report a failed write too. The checksums go next to the image (if we keep any)
+    if (close(fd) == 0 && written && checksum_save(bs, filename)) {
+        return written;
+    }
+    return 0;
+}
 
 /*
- *  This creates a new BS device, ready to go
+ * Writes the entirety of the BS device to file, overwriting it if it exists
  */
-block_store_t* block_store_create() {
-    // Allocate space for 256 block addresses
-    block_store_t* bs = malloc(sizeof(block_store_t) * BLOCK_COUNT);
+size_t block_store_serialize(const block_store_t* const bs, const char* const filename) {
+    // Check params (a cached device doesn't have its blocks in memory to write out)
+    if (!bs || !filename || bs->cache) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t written = serialize_image(bs, filename);
+    stats_record(bs, BS_STAT_SERIALIZE, start, written, !written);
+    return written;
+}
 
-    // Allocate 256 bytes for each block
-    // These are not contiguous, but are addressable via an array of blocks
-    for (int i = 0; i < BLOCK_COUNT - 1; i++) {
-        bs[i].block = malloc(BLOCK_SIZE);
+// Writes the dirty blocks to an image, block_store_serialize_incremental without the stats
+static size_t serialize_dirty(block_store_t* const bs, const int fd) {
+    // If the file isn't already an image of this device (that's whole), everything has to go
+    image_header_t header, existing;
+    image_header_fill(&header, bs->block_size, bs->block_count);
+    struct stat info;
+    const bool whole = pread(fd, &existing, sizeof(existing), 0) == (ssize_t) sizeof(existing)
+                       && memcmp(&header, &existing, sizeof(header)) == 0 && fstat(fd, &info) == 0
+                       && (uint64_t) info.st_size >= header.data_offset + header.data_bytes;
+    if (!whole) {
+        static const uint8_t padding[IMAGE_ALIGNMENT];
+        if (!lazy_load_all(bs) || !pwrite_all(fd, &header, sizeof(header), 0)
+            || !pwrite_all(fd, padding, header.data_offset - header.fbm_offset - header.fbm_bytes,
+                           header.fbm_offset + header.fbm_bytes)) {
+            return 0;
+        }
+        bitmap_set_range(bs->dirty, 0, bs->total_blocks);
     }
 
-    // Allocate 255th block for bitmap and set bit 255 accordingly
-    bs[BLOCK_COUNT - 1].block = bitmap_create(BLOCK_COUNT);
-    bitmap_set(bs[BLOCK_COUNT - 1].block, BLOCK_COUNT - 1);
-    return bs;
+    // Each run of dirty blocks is one pwrite. The bits are cleared before the data is read,
+    // so a block written meanwhile stays dirty for next time
+    size_t written = whole ? 0 : header.data_offset - header.fbm_bytes;
+    bitmap_iter_t it;
+    bitmap_iter_init(&it, bs->dirty);
+    for (size_t block = bitmap_next_set(&it); block != SIZE_MAX;) {
+        size_t end = block + 1, next;
+        while ((next = bitmap_next_set(&it)) == end) {
+            end++;
+        }
+        const size_t length = (end - block) << bs->block_shift;
+        bitmap_reset_range(bs->dirty, block, end - block);
+        bool loaded = true;
+        for (size_t i = block; i < end && loaded; i++) {
+            loaded = block_fault(bs, i, true);
+        }
+        if (!loaded
+            || !pwrite_all(fd, block_address(bs, block), length, header.data_offset + (block << bs->block_shift))) {
+            // Ours wasn't written after all, nor is anything we didn't get to
+            bitmap_set_range(bs->dirty, block, bs->total_blocks - block);
+            return 0;
+        }
+        written += length;
+        block = next;
+    }
+
+    // The fbm goes last, it has to describe the blocks that are there
+    if (!pwrite_all(fd, bitmap_export(bs->fbm), header.fbm_bytes, header.fbm_offset)) {
+        return 0;
+    }
+    return written + header.fbm_bytes;
 }
 
 /*
- * Destroys the provided block storage devices
+ * Writes the blocks changed since the last incremental serialize (and the fbm) to an image
  */
-void block_store_destroy(block_store_t* const bs) {
+size_t block_store_serialize_incremental(block_store_t* const bs, const int fd) {
+    // Check params (same as serialize, and a snapshot's blocks don't come in runs. block_store_diff is for those)
+    if (!bs || fd < 0 || bs->cache || bs->snapshot) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t written = serialize_dirty(bs, fd);
+    stats_record(bs, BS_STAT_SERIALIZE, start, written, !written);
+    return written;
+}
+
+// Writes the whole device to a file compressed, block_store_serialize_compressed without the stats
+static size_t serialize_frames(const block_store_t* const bs, const char* const filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+
+    compressed_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, compressed_magic, sizeof(header.magic));
+    header.version      = COMPRESSED_VERSION;
+    header.header_size  = sizeof(header);
+    header.block_size   = bs->block_size;
+    header.block_count  = bs->block_count;
+    header.fbm_offset   = sizeof(header);
+    header.fbm_bytes    = fbm_bytes(bs->block_count);
+    header.index_offset = header.fbm_offset + header.fbm_bytes;
+    header.data_offset  = header.index_offset + (bs->total_blocks + 1) * sizeof(uint64_t);
+
+    // Frames pile up in a buffer and go out whenever another might not fit,
+    // the index and header go last, once we know where everything ended up
+    const size_t buffer_size = frame_bound(bs) > COMPRESSED_BUFFER ? frame_bound(bs) : COMPRESSED_BUFFER;
+    uint64_t* const index    = malloc((bs->total_blocks + 1) * sizeof(uint64_t));
+    uint8_t* const buffer    = malloc(buffer_size);
+    bool success             = index && buffer && lazy_load_all(bs);
+    uint64_t offset = header.data_offset, flushed = header.data_offset;
+    const bool locked = success && bs->cold;
+    if (locked) {
+        pthread_mutex_lock(&bs->cold->lock);
+    }
+    snapshot_read_begin(bs);
+    for (size_t i = 0; success && i < bs->total_blocks; i++) {
+        if (buffer_size - (offset - flushed) < frame_bound(bs)) {
+            success = pwrite_all(fd, buffer, offset - flushed, flushed);
+            flushed = offset;
+        }
+        // A cold block is already a frame
+        uint8_t* const frame = buffer + (offset - flushed);
+        size_t length;
+        if (bs->cold && bitmap_test(bs->cold->cold, i)) {
+            length = bs->cold->frame_bytes[i];
+            memcpy(frame, bs->cold->frames[i], length);
+        } else {
+            length = block_encode(bs, block_address(bs, i), frame);
+        }
+        index[i] = offset;
+        offset += length;
+    }
+    snapshot_read_end(bs);
+    if (locked) {
+        pthread_mutex_unlock(&bs->cold->lock);
+    }
+    if (success) {
+        index[bs->total_blocks] = offset;
+        success = pwrite_all(fd, buffer, offset - flushed, flushed)
+                  && pwrite_all(fd, index, (bs->total_blocks + 1) * sizeof(uint64_t), header.index_offset)
+                  && pwrite_all(fd, bitmap_export(bs->fbm), header.fbm_bytes, header.fbm_offset)
+                  && pwrite_all(fd, &header, sizeof(header), 0);
+    }
+    free(buffer);
+    free(index);
+
+    // Same as serialize from here
+    if (close(fd) == 0 && success && checksum_save(bs, filename)) {
+        return offset;
+    }
+    return 0;
+}
+
+/*
+ * Writes the entirety of the BS device to file with every block compressed
+ */
+size_t block_store_serialize_compressed(const block_store_t* const bs, const char* const filename) {
+    // Check params (same as serialize)
+    if (!bs || !filename || bs->cache) {
+        return 0;
+    }
+
+    const uint64_t start = stats_start(bs);
+    const size_t written = serialize_frames(bs, filename);
+    stats_record(bs, BS_STAT_SERIALIZE, start, written, !written);
+    return written;
+}
+
+/*
+ * Opens a serialized BS device in place
+ */
+block_store_t* block_store_open_mmap(const char* const filename) {
     // Check param
-    if (!bs) {
-        return;
+    if (!filename) {
+        return NULL;
     }
 
-    // Destroy bitmap (this will deallocate)
-    bitmap_destroy(bs[BLOCK_COUNT - 1].block);
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
 
-    // Deallocate the first 255 blocks
-    for (int i = 0; i < BLOCK_COUNT - 1; i++) {
-        free(bs[i].block);
+    // Same image as deserialize, we just use it where it is
+    // The descriptor stays open for the async calls, they go to the file itself
+    image_header_t header;
+    uint8_t* map = MAP_FAILED;
+    if (image_header_read(fd, &header)) {
+        map = mmap(NULL, header.data_offset + header.data_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
     }
 
-    // Finally, deallocate all the block pointers
-    free(bs);
-    return;
+    block_store_t* bs = block_store_alloc(header.block_size, header.block_count);
+    if (bs) {
+        bs->fd         = fd;
+        bs->map        = map;
+        bs->map_size   = header.data_offset + header.data_bytes;
+        bs->data       = map + header.data_offset;
+        bs->fbm        = bitmap_overlay(bs->block_count, map + header.fbm_offset);
+        bs->image_path = strdup(filename);
+        if (bs->fbm && bs->image_path) {
+            checksum_load(bs, filename);
+            // The fbm's own blocks are always in use, but don't dirty the page if the file agrees
+            for (size_t i = bs->total_blocks; i < bs->block_count; i++) {
+                if (!bitmap_test(bs->fbm, i)) {
+                    bitmap_set(bs->fbm, i);
+                }
+            }
+            used_recount(bs);
+            return bs;
+        }
+        block_store_destroy(bs);
+        return NULL;
+    }
+    munmap(map, header.data_offset + header.data_bytes);
+    close(fd);
+    return NULL;
 }
 
 /*
- * Searches for a free block, marks it as in use
- * and returns the block's id
+ * Opens a serialized BS device, reading in only the header and fbm until the blocks are needed
  */
-size_t block_store_allocate(block_store_t* const bs) {
+block_store_t* block_store_open_lazy(const char* const filename, const bool prefetch) {
     // Check param
-    if (!bs) {
-        return SIZE_MAX;
+    if (!filename) {
+        return NULL;
     }
 
-    // Find index of first zero through the bitmap_ffz function
-    size_t block = bitmap_ffz(bs[BLOCK_COUNT - 1].block);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
 
-    if (block == SIZE_MAX) { // This means there are no free blocks
-        return SIZE_MAX;
-    } else { // We've found a free block. Set bitmap and return index
-        bitmap_set(bs[BLOCK_COUNT - 1].block, block);
-        return block;
+    // Same image and device as deserialize, the blocks just stay in the file for now
+    // (a compressed image's index says where to find each one)
+    image_header_t header;
+    compressed_header_t compressed;
+    uint64_t* index   = NULL;
+    block_store_t* bs = NULL;
+    if (image_compressed(fd)) {
+        if ((index = compressed_header_read(fd, &compressed))) {
+            header.fbm_offset = compressed.fbm_offset;
+            header.fbm_bytes  = compressed.fbm_bytes;
+            bs                = block_store_create_ex(compressed.block_size, compressed.block_count);
+        }
+    } else if (image_header_read(fd, &header)) {
+        bs = block_store_create_ex(header.block_size, header.block_count);
+    }
+    lazy_load_t* const lazy = bs ? calloc(1, sizeof(lazy_load_t)) : NULL;
+    if (!lazy) {
+        block_store_destroy(bs);
+        free(index);
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_init(&lazy->lock, NULL);
+    lazy->fd          = fd;
+    lazy->data_offset = index ? 0 : header.data_offset;
+    lazy->index       = index;
+    lazy->frame       = index ? malloc(frame_bound(bs)) : NULL;
+    lazy->remaining   = bs->total_blocks;
+    lazy->loaded      = bitmap_create(bs->total_blocks);
+    atomic_init(&lazy->complete, false);
+    atomic_init(&lazy->stop, false);
+    bs->lazy = lazy;
+    if (!lazy->loaded || (index && !lazy->frame)
+        || !pread_all(fd, block_address(bs, bs->total_blocks), header.fbm_bytes, header.fbm_offset)) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    // The journal only faults in the blocks it writes to
+    checksum_load(bs, filename);
+    journal_replay(bs, filename);
+    for (size_t i = bs->total_blocks; i < bs->block_count; i++) {
+        bitmap_set(bs->fbm, i);
+    }
+    used_recount(bs);
+
+    // The prefetcher works from a copy of the fbm, the device's own can change under it
+    if (prefetch) {
+        lazy->order       = bitmap_import(bs->block_count, bitmap_export(bs->fbm));
+        lazy->prefetching = lazy->order && pthread_create(&lazy->prefetcher, NULL, lazy_prefetcher, bs) == 0;
+        if (!lazy->prefetching) {
+            block_store_destroy(bs);
+            return NULL;
+        }
     }
+    return bs;
 }
 
 /*
- * Attempts to allocate the requested block id
+ * Opens a serialized BS device with only a bounded cache of its blocks in memory
  */
-bool block_store_request(block_store_t* const bs, const size_t block_id) {
+block_store_t* block_store_open_cached(const char* const filename, const size_t cache_blocks) {
     // Check params
-    if (!bs || block_id > BLOCK_COUNT - 1) {
-        return false;
+    if (!filename || !cache_blocks) {
+        return NULL;
     }
 
-    // Test the requested block to see if it's available or not
-    if (!bitmap_test(bs[BLOCK_COUNT - 1].block, block_id)) {
-        bitmap_set(bs[BLOCK_COUNT - 1].block, block_id); // If free, set bitmap
-        return true;
-    } else {
-        return false; // No go
+    int fd = open(filename, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Same image as deserialize, but only the fbm is read in. It's small and every allocation needs it
+    image_header_t header;
+    block_store_t* bs = NULL;
+    uint8_t* fbm_data = NULL;
+    if (image_header_read(fd, &header) && (fbm_data = malloc(header.fbm_bytes))
+        && pread_all(fd, fbm_data, header.fbm_bytes, header.fbm_offset)) {
+        bs = block_store_alloc(header.block_size, header.block_count);
+    }
+    if (!bs) {
+        free(fbm_data);
+        close(fd);
+        return NULL;
+    }
+    bs->fd  = fd;
+    bs->fbm = bitmap_import(bs->block_count, fbm_data);
+    free(fbm_data);
+    // No point in more frames than there are blocks
+    bs->cache = bs->fbm ? cache_create(bs, cache_blocks < bs->total_blocks ? cache_blocks : bs->total_blocks,
+                                       header.data_offset)
+                        : NULL;
+    if (!bs->cache) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    for (size_t i = bs->total_blocks; i < bs->block_count; i++) {
+        bitmap_set(bs->fbm, i);
+    }
+    used_recount(bs);
+
+    // Checksums aren't kept through the cache, and once it writes back any we have would be wrong
+    char* const checksum_file = sidecar_path(filename, CHECKSUM_SUFFIX);
+    if (checksum_file) {
+        unlink(checksum_file);
+    }
+    free(checksum_file);
+    return bs;
+}
+
+/*
+ * Gets the cache counters of a cached device
+ */
+bool block_store_get_cache_stats(block_store_t* const bs, block_store_cache_stats_t* const stats) {
+    // Check params
+    if (!bs || !bs->cache || !stats) {
+        return false;
     }
+
+    pthread_mutex_lock(&bs->cache->lock);
+    *stats = bs->cache->stats;
+    pthread_mutex_unlock(&bs->cache->lock);
+    return true;
 }
 
 /*
- * Frees the specified block
+ * Flushes everything written to a mapped or cached device back to its file
  */
-void block_store_release(block_store_t* const bs, const size_t block_id) {
+bool block_store_sync(block_store_t* const bs) {
     // Check param
-    if (!bs) {
-        return;
+    if (!bs || (!bs->map && !bs->cache)) {
+        return false;
+    }
+
+    // A cached device just writes back what it's holding
+    if (bs->cache) {
+        return cache_sync(bs);
+    }
+
+    // Header and fbm are small and change all the time, always flush them
+    const size_t data_offset = (size_t)(bs->data - bs->map);
+    if (msync(bs->map, data_offset, MS_SYNC)) {
+        return false;
     }
 
-    // Could've checked to see if it was already cleared, but the same
-    // result is achieved regardless
-    bitmap_reset(bs[BLOCK_COUNT - 1].block, block_id);
+    // Then just the range of blocks that has been written, msync wants it page aligned
+    // Take the range first, anything written while we flush is left for the next sync
+    const size_t dirty_start = atomic_exchange_explicit(&bs->dirty_start, SIZE_MAX, memory_order_relaxed);
+    const size_t dirty_end   = atomic_exchange_explicit(&bs->dirty_end, 0, memory_order_relaxed);
+    if (dirty_start < dirty_end) {
+        const size_t page  = (size_t) sysconf(_SC_PAGESIZE);
+        const size_t start = (data_offset + dirty_start) & ~(page - 1);
+        const size_t end   = data_offset + dirty_end;
+        if (msync(bs->map + start, end - start, MS_SYNC)) {
+            // Didn't make it, so it's still dirty
+            mark_dirty(bs, dirty_start, dirty_end - dirty_start);
+            return false;
+        }
+    }
+    return checksum_save(bs, bs->image_path);
 }
 
 /*
- * Counts the number of blocks marked as in use
+ * Starts journaling every change to the device, checkpointing it to the given image first
  */
-size_t block_store_get_used_blocks(const block_store_t* const bs) {
+bool block_store_journal_open(block_store_t* const bs, const char* const filename, const size_t checkpoint_bytes) {
+    // Check params (a mapped or cached device already writes to its image, and a snapshot can't be replayed)
+    if (!bs || !filename || bs->map || bs->cache || bs->snapshot || bs->journal) {
+        return false;
+    }
+
+    journal_t* const journal = calloc(1, sizeof(journal_t));
+    if (!journal || !(journal->image = strdup(filename)) || !(journal->path = sidecar_path(filename, JOURNAL_SUFFIX))
+        || !(journal->old_path = sidecar_path(filename, JOURNAL_OLD_SUFFIX))
+        || (journal->fd = open(journal->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        if (journal) {
+            free(journal->old_path);
+            free(journal->path);
+            free(journal->image);
+        }
+        free(journal);
+        return false;
+    }
+    journal->checkpoint_bytes = checkpoint_bytes;
+    // Whatever old journal a crash left behind is in the device already, the first checkpoint clears it out
+    journal->old_segment = true;
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->flushed, NULL);
+    pthread_cond_init(&journal->wake, NULL);
+
+    // Start from an image that matches the device and an empty journal,
+    // so whatever was there before can't replay on top of us
+    bs->journal = journal;
+    pthread_mutex_lock(&journal->lock);
+    bool success = journal_checkpoint_locked(bs);
+    pthread_mutex_unlock(&journal->lock);
+    if (success && checkpoint_bytes) {
+        success = journal->checkpointer_running =
+            pthread_create(&journal->checkpointer, NULL, journal_checkpointer, bs) == 0;
+    }
+    if (!success) {
+        block_store_journal_close(bs);
+    }
+    return success;
+}
+
+/*
+ * Makes everything journaled so far durable
+ */
+bool block_store_journal_commit(block_store_t* const bs) {
     // Check param
-    if (!bs) {
-        return SIZE_MAX;
+    if (!bs || !bs->journal) {
+        return false;
     }
 
-    // Call the provided bitmap function to return number of set blocks
-    size_t used_blocks = bitmap_total_set(bs[BLOCK_COUNT - 1].block);
+    journal_t* const journal = bs->journal;
+    pthread_mutex_lock(&journal->lock);
+    const uint64_t target = journal->appended;
+    while (journal->durable < target && !journal->failed) {
+        if (journal->flushing) {
+            // Someone else is writing, which may well cover our records too
+            pthread_cond_wait(&journal->flushed, &journal->lock);
+            continue;
+        }
 
-    // Need to subtract 1 because we don't care that the bitmap's index is set
-    return used_blocks - 1;
+        // Take the whole batch, and let the next one build up in the spare buffer meanwhile
+        uint8_t* const batch     = journal->buffer;
+        const size_t batch_bytes = journal->buffer_used, batch_size = journal->buffer_size;
+        const uint64_t batch_end = journal->appended;
+        journal->buffer          = journal->spare;
+        journal->buffer_size     = journal->spare_size;
+        journal->buffer_used     = 0;
+        journal->flushing        = true;
+        pthread_mutex_unlock(&journal->lock);
+
+        struct iovec iov   = {batch, batch_bytes};
+        const bool success = write_all(journal->fd, &iov, 1) && fdatasync(journal->fd) == 0;
+
+        pthread_mutex_lock(&journal->lock);
+        journal->spare      = batch;
+        journal->spare_size = batch_size;
+        journal->flushing   = false;
+        if (success) {
+            journal->durable = batch_end;
+            journal->file_bytes += batch_bytes;
+            if (journal->checkpoint_bytes && journal->file_bytes >= journal->checkpoint_bytes) {
+                pthread_cond_signal(&journal->wake);
+            }
+        } else {
+            // Part of the batch may be in the file, nothing after it could be replayed
+            journal->failed = true;
+        }
+        pthread_cond_broadcast(&journal->flushed);
+    }
+    const bool success = journal->durable >= target;
+    pthread_mutex_unlock(&journal->lock);
+    return success;
 }
 
 /*
- * Counts the number of blocks marked free for use
+ * Writes the device to its image and empties the journal
  */
-size_t block_store_get_free_blocks(const block_store_t* const bs) {
+bool block_store_journal_checkpoint(block_store_t* const bs) {
     // Check param
-    if (!bs) {
-        return SIZE_MAX;
+    if (!bs || !bs->journal) {
+        return false;
     }
 
-    // This number is just the difference of 256 and used_blocks that we found
-    size_t free_blocks = BLOCK_COUNT - bitmap_total_set(bs[BLOCK_COUNT - 1].block);
-    return free_blocks;
+    pthread_mutex_lock(&bs->journal->lock);
+    const bool success = journal_checkpoint(bs);
+    pthread_mutex_unlock(&bs->journal->lock);
+    return success;
 }
 
 /*
- * Returns the total number of user-addressable blocks
- * (since this is constant, you don't even need bs object)
+ * Commits what's left and stops journaling
  */
-size_t block_store_get_total_blocks() {
-    // This is constant. Easy!
-    return BLOCK_COUNT - 1;
+bool block_store_journal_close(block_store_t* const bs) {
+    // Check param
+    if (!bs || !bs->journal) {
+        return false;
+    }
+
+    // The checkpointer goes first, it can move the journal to a new file
+    journal_t* const journal = bs->journal;
+    if (journal->checkpointer_running) {
+        pthread_mutex_lock(&journal->lock);
+        journal->stop = true;
+        pthread_cond_signal(&journal->wake);
+        pthread_mutex_unlock(&journal->lock);
+        pthread_join(journal->checkpointer, NULL);
+    }
+    const bool success = journal->fd >= 0 && block_store_journal_commit(bs);
+    bs->journal = NULL;
+    pthread_cond_destroy(&journal->wake);
+    pthread_cond_destroy(&journal->flushed);
+    pthread_mutex_destroy(&journal->lock);
+    close(journal->fd);
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal->old_path);
+    free(journal->path);
+    free(journal->image);
+    free(journal);
+    return success;
 }
 
 /*
- * Reads data from the specified block and writes it to designated buffer
+ * Queues an asynchronous read of a block
  */
-size_t block_store_read(const block_store_t* const bs, const size_t block_id, void* buffer) {
+bool block_store_read_async(block_store_t* const bs, const size_t block_id, void* const buffer,
+                            const block_store_io_callback_t callback, void* const arg) {
     // Check params
-    if (!bs || block_id > BLOCK_COUNT - 1 || !buffer) {
-        return 0;
+    if (!bs || block_id >= bs->total_blocks || !buffer || !callback) {
+        return false;
     }
 
-    // Simply copy the memory and return success
-    memcpy(buffer, bs[block_id].block, BLOCK_SIZE);
-    return BLOCK_SIZE;
+    return async_queue(bs, block_id, buffer, false, callback, arg);
 }
 
 /*
- * Reads data from buffer and writes it to designated block
+ * Queues an asynchronous write of a block
  */
-size_t block_store_write(block_store_t* const bs, const size_t block_id, const void* buffer) {
+bool block_store_write_async(block_store_t* const bs, const size_t block_id, const void* const buffer,
+                             const block_store_io_callback_t callback, void* const arg) {
     // Check params
-    if (!bs || block_id > BLOCK_COUNT - 1 || !buffer) {
-        return 0;
+    if (!bs || block_id >= bs->total_blocks || !buffer || !callback) {
+        return false;
     }
 
-    // block_id is already tested in tests.cpp, so we can assume block is free
-    // Simply copy the memory and return success
-    memcpy(bs[block_id].block, buffer, BLOCK_SIZE);
-    return BLOCK_SIZE;
+    // The buffer is only ever read from for a write
+    return async_queue(bs, block_id, (void*) buffer, true, callback, arg);
 }
 
-block_store_t* block_store_deserialize(const char* const filename) {
+/*
+ * Submits everything queued and runs the callbacks of what has completed
+ */
+size_t block_store_poll(block_store_t* const bs, const bool wait) {
     // Check param
-    if (!filename) {
+    if (!bs || !bs->async) {
+        return 0;
+    }
+
+    async_io_t* const io = bs->async;
+    async_submit(bs, io, wait);
+
+    // Slots go back before the callbacks run, so a callback can queue the next request
+    size_t completed = 0;
+    for (async_request_t *request = async_take_done(io), *next; request; request = next, completed++) {
+        next                                     = request->next;
+        const block_store_io_callback_t callback = request->callback;
+        void* const arg                          = request->arg;
+        const size_t block_id = request->block_id;
+        size_t result         = request->result;
+        // A read that doesn't match its checksum failed
+        if (result && !request->write && bs->checksums
+            && bs->checksums[block_id] != crc32c(0, request->buffer, bs->block_size)) {
+            result = 0;
+        }
+        // A file write is only in the block once it's all there, the checksum can't go ahead of it
+        // (a heap device did all this as it copied)
+        if (result && request->write && io->file >= 0) {
+            mark_dirty(bs, block_id << bs->block_shift, bs->block_size);
+            if (bs->checksums) {
+                bs->checksums[block_id] = crc32c(0, request->buffer, bs->block_size);
+            }
+        }
+        request->next = io->free;
+        io->free      = request;
+        io->in_flight--;
+        callback(block_id, result, arg);
+    }
+    return completed;
+}
+
+/*
+ * Takes a copy-on-write snapshot of the device
+ */
+block_store_t* block_store_snapshot(block_store_t* const bs) {
+    // Check param (the blocks have to be in a slab of our own, where no pointer can change them unseen)
+    if (!bs || bs->map || bs->cache || bs->cold || bs->snapshot
+        || atomic_load_explicit(&bs->pins, memory_order_relaxed) || !lazy_load_all(bs)) {
         return NULL;
     }
 
-    return NULL;
+    // The first snapshot puts the slab up for sharing, the device's reference is the first one
+    if (!bs->share) {
+        shared_slab_t* const slab = calloc(1, sizeof(shared_slab_t));
+        if (!slab || !(slab->shared = bitmap_create(bs->block_count))) {
+            free(slab);
+            return NULL;
+        }
+        bitmap_set_concurrent(slab->shared, true);
+        pthread_rwlock_init(&slab->lock, NULL);
+        atomic_init(&slab->refs, 1);
+        slab->data = bs->data;
+        bs->share  = slab;
+    }
+
+    // The snapshot gets a copy of the fbm and the checksums, its blocks are all still the device's
+    block_store_t* const copy  = block_store_alloc(bs->block_size, bs->block_count);
+    snapshot_t* const snapshot = calloc(1, sizeof(snapshot_t) + bitmap_footprint(bs->block_count));
+    if (snapshot) {
+        snapshot->copied = bitmap_create_inline(snapshot + 1, bs->block_count);
+    }
+    if (!copy || !snapshot || !(copy->fbm = bitmap_import(bs->block_count, bitmap_export(bs->fbm)))
+        || !(snapshot->pages = calloc(bs->total_blocks, sizeof(snapshot_page_t*)))
+        || (bs->checksums && !(copy->checksums = malloc(bs->total_blocks * sizeof(uint32_t))))) {
+        if (snapshot) {
+            free(snapshot->pages);
+            free(snapshot);
+        }
+        block_store_destroy(copy);
+        return NULL;
+    }
+    if (bs->checksums) {
+        memcpy(copy->checksums, bs->checksums, bs->total_blocks * sizeof(uint32_t));
+    }
+    atomic_init(&copy->used_blocks, atomic_load_explicit(&bs->used_blocks, memory_order_relaxed));
+    copy->alloc_policy = bs->alloc_policy;
+    copy->data         = bs->data;
+    copy->snapshot     = snapshot;
+    snapshot->slab     = bs->share;
+    atomic_fetch_add_explicit(&bs->share->refs, 1, memory_order_relaxed);
+
+    // From here on the device gives a block to the snapshot before it first changes it
+    pthread_rwlock_wrlock(&bs->share->lock);
+    snapshot->next       = bs->share->snapshots;
+    bs->share->snapshots = snapshot;
+    bitmap_set_range(bs->share->shared, 0, bs->total_blocks);
+    pthread_rwlock_unlock(&bs->share->lock);
+    return copy;
 }
 
-size_t block_store_serialize(const block_store_t* const bs, const char* const filename) {
+/*
+ * Lists the blocks that differ between two snapshots of the same device
+ */
+size_t block_store_diff(const block_store_t* const a, const block_store_t* const b, size_t* const block_ids,
+                        const size_t max_ids) {
+    // Check params (both have to share a slab: the device and its snapshots)
+    shared_slab_t* const slab = a ? (a->snapshot ? a->snapshot->slab : a->share) : NULL;
+    if (!slab || !b || slab != (b->snapshot ? b->snapshot->slab : b->share) || (!block_ids && max_ids)) {
+        return SIZE_MAX;
+    }
+
+    // A block allocated in one and not the other is different. The scratch maps share one allocation
+    bitmap_arena_t* const arena = bitmap_arena_create(3 * bitmap_footprint(a->block_count));
+    bitmap_t* const diff        = bitmap_create_in(arena, a->block_count);
+    bitmap_t* const changed     = bitmap_create_in(arena, a->block_count);
+    bitmap_t* const both        = bitmap_create_in(arena, a->block_count);
+    bool success = diff && changed && both && bitmap_or(diff, a->fbm) && bitmap_xor(diff, b->fbm);
+    pthread_rwlock_rdlock(&slab->lock);
+    if (success) {
+        // So is one that only one of them has a page for, the other still has the block the device had.
+        // The device itself never has any
+        const snapshot_t* const first  = a->snapshot;
+        const snapshot_t* const second = b->snapshot;
+        if (first) {
+            bitmap_or(changed, first->copied);
+            bitmap_or(both, first->copied);
+        }
+        if (second) {
+            bitmap_xor(changed, second->copied);
+            bitmap_and(both, second->copied);
+        } else {
+            bitmap_format(both, 0x00);
+        }
+        // And one they both have a page for, unless it's the same page: the device gave it to both at once
+        bitmap_iter_t it;
+        bitmap_iter_init(&it, both);
+        for (size_t block; (block = bitmap_next_set(&it)) != SIZE_MAX;) {
+            if (first->pages[block] != second->pages[block]) {
+                bitmap_set(changed, block);
+            }
+        }
+        bitmap_or(diff, changed);
+    }
+    pthread_rwlock_unlock(&slab->lock);
+
+    // The fbm's own blocks are set in both, so everything left is a user block
+    size_t count = 0;
+    if (success) {
+        bitmap_iter_t it;
+        bitmap_iter_init(&it, diff);
+        for (size_t block; (block = bitmap_next_set(&it)) != SIZE_MAX; count++) {
+            if (count < max_ids) {
+                block_ids[count] = block;
+            }
+        }
+    }
+    bitmap_arena_destroy(arena);
+    return success ? count : SIZE_MAX;
+}
+
+/*
+ * Turns operation stats on (from zero) or off
+ */
+bool block_store_set_stats(block_store_t* const bs, const bool enable) {
+    // Check param
+    if (!bs) {
+        return false;
+    }
+
+    free(bs->stats);
+    bs->stats = NULL;
+    if (!enable) {
+        return true;
+    }
+    // Every shard starts on a cache line of its own (stats_t is a whole number of them)
+    bs->stats = aligned_alloc(SLAB_ALIGNMENT, sizeof(stats_t));
+    if (!bs->stats) {
+        return false;
+    }
+    memset(bs->stats, 0, sizeof(stats_t));
+    for (size_t shard = 0; shard < STATS_SHARDS; shard++) {
+        for (size_t op = 0; op < BS_STAT_OPS; op++) {
+            atomic_init(&bs->stats->shards[shard].latency[op].min_ns, SIZE_MAX);
+        }
+    }
+    return true;
+}
+
+/*
+ * Adds up the operation stats of every thread
+ */
+bool block_store_get_stats(const block_store_t* const bs, block_store_stats_t* const stats) {
     // Check params
-    if (!bs || !filename) {
+    if (!bs || !stats || !bs->stats) {
+        return false;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (size_t op = 0; op < BS_STAT_OPS; op++) {
+        stats->latency[op].min_ns = SIZE_MAX;
+    }
+    for (size_t i = 0; i < STATS_SHARDS; i++) {
+        const stats_shard_t* const shard = &bs->stats->shards[i];
+        stats->bytes_read += stats_load(&shard->bytes_read);
+        stats->bytes_written += stats_load(&shard->bytes_written);
+        stats->bytes_serialized += stats_load(&shard->bytes_serialized);
+        stats->ffz_words += stats_load(&shard->ffz_words);
+        for (size_t op = 0; op < BS_STAT_OPS; op++) {
+            const stats_latency_t* const hist = &shard->latency[op];
+            block_store_latency_t* const out  = &stats->latency[op];
+            const size_t min = stats_load(&hist->min_ns), max = stats_load(&hist->max_ns);
+            stats->calls[op] += stats_load(&shard->calls[op]);
+            stats->failures[op] += stats_load(&shard->failures[op]);
+            out->total_ns += stats_load(&hist->total_ns);
+            out->min_ns = min < out->min_ns ? min : out->min_ns;
+            out->max_ns = max > out->max_ns ? max : out->max_ns;
+            for (size_t bucket = 0; bucket < BS_LATENCY_BUCKETS; bucket++) {
+                out->buckets[bucket] += stats_load(&hist->buckets[bucket]);
+            }
+        }
+    }
+    // An op nobody called has no minimum
+    for (size_t op = 0; op < BS_STAT_OPS; op++) {
+        if (stats->latency[op].min_ns == SIZE_MAX) {
+            stats->latency[op].min_ns = 0;
+        }
+    }
+    return true;
+}
+
+/*
+ * Finds the bucket a percentile of the histogram falls in, and the highest latency that goes there
+ */
+size_t block_store_latency_percentile(const block_store_latency_t* const latency, const double percentile) {
+    // Check params (written so NaN doesn't get through)
+    if (!latency || !(percentile >= 0 && percentile <= 100)) {
         return 0;
     }
 
-    return 0;
+    size_t count = 0;
+    for (size_t bucket = 0; bucket < BS_LATENCY_BUCKETS; bucket++) {
+        count += latency->buckets[bucket];
+    }
+    if (!count) {
+        return 0;
+    }
+    // The rank of the latency we want, rounded up and at least the first one
+    const double exact = percentile / 100 * (double) count;
+    size_t rank        = (size_t) exact;
+    rank += ((double) rank < exact || !rank) && rank < count;
+    size_t seen = 0, bucket = 0;
+    for (; bucket < BS_LATENCY_BUCKETS - 1 && (seen += latency->buckets[bucket]) < rank; bucket++) {
+    }
+    const size_t highest = bucket < BS_LATENCY_BUCKETS - 1 ? latency_bucket_floor(bucket + 1) - 1 : latency->max_ns;
+    if (highest < latency->min_ns) {
+        return latency->min_ns;
+    }
+    return highest < latency->max_ns ? highest : latency->max_ns;
 }
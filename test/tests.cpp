@@ -8,7 +8,16 @@
 */
 
 #include <gtest/gtest.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include "block_store.h"
+#include "bitmap.h"
 
 // Helpful constants...
 #define BITMAP_SIZE_BYTES 256        // 2^8 blocks.
@@ -242,7 +251,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -270,7 +279,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -330,6 +339,1324 @@ TEST(block_store_write_read, valid_write_and_read) {
 }
 
 
+TEST(bitmap_ffz, word_boundaries) {
+    // Odd sizes so every scan has to deal with a partial tail word and byte
+    const size_t sizes[] = {1, 7, 8, 63, 64, 65, 100, 255, 256, 1000, 4099};
+    for (size_t n : sizes) {
+        bitmap_t *bitmap = bitmap_create(n);
+        ASSERT_NE(nullptr, bitmap);
+        ASSERT_EQ(0, bitmap_ffz(bitmap));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+        for (size_t bit = 0; bit < n; ++bit) {
+            ASSERT_EQ(bit, bitmap_ffz(bitmap)) << "n = " << n;
+            bitmap_set(bitmap, bit);
+            ASSERT_EQ(0, bitmap_ffs(bitmap));
+        }
+        // Completely full, must not report a bit past the end
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap)) << "n = " << n;
+        bitmap_reset(bitmap, n - 1);
+        ASSERT_EQ(n - 1, bitmap_ffz(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap_ffs, word_boundaries) {
+    const size_t sizes[] = {1, 7, 8, 63, 64, 65, 100, 255, 256, 1000, 4099};
+    for (size_t n : sizes) {
+        bitmap_t *bitmap = bitmap_create(n);
+        ASSERT_NE(nullptr, bitmap);
+        bitmap_set(bitmap, n - 1);
+        ASSERT_EQ(n - 1, bitmap_ffs(bitmap)) << "n = " << n;
+        bitmap_set(bitmap, n / 2);
+        ASSERT_EQ(n / 2, bitmap_ffs(bitmap)) << "n = " << n;
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap_ffz, ignores_bits_past_end) {
+    // Formatting sets the undetermined bits in the last byte, they must never be reported
+    bitmap_t *bitmap = bitmap_create(60);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    bitmap_format(bitmap, 0x00);
+    bitmap_invert(bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    bitmap_format(bitmap, 0x00);
+    bitmap_set(bitmap, 62);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_hier, matches_flat_ffz) {
+    // Big enough for three summary levels, odd so the tail word is partial
+    const size_t n      = 64 * 64 * 64 + 77;
+    bitmap_hier_t *hier = bitmap_hier_create(n);
+    bitmap_t *flat      = bitmap_create(n);
+    ASSERT_NE(nullptr, hier);
+    ASSERT_NE(nullptr, flat);
+    ASSERT_EQ(0, bitmap_hier_ffz(hier));
+
+    // Fill it all, poking holes along the way, and make sure both agree every step
+    for (size_t bit = 0; bit < n; ++bit) {
+        bitmap_hier_set(hier, bit);
+        bitmap_set(flat, bit);
+        if (bit % 4099 == 0) {
+            ASSERT_EQ(bitmap_ffz(flat), bitmap_hier_ffz(hier)) << "bit = " << bit;
+        }
+    }
+    ASSERT_EQ(SIZE_MAX, bitmap_hier_ffz(hier));
+
+    const size_t holes[] = {n - 1, 200000, 64 * 64, 4095, 64, 3};
+    for (size_t hole : holes) {
+        bitmap_hier_reset(hier, hole);
+        ASSERT_EQ(hole, bitmap_hier_ffz(hier));
+        ASSERT_FALSE(bitmap_hier_test(hier, hole));
+    }
+    for (size_t idx = sizeof(holes) / sizeof(holes[0]); idx-- > 1;) {
+        bitmap_hier_set(hier, holes[idx]);
+        ASSERT_EQ(holes[idx - 1], bitmap_hier_ffz(hier));
+    }
+    bitmap_hier_set(hier, holes[0]);
+    ASSERT_EQ(SIZE_MAX, bitmap_hier_ffz(hier));
+    ASSERT_EQ(n, bitmap_total_set(bitmap_hier_get_bitmap(hier)));
+
+    bitmap_destroy(flat);
+    bitmap_hier_destroy(hier);
+}
+
+TEST(bitmap_hier, wrap_and_sync) {
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_format(bitmap, 0xFF);
+    bitmap_reset(bitmap, 777);
+
+    bitmap_hier_t *hier = bitmap_hier_wrap(bitmap);
+    ASSERT_NE(nullptr, hier);
+    ASSERT_EQ(777, bitmap_hier_ffz(hier));
+
+    // Changed behind its back, needs a sync
+    bitmap_reset(bitmap, 5);
+    bitmap_hier_sync(hier);
+    ASSERT_EQ(5, bitmap_hier_ffz(hier));
+
+    // Wrapped bitmaps survive the summary
+    bitmap_hier_destroy(hier);
+    ASSERT_EQ(5, bitmap_ffz(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_set_fbm, hier_allocation) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_set_fbm(NULL, BS_FBM_HIER));
+
+    ASSERT_TRUE(block_store_request(bs, 0));
+    ASSERT_TRUE(block_store_request(bs, 2));
+    ASSERT_TRUE(block_store_set_fbm(bs, BS_FBM_HIER));
+    ASSERT_EQ(1, block_store_allocate(bs));
+    ASSERT_EQ(3, block_store_allocate(bs));
+    for (size_t i = 4; i < BLOCK_STORE_AVAIL_BLOCKS; i++) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+    }
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+    block_store_release(bs, 100);
+    ASSERT_EQ(100, block_store_allocate(bs));
+
+    // Switching back keeps the same state
+    block_store_release(bs, 42);
+    ASSERT_TRUE(block_store_set_fbm(bs, BS_FBM_FLAT));
+    ASSERT_EQ(42, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create_ex, geometry) {
+    // Bad sizes: zero, not a power of two, no room left after the fbm, overflow
+    ASSERT_EQ(nullptr, block_store_create_ex(0, 256));
+    ASSERT_EQ(nullptr, block_store_create_ex(100, 256));
+    ASSERT_EQ(nullptr, block_store_create_ex(256, 0));
+    ASSERT_EQ(nullptr, block_store_create_ex(1, 1));
+    ASSERT_EQ(nullptr, block_store_create_ex(SIZE_MAX / 2 + 1, 4));
+
+    block_store_t *bs = block_store_create_ex(BLOCK_SIZE_BYTES, BLOCK_STORE_NUM_BLOCKS);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_total_blocks(), block_store_get_total_blocks_ex(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_get_block_size(bs));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(SIZE_MAX, block_store_get_total_blocks_ex(NULL));
+    ASSERT_EQ(0, block_store_get_block_size(NULL));
+}
+
+TEST(block_store_create_ex, multi_block_fbm) {
+    // 1024 bits of fbm is 128 bytes, which takes up 16 blocks of 8 bytes
+    block_store_t *bs = block_store_create_ex(8, 1024);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1008, block_store_get_total_blocks_ex(bs));
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    ASSERT_EQ(1008, block_store_get_free_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 1008));
+
+    uint64_t value = 0x0123456789ABCDEF, result = 0;
+    for (size_t i = 0; i < 1008; i++) {
+        ASSERT_EQ(i, block_store_allocate(bs));
+        ASSERT_EQ(8, block_store_write(bs, i, &value));
+    }
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_EQ(0, block_store_write(bs, 1008, &value));
+    ASSERT_EQ(8, block_store_read(bs, 1007, &result));
+    ASSERT_EQ(value, result);
+    ASSERT_EQ(1008, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create_ex, large_blocks) {
+    block_store_t *bs = block_store_create_ex(4096, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4095, block_store_get_total_blocks_ex(bs));
+
+    uint8_t *write_buffer = (uint8_t *) malloc(4096);
+    uint8_t *read_buffer  = (uint8_t *) calloc(1, 4096);
+    ASSERT_NE(nullptr, write_buffer);
+    ASSERT_NE(nullptr, read_buffer);
+    memset(write_buffer, '~', 4096);
+    ASSERT_EQ(4096, block_store_write(bs, 4094, write_buffer));
+    ASSERT_EQ(4096, block_store_read(bs, 4094, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, 4096));
+
+    free(read_buffer);
+    free(write_buffer);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, blocks_are_isolated) {
+    // Neighbouring blocks share a slab, make sure writes stay inside their block
+    // and never reach the free block map at the end of it
+    block_store_t *bs = block_store_create_ex(64, 2048);
+    ASSERT_NE(nullptr, bs);
+    const size_t avail = block_store_get_total_blocks_ex(bs);
+    uint8_t buffer[64];
+    for (size_t i = 0; i < avail; i++) {
+        memset(buffer, (int) (i & 0xFF), sizeof(buffer));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+    }
+    ASSERT_EQ(0, block_store_get_used_blocks(bs));
+    for (size_t i = 0; i < avail; i++) {
+        ASSERT_EQ(sizeof(buffer), block_store_read(bs, i, buffer));
+        for (size_t byte = 0; byte < sizeof(buffer); byte++) {
+            ASSERT_EQ((uint8_t) (i & 0xFF), buffer[byte]) << "block " << i;
+        }
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store_view, zero_copy) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_view(NULL, 0));
+    ASSERT_EQ(nullptr, block_store_mut(NULL, 0));
+    ASSERT_EQ(nullptr, block_store_view(bs, BLOCK_STORE_AVAIL_BLOCKS));
+    ASSERT_EQ(nullptr, block_store_mut(bs, BLOCK_STORE_AVAIL_BLOCKS));
+    block_store_unpin(NULL, 0);
+
+    // Writes through mut show up in block_store_read, and block_store_write shows up in view
+    uint8_t *block = (uint8_t *) block_store_mut(bs, 100);
+    ASSERT_NE(nullptr, block);
+    memset(block, '~', BLOCK_SIZE_BYTES);
+    block_store_unpin(bs, 100);
+
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 100, buffer));
+    ASSERT_EQ('~', buffer[0]);
+    ASSERT_EQ('~', buffer[BLOCK_SIZE_BYTES - 1]);
+
+    memset(buffer, '!', sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 101, buffer));
+    const uint8_t *view = (const uint8_t *) block_store_view(bs, 101);
+    ASSERT_NE(nullptr, view);
+    ASSERT_EQ(0, memcmp(view, buffer, BLOCK_SIZE_BYTES));
+    // Neighbours, but not overlapping
+    ASSERT_EQ(block + BLOCK_SIZE_BYTES, view);
+    block_store_unpin(bs, 101);
+    // Extra unpins are ignored
+    block_store_unpin(bs, 101);
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_pread_pwrite, partial_block) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 7, buffer));
+
+    const uint64_t field = 0xFEEDFACECAFEBEEF;
+    ASSERT_EQ(sizeof(field), block_store_pwrite(bs, 7, 128, sizeof(field), &field));
+    ASSERT_EQ(1, block_store_pwrite(bs, 7, BLOCK_SIZE_BYTES - 1, 1, "x"));
+
+    uint64_t result = 0;
+    ASSERT_EQ(sizeof(result), block_store_pread(bs, 7, 128, sizeof(result), &result));
+    ASSERT_EQ(field, result);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 7, buffer));
+    ASSERT_EQ(0, buffer[127]);
+    ASSERT_EQ(0, memcmp(buffer + 128, &field, sizeof(field)));
+    ASSERT_EQ(0, buffer[136]);
+    ASSERT_EQ('x', buffer[BLOCK_SIZE_BYTES - 1]);
+
+    // Whole block through the offset calls works too
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_pread(bs, 7, 0, BLOCK_SIZE_BYTES, buffer));
+
+    // Out of bounds, in every way
+    ASSERT_EQ(0, block_store_pread(NULL, 7, 0, 8, &result));
+    ASSERT_EQ(0, block_store_pread(bs, BLOCK_STORE_AVAIL_BLOCKS, 0, 8, &result));
+    ASSERT_EQ(0, block_store_pread(bs, 7, 0, 8, NULL));
+    ASSERT_EQ(0, block_store_pread(bs, 7, 0, 0, &result));
+    ASSERT_EQ(0, block_store_pread(bs, 7, 250, 8, &result));
+    ASSERT_EQ(0, block_store_pread(bs, 7, BLOCK_SIZE_BYTES, 1, &result));
+    ASSERT_EQ(0, block_store_pwrite(bs, 7, 1, SIZE_MAX, &field));
+    ASSERT_EQ(0, block_store_pwrite(bs, 7, SIZE_MAX, 8, &field));
+    ASSERT_EQ(0, block_store_pwrite(NULL, 7, 0, 8, &field));
+    ASSERT_EQ(0, block_store_pwrite(bs, 7, 0, 8, NULL));
+
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_claim_zeros, single_pass) {
+    bitmap_t *bitmap = bitmap_create(200);
+    ASSERT_NE(nullptr, bitmap);
+    size_t bits[200];
+    bitmap_set(bitmap, 1);
+    bitmap_set(bitmap, 64);
+    ASSERT_EQ(4, bitmap_claim_zeros(bitmap, 4, bits));
+    ASSERT_EQ(0, bits[0]);
+    ASSERT_EQ(2, bits[1]);
+    ASSERT_EQ(3, bits[2]);
+    ASSERT_EQ(4, bits[3]);
+    ASSERT_EQ(5, bitmap_ffz(bitmap));
+
+    // Spans words, and stops at the end without going past bit_count
+    ASSERT_EQ(194, bitmap_claim_zeros(bitmap, 200, bits));
+    for (size_t idx = 1; idx < 194; ++idx) {
+        ASSERT_LT(bits[idx - 1], bits[idx]);
+        ASSERT_NE(64, bits[idx]);
+    }
+    ASSERT_EQ(199, bits[193]);
+    ASSERT_EQ(200, bitmap_total_set(bitmap));
+    ASSERT_EQ(0, bitmap_claim_zeros(bitmap, 1, bits));
+    ASSERT_EQ(0, bitmap_claim_zeros(NULL, 1, bits));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_allocate_n, batches) {
+    size_t ids[BLOCK_STORE_NUM_BLOCKS];
+    ASSERT_EQ(0, block_store_allocate_n(NULL, 4, ids));
+    block_store_release_n(NULL, ids, 4);
+
+    // Same results flat or with the summary
+    const block_store_fbm_t fbms[] = {BS_FBM_FLAT, BS_FBM_HIER};
+    for (block_store_fbm_t fbm : fbms) {
+        block_store_t *bs = block_store_create();
+        ASSERT_NE(nullptr, bs);
+        ASSERT_TRUE(block_store_set_fbm(bs, fbm));
+        ASSERT_EQ(0, block_store_allocate_n(bs, 4, NULL));
+        ASSERT_TRUE(block_store_request(bs, 2));
+
+        ASSERT_EQ(3, block_store_allocate_n(bs, 3, ids));
+        ASSERT_EQ(0, ids[0]);
+        ASSERT_EQ(1, ids[1]);
+        ASSERT_EQ(3, ids[2]);
+        ASSERT_EQ(4, block_store_get_used_blocks(bs));
+
+        // Everything else, and never the fbm's block
+        ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 4, block_store_allocate_n(bs, BLOCK_STORE_NUM_BLOCKS, ids));
+        ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 1, ids[BLOCK_STORE_AVAIL_BLOCKS - 5]);
+        ASSERT_EQ(0, block_store_get_free_blocks(bs));
+
+        const size_t release[] = {10, 200, 11, BLOCK_STORE_AVAIL_BLOCKS, SIZE_MAX};
+        block_store_release_n(bs, release, 5);
+        ASSERT_EQ(3, block_store_get_free_blocks(bs));
+        ASSERT_EQ(3, block_store_allocate_n(bs, 5, ids));
+        ASSERT_EQ(10, ids[0]);
+        ASSERT_EQ(11, ids[1]);
+        ASSERT_EQ(200, ids[2]);
+        block_store_destroy(bs);
+    }
+}
+
+TEST(bitmap_find_zero_run, runs) {
+    bitmap_t *bitmap = bitmap_create(300);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(NULL, 1));
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 0));
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 301));
+    ASSERT_EQ(0, bitmap_find_zero_run(bitmap, 300));
+
+    // Holes of 3 at 10, 70 across a word boundary at 62, and everything from 130 on
+    bitmap_format(bitmap, 0xFF);
+    for (size_t bit = 10; bit < 13; ++bit) {
+        bitmap_reset(bitmap, bit);
+    }
+    for (size_t bit = 60; bit < 68; ++bit) {
+        bitmap_reset(bitmap, bit);
+    }
+    for (size_t bit = 130; bit < 300; ++bit) {
+        bitmap_reset(bitmap, bit);
+    }
+    ASSERT_EQ(10, bitmap_find_zero_run(bitmap, 1));
+    ASSERT_EQ(10, bitmap_find_zero_run(bitmap, 3));
+    ASSERT_EQ(60, bitmap_find_zero_run(bitmap, 4));
+    ASSERT_EQ(60, bitmap_find_zero_run(bitmap, 8));
+    ASSERT_EQ(130, bitmap_find_zero_run(bitmap, 9));
+    ASSERT_EQ(130, bitmap_find_zero_run(bitmap, 170));
+    ASSERT_EQ(SIZE_MAX, bitmap_find_zero_run(bitmap, 171));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_allocate_extent, contiguous) {
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(NULL, 4));
+    block_store_release_extent(NULL, 0, 4);
+
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 5));
+    ASSERT_EQ(0, block_store_allocate_extent(bs, 5));
+    ASSERT_EQ(6, block_store_allocate_extent(bs, 100));
+    ASSERT_EQ(106, block_store_allocate_extent(bs, 149));
+    ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_used_blocks(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 1));
+
+    // Out of bounds releases don't touch anything
+    block_store_release_extent(bs, 250, 10);
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    block_store_release_extent(bs, 50, 20);
+    ASSERT_EQ(20, block_store_get_free_blocks(bs));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 21));
+    ASSERT_EQ(50, block_store_allocate_extent(bs, 20));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_set_concurrent, atomic_ops) {
+    ASSERT_FALSE(bitmap_set_concurrent(NULL, true));
+    // Tail bytes past the last full word go through their own path
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_TRUE(bitmap_set_concurrent(bitmap, true));
+    ASSERT_FALSE(bitmap_test_and_set(bitmap, 3));
+    ASSERT_TRUE(bitmap_test_and_set(bitmap, 3));
+    ASSERT_FALSE(bitmap_test_and_set(bitmap, 99));
+    ASSERT_TRUE(bitmap_test(bitmap, 99));
+    ASSERT_TRUE(bitmap_test_and_reset(bitmap, 99));
+    ASSERT_FALSE(bitmap_test_and_reset(bitmap, 99));
+    bitmap_flip(bitmap, 70);
+    ASSERT_TRUE(bitmap_test(bitmap, 70));
+    ASSERT_EQ(2, bitmap_total_set(bitmap));
+    ASSERT_EQ(0, bitmap_claim_zero(bitmap));
+    ASSERT_EQ(1, bitmap_claim_zero(bitmap));
+    ASSERT_EQ(2, bitmap_claim_zero(bitmap));
+    ASSERT_EQ(4, bitmap_claim_zero(bitmap));
+
+    size_t bits[100];
+    ASSERT_EQ(94, bitmap_claim_zeros(bitmap, 100, bits));
+    ASSERT_EQ(SIZE_MAX, bitmap_claim_zero(bitmap));
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(100, bitmap_total_set(bitmap));
+    ASSERT_TRUE(bitmap_set_concurrent(bitmap, false));
+    ASSERT_EQ(100, bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+
+    // Misaligned data can't do 64-bit atomics
+    uint64_t storage[4] = {0};
+    bitmap = bitmap_overlay(64, (uint8_t *) storage + 1);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_FALSE(bitmap_set_concurrent(bitmap, true));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_set_concurrent, unique_allocations) {
+    ASSERT_FALSE(block_store_set_concurrent(NULL, true));
+    block_store_t *bs = block_store_create_ex(8, 40000);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_fbm(bs, BS_FBM_HIER));
+    ASSERT_FALSE(block_store_set_concurrent(bs, true)) << "the summary isn't atomic";
+    ASSERT_TRUE(block_store_set_fbm(bs, BS_FBM_FLAT));
+    ASSERT_TRUE(block_store_set_concurrent(bs, true));
+    ASSERT_FALSE(block_store_set_fbm(bs, BS_FBM_HIER));
+
+    // Everyone allocates as fast as they can (mixing all the flavours) until it's full
+    const size_t avail = block_store_get_total_blocks_ex(bs);
+    const size_t thread_count = 4;
+    std::vector<std::vector<size_t>> results(thread_count);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back([bs, t, &results]() {
+            std::vector<size_t> &mine = results[t];
+            size_t batch[16];
+            for (size_t round = 0;; ++round) {
+                if (round % 3 == 0) {
+                    const size_t id = block_store_allocate(bs);
+                    if (id == SIZE_MAX) {
+                        break;
+                    }
+                    mine.push_back(id);
+                } else if (round % 3 == 1) {
+                    const size_t got = block_store_allocate_n(bs, 16, batch);
+                    mine.insert(mine.end(), batch, batch + got);
+                } else {
+                    const size_t start = block_store_allocate_extent(bs, 5);
+                    for (size_t i = 0; start != SIZE_MAX && i < 5; ++i) {
+                        mine.push_back(start + i);
+                    }
+                }
+                // Give a few back and take them again, so releases race too
+                if (round % 7 == 0 && !mine.empty()) {
+                    block_store_release(bs, mine.back());
+                    mine.pop_back();
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<size_t> all;
+    for (const std::vector<size_t> &mine : results) {
+        all.insert(all.end(), mine.begin(), mine.end());
+    }
+    std::sort(all.begin(), all.end());
+    ASSERT_EQ(avail, all.size());
+    for (size_t i = 0; i < all.size(); ++i) {
+        ASSERT_EQ(i, all[i]) << "duplicate or missing block id";
+    }
+    ASSERT_EQ(avail, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_claim_zero_from, wraps) {
+    bitmap_t *bitmap = bitmap_create(130);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_claim_zero_from(NULL, 0));
+    ASSERT_EQ(70, bitmap_claim_zero_from(bitmap, 70));
+    ASSERT_EQ(71, bitmap_claim_zero_from(bitmap, 70));
+    ASSERT_EQ(129, bitmap_claim_zero_from(bitmap, 129));
+    // Past the end starts over, and so does running off the end
+    ASSERT_EQ(0, bitmap_claim_zero_from(bitmap, 500));
+    ASSERT_EQ(1, bitmap_claim_zero_from(bitmap, 129));
+    for (size_t bit = 0; bit < 130; ++bit) {
+        bitmap_set(bitmap, bit);
+    }
+    bitmap_reset(bitmap, 68);
+    ASSERT_EQ(68, bitmap_claim_zero_from(bitmap, 69));
+    ASSERT_EQ(SIZE_MAX, bitmap_claim_zero_from(bitmap, 69));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_set_concurrent, thread_regions) {
+    block_store_t *bs = block_store_create_ex(8, 1 << 20);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_concurrent(bs, true));
+
+    // A thread keeps allocating next to its last block, and reuses what it frees
+    const size_t first = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, first);
+    const size_t second = block_store_allocate(bs);
+    ASSERT_EQ(first + 1, second);
+    block_store_release(bs, first);
+    ASSERT_EQ(first, block_store_allocate(bs));
+    ASSERT_EQ(second + 1, block_store_allocate(bs));
+
+    // Two new threads start out in different regions, nowhere near each other's fbm words
+    size_t ids[2] = {SIZE_MAX, SIZE_MAX};
+    std::thread a([bs, &ids]() { ids[0] = block_store_allocate(bs); });
+    a.join();
+    std::thread b([bs, &ids]() { ids[1] = block_store_allocate(bs); });
+    b.join();
+    ASSERT_NE(SIZE_MAX, ids[0]);
+    ASSERT_NE(SIZE_MAX, ids[1]);
+    ASSERT_GE(std::max(ids[0], ids[1]) - std::min(ids[0], ids[1]), 512u);
+
+    ASSERT_TRUE(block_store_set_concurrent(bs, false));
+    ASSERT_EQ(5, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_ffz_from, wraps) {
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(NULL, 0));
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz_from(bitmap, 0));
+    bitmap_reset(bitmap, 10);
+    bitmap_reset(bitmap, 900);
+    ASSERT_EQ(10, bitmap_ffz_from(bitmap, 0));
+    ASSERT_EQ(10, bitmap_ffz_from(bitmap, 10));
+    ASSERT_EQ(900, bitmap_ffz_from(bitmap, 11));
+    ASSERT_EQ(10, bitmap_ffz_from(bitmap, 901));
+    ASSERT_EQ(10, bitmap_ffz_from(bitmap, 999));
+    ASSERT_EQ(10, bitmap_ffz_from(bitmap, 5000));
+    bitmap_reset(bitmap, 9);
+    ASSERT_EQ(9, bitmap_ffz_from(bitmap, 901)) << "the start word's low bits count after wrapping";
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_set_alloc_policy, next_fit) {
+    ASSERT_FALSE(block_store_set_alloc_policy(NULL, BS_ALLOC_NEXT_FIT));
+    const block_store_fbm_t fbms[] = {BS_FBM_FLAT, BS_FBM_HIER};
+    for (block_store_fbm_t fbm : fbms) {
+        block_store_t *bs = block_store_create();
+        ASSERT_NE(nullptr, bs);
+        ASSERT_TRUE(block_store_set_fbm(bs, fbm));
+        ASSERT_TRUE(block_store_set_alloc_policy(bs, BS_ALLOC_NEXT_FIT));
+        for (size_t i = 0; i < 10; i++) {
+            ASSERT_EQ(i, block_store_allocate(bs));
+        }
+        // First fit would hand 3 right back
+        block_store_release(bs, 3);
+        ASSERT_EQ(10, block_store_allocate(bs));
+        for (size_t i = 11; i < BLOCK_STORE_AVAIL_BLOCKS; i++) {
+            ASSERT_EQ(i, block_store_allocate(bs));
+        }
+        // Wraps around to what's left
+        ASSERT_EQ(3, block_store_allocate(bs));
+        ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+        block_store_release(bs, 50);
+        block_store_release(bs, 20);
+        ASSERT_TRUE(block_store_set_alloc_policy(bs, BS_ALLOC_FIRST_FIT));
+        ASSERT_EQ(20, block_store_allocate(bs));
+        ASSERT_EQ(50, block_store_allocate(bs));
+        block_store_destroy(bs);
+    }
+}
+
+TEST(bitmap_total_set, word_sizes) {
+    // Exercise the vector loop, its remainder, and the masked partial word
+    const size_t sizes[] = {1, 63, 64, 65, 1000, 1024, 4095, 70000};
+    for (size_t n : sizes) {
+        bitmap_t *bitmap = bitmap_create(n);
+        ASSERT_NE(nullptr, bitmap);
+        ASSERT_EQ(0, bitmap_total_set(bitmap));
+        size_t expected = 0;
+        for (size_t i = 0; i < n; i += 3) {
+            bitmap_set(bitmap, i);
+            ++expected;
+        }
+        ASSERT_EQ(expected, bitmap_total_set(bitmap)) << n;
+        bitmap_format(bitmap, 0xFF);
+        ASSERT_EQ(n, bitmap_total_set(bitmap)) << n;
+        bitmap_invert(bitmap);
+        ASSERT_EQ(0, bitmap_total_set(bitmap)) << n;
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap_invert, partial_words) {
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set(bitmap, 5);
+    bitmap_set(bitmap, 70);
+    bitmap_set(bitmap, 99);
+    bitmap_invert(bitmap);
+    ASSERT_EQ(97, bitmap_total_set(bitmap));
+    ASSERT_FALSE(bitmap_test(bitmap, 5));
+    ASSERT_FALSE(bitmap_test(bitmap, 70));
+    ASSERT_FALSE(bitmap_test(bitmap, 99));
+    ASSERT_TRUE(bitmap_test(bitmap, 98));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_bulk, ops) {
+    bitmap_t *a = bitmap_create(200), *b = bitmap_create(200), *c = bitmap_create(201);
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    ASSERT_NE(nullptr, c);
+    ASSERT_FALSE(bitmap_and(NULL, b));
+    ASSERT_FALSE(bitmap_or(a, NULL));
+    ASSERT_FALSE(bitmap_xor(a, c)) << "sizes differ";
+    ASSERT_FALSE(bitmap_andnot(c, a));
+
+    auto reset = [&]() {
+        bitmap_format(a, 0x00);
+        bitmap_format(b, 0x00);
+        for (size_t i = 0; i < 200; i += 2) bitmap_set(a, i);
+        for (size_t i = 0; i < 200; i += 3) bitmap_set(b, i);
+    };
+    reset();
+    ASSERT_TRUE(bitmap_and(a, b));
+    for (size_t i = 0; i < 200; ++i) ASSERT_EQ(i % 6 == 0, bitmap_test(a, i)) << i;
+    reset();
+    ASSERT_TRUE(bitmap_or(a, b));
+    for (size_t i = 0; i < 200; ++i) ASSERT_EQ(i % 2 == 0 || i % 3 == 0, bitmap_test(a, i)) << i;
+    reset();
+    ASSERT_TRUE(bitmap_xor(a, b));
+    for (size_t i = 0; i < 200; ++i) ASSERT_EQ((i % 2 == 0) != (i % 3 == 0), bitmap_test(a, i)) << i;
+    reset();
+    ASSERT_TRUE(bitmap_andnot(a, b));
+    for (size_t i = 0; i < 200; ++i) ASSERT_EQ(i % 2 == 0 && i % 3 != 0, bitmap_test(a, i)) << i;
+    ASSERT_TRUE(bitmap_andnot(a, a));
+    ASSERT_EQ(0, bitmap_total_set(a));
+    // The untouched operand doesn't change
+    ASSERT_EQ(67, bitmap_total_set(b));
+
+    bitmap_destroy(a);
+    bitmap_destroy(b);
+    bitmap_destroy(c);
+}
+
+TEST(block_store_used_count, tracks_every_path) {
+    const block_store_fbm_t fbms[] = {BS_FBM_FLAT, BS_FBM_HIER};
+    for (block_store_fbm_t fbm : fbms) {
+        block_store_t *bs = block_store_create();
+        ASSERT_NE(nullptr, bs);
+        ASSERT_TRUE(block_store_set_fbm(bs, fbm));
+        ASSERT_EQ(0, block_store_get_used_blocks(bs));
+        ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_free_blocks(bs));
+
+        ASSERT_EQ(0, block_store_allocate(bs));
+        ASSERT_TRUE(block_store_request(bs, 10));
+        ASSERT_FALSE(block_store_request(bs, 10));
+        ASSERT_EQ(2, block_store_get_used_blocks(bs));
+
+        size_t ids[5];
+        ASSERT_EQ(5, block_store_allocate_n(bs, 5, ids));
+        ASSERT_EQ(7, block_store_get_used_blocks(bs));
+        const size_t extent = block_store_allocate_extent(bs, 20);
+        ASSERT_NE(SIZE_MAX, extent);
+        ASSERT_EQ(27, block_store_get_used_blocks(bs));
+
+        // Double frees and out of range ids don't touch the count
+        block_store_release(bs, 10);
+        block_store_release(bs, 10);
+        block_store_release(bs, BLOCK_STORE_AVAIL_BLOCKS);
+        block_store_release(bs, SIZE_MAX);
+        ASSERT_EQ(26, block_store_get_used_blocks(bs));
+        block_store_release_n(bs, ids, 5);
+        block_store_release_n(bs, ids, 5);
+        ASSERT_EQ(21, block_store_get_used_blocks(bs));
+        block_store_release_extent(bs, extent, 20);
+        ASSERT_EQ(1, block_store_get_used_blocks(bs));
+        ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS - 1, block_store_get_free_blocks(bs));
+
+        // The fbm's own blocks stay in use
+        ASSERT_FALSE(block_store_request(bs, BLOCK_STORE_AVAIL_BLOCKS));
+        for (size_t i = 0; i < BLOCK_STORE_AVAIL_BLOCKS; i++) {
+            block_store_request(bs, i);
+        }
+        ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_used_blocks(bs));
+        ASSERT_EQ(0, block_store_get_free_blocks(bs));
+        ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+        ASSERT_EQ(BLOCK_STORE_AVAIL_BLOCKS, block_store_get_used_blocks(bs));
+        block_store_destroy(bs);
+    }
+}
+
+TEST(block_store_used_count, concurrent) {
+    block_store_t *bs = block_store_create_ex(64, 8192);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_concurrent(bs, true));
+    const size_t avail = block_store_get_total_blocks_ex(bs);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([bs]() {
+            std::vector<size_t> mine;
+            for (int round = 0; round < 3; round++) {
+                for (int i = 0; i < 500; i++) {
+                    const size_t id = block_store_allocate(bs);
+                    if (id != SIZE_MAX) mine.push_back(id);
+                }
+                for (size_t i = 0; i < mine.size(); i += 2) {
+                    block_store_release(bs, mine[i]);
+                    block_store_release(bs, mine[i]);
+                }
+                std::vector<size_t> kept;
+                for (size_t i = 1; i < mine.size(); i += 2) kept.push_back(mine[i]);
+                mine.swap(kept);
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+    const size_t used = block_store_get_used_blocks(bs);
+    ASSERT_EQ(avail - used, block_store_get_free_blocks(bs));
+    // Matches what the map itself says
+    size_t counted = 0;
+    for (size_t i = 0; i < avail; i++) {
+        if (!block_store_request(bs, i)) counted++;
+    }
+    ASSERT_EQ(used, counted);
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_iter, sparse_and_dense) {
+    bitmap_iter_t it;
+    bitmap_iter_init(&it, NULL);
+    ASSERT_EQ(SIZE_MAX, bitmap_next_set(&it));
+    ASSERT_EQ(SIZE_MAX, bitmap_next_set(NULL));
+
+    const size_t sizes[] = {1, 64, 100, 5000};
+    for (size_t n : sizes) {
+        bitmap_t *bitmap = bitmap_create(n);
+        ASSERT_NE(nullptr, bitmap);
+        bitmap_iter_init(&it, bitmap);
+        ASSERT_EQ(SIZE_MAX, bitmap_next_set(&it)) << n;
+
+        std::vector<size_t> expected;
+        for (size_t i = 0; i < n; i += (i < 70 ? 1 : 997)) {
+            bitmap_set(bitmap, i);
+            expected.push_back(i);
+        }
+        bitmap_set(bitmap, n - 1);
+        if (expected.back() != n - 1) expected.push_back(n - 1);
+
+        std::vector<size_t> seen;
+        bitmap_iter_init(&it, bitmap);
+        for (size_t bit; (bit = bitmap_next_set(&it)) != SIZE_MAX;) seen.push_back(bit);
+        ASSERT_EQ(expected, seen) << n;
+        ASSERT_EQ(SIZE_MAX, bitmap_next_set(&it));
+
+        // for_each sees the same thing
+        std::vector<size_t> called;
+        bitmap_for_each(bitmap, [](size_t bit, void *arg) { static_cast<std::vector<size_t> *>(arg)->push_back(bit); },
+                        &called);
+        ASSERT_EQ(expected, called) << n;
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap_iter, ignores_bits_past_the_end) {
+    bitmap_t *bitmap = bitmap_create(70);
+    ASSERT_NE(nullptr, bitmap);
+    // All ones, including the undetermined bits past bit 69
+    bitmap_format(bitmap, 0xFF);
+    bitmap_iter_t it;
+    bitmap_iter_init(&it, bitmap);
+    size_t count = 0, last = 0;
+    for (size_t bit; (bit = bitmap_next_set(&it)) != SIZE_MAX; ++count) last = bit;
+    ASSERT_EQ(70, count);
+    ASSERT_EQ(69, last);
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_range, matches_single_bits) {
+    const size_t n = 1000;
+    // (start, length) pairs covering single words, word boundaries, and the partial tail word
+    const size_t ranges[][2] = {{0, 1}, {3, 5}, {60, 8}, {64, 64}, {10, 500}, {100, 900}, {990, 10}, {0, 1000}};
+    for (int concurrent = 0; concurrent < 2; concurrent++) {
+        for (const auto &range : ranges) {
+            bitmap_t *bitmap = bitmap_create(n);
+            ASSERT_NE(nullptr, bitmap);
+            ASSERT_TRUE(bitmap_set_concurrent(bitmap, concurrent));
+            for (size_t i = 0; i < n; i += 7) bitmap_set(bitmap, i);
+            size_t expected = 0;
+            for (size_t i = range[0]; i < range[0] + range[1]; i++) expected += bitmap_test(bitmap, i);
+
+            ASSERT_EQ(expected, bitmap_count_range(bitmap, range[0], range[1]));
+            ASSERT_EQ(range[1] == 1 && expected == 1, bitmap_all_set_range(bitmap, range[0], range[1]));
+            ASSERT_EQ(range[1] - expected, bitmap_set_range(bitmap, range[0], range[1]));
+            ASSERT_TRUE(bitmap_all_set_range(bitmap, range[0], range[1]));
+            ASSERT_EQ(range[1], bitmap_count_range(bitmap, range[0], range[1]));
+            for (size_t i = 0; i < n; i++) {
+                const bool inside = i >= range[0] && i < range[0] + range[1];
+                ASSERT_EQ(inside || i % 7 == 0, bitmap_test(bitmap, i)) << i;
+            }
+
+            ASSERT_EQ(range[1], bitmap_reset_range(bitmap, range[0], range[1]));
+            ASSERT_EQ(0, bitmap_count_range(bitmap, range[0], range[1]));
+            for (size_t i = 0; i < n; i++) {
+                const bool inside = i >= range[0] && i < range[0] + range[1];
+                ASSERT_EQ(!inside && i % 7 == 0, bitmap_test(bitmap, i)) << i;
+            }
+            bitmap_destroy(bitmap);
+        }
+    }
+}
+
+TEST(bitmap_range, bad_params) {
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(0, bitmap_set_range(NULL, 0, 10));
+    ASSERT_EQ(0, bitmap_set_range(bitmap, 0, 0));
+    ASSERT_EQ(0, bitmap_set_range(bitmap, 95, 6));
+    ASSERT_EQ(0, bitmap_set_range(bitmap, 100, 1));
+    ASSERT_EQ(0, bitmap_set_range(bitmap, 1, SIZE_MAX));
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+    ASSERT_EQ(0, bitmap_reset_range(NULL, 0, 10));
+    ASSERT_EQ(0, bitmap_count_range(bitmap, 50, 51));
+    ASSERT_FALSE(bitmap_all_set_range(NULL, 0, 1));
+    ASSERT_FALSE(bitmap_all_set_range(bitmap, 99, 2));
+    ASSERT_TRUE(bitmap_all_set_range(bitmap, 10, 0));
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_storage, byte_compatible) {
+    // Bit n is bit n % 8 of byte n / 8, whatever the storage width
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_EQ(13, bitmap_get_bytes(bitmap));
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 9);
+    bitmap_set(bitmap, 63);
+    bitmap_set(bitmap, 64);
+    bitmap_set(bitmap, 99);
+    const uint8_t expected[13] = {0x01, 0x02, 0, 0, 0, 0, 0, 0x80, 0x01, 0, 0, 0, 0x08};
+    ASSERT_EQ(0, memcmp(expected, bitmap_export(bitmap), sizeof(expected)));
+
+    bitmap_t *imported = bitmap_import(100, expected);
+    ASSERT_NE(nullptr, imported);
+    for (size_t i = 0; i < 100; i++) ASSERT_EQ(bitmap_test(bitmap, i), bitmap_test(imported, i)) << i;
+    bitmap_destroy(imported);
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_storage, unaligned_overlay) {
+    // 13 bytes at an odd address: one whole word and five tail bytes, nothing past them touched
+    uint8_t buffer[32];
+    memset(buffer, 0xAA, sizeof(buffer));
+    uint8_t *const data = buffer + 1;
+    memset(data, 0, 13);
+    bitmap_t *bitmap = bitmap_overlay(100, data);
+    ASSERT_NE(nullptr, bitmap);
+    ASSERT_FALSE(bitmap_set_concurrent(bitmap, true));
+    bitmap_set(bitmap, 3);
+    bitmap_set(bitmap, 70);
+    bitmap_set(bitmap, 99);
+    ASSERT_EQ(3, bitmap_total_set(bitmap));
+    ASSERT_EQ(0, bitmap_ffz(bitmap));
+    ASSERT_EQ(3, bitmap_ffs(bitmap));
+    ASSERT_EQ(0x08, data[0]);
+    ASSERT_EQ(0x40, data[8]);
+    ASSERT_EQ(0x08, data[12]);
+    bitmap_invert(bitmap);
+    bitmap_reset_range(bitmap, 0, 100);
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+    ASSERT_EQ(0xAA, buffer[0]);
+    for (size_t i = 14; i < sizeof(buffer); i++) ASSERT_EQ(0xAA, buffer[i]) << i;
+    bitmap_destroy(bitmap);
+}
+
+TEST(bitmap_storage, inline_and_arena) {
+    // Header and data in memory of ours, which gets set up from scratch and left alone after
+    ASSERT_EQ(bitmap_footprint(64), bitmap_footprint(1));
+    ASSERT_EQ(bitmap_footprint(64) + 8, bitmap_footprint(65));
+    ASSERT_EQ(SIZE_MAX, bitmap_footprint(SIZE_MAX));
+    std::vector<uint64_t> memory(bitmap_footprint(200) / 8 + 1, UINT64_MAX);
+    ASSERT_EQ(nullptr, bitmap_create_inline(NULL, 200));
+    ASSERT_EQ(nullptr, bitmap_create_inline((uint8_t *) memory.data() + 1, 200));
+    ASSERT_EQ(nullptr, bitmap_create_inline(memory.data(), 0));
+    bitmap_t *bitmap = bitmap_create_inline(memory.data(), 200);
+    ASSERT_EQ((void *) memory.data(), (void *) bitmap);
+    ASSERT_EQ(0, bitmap_total_set(bitmap));
+    ASSERT_TRUE(bitmap_set_concurrent(bitmap, true));
+    bitmap_set_range(bitmap, 10, 150);
+    ASSERT_EQ(150, bitmap_total_set(bitmap));
+    ASSERT_EQ(UINT64_MAX, memory.back());
+    bitmap_destroy(bitmap);
+
+    // An arena hands out zeroed bitmaps until reset, bigger ones than its chunks too
+    ASSERT_EQ(nullptr, bitmap_arena_create(0));
+    ASSERT_EQ(nullptr, bitmap_create_in(NULL, 8));
+    bitmap_arena_t *arena = bitmap_arena_create(2 * bitmap_footprint(100));
+    ASSERT_NE(nullptr, arena);
+    ASSERT_EQ(nullptr, bitmap_create_in(arena, 0));
+    for (int round = 0; round < 3; round++) {
+        std::vector<bitmap_t *> maps;
+        for (size_t bits = 1; bits < 1000; bits += 97) {
+            bitmap_t *map = bitmap_create_in(arena, bits);
+            ASSERT_NE(nullptr, map);
+            ASSERT_EQ(bits, bitmap_get_bits(map));
+            ASSERT_EQ(0, bitmap_total_set(map)) << bits;
+            bitmap_set_range(map, 0, bits);
+            maps.push_back(map);
+        }
+        for (size_t i = 0; i < maps.size(); i++) ASSERT_EQ(1 + 97 * i, bitmap_total_set(maps[i])) << i;
+        bitmap_destroy(maps[0]);
+        bitmap_arena_reset(arena);
+    }
+    bitmap_t *big = bitmap_create_in(arena, 1 << 20);
+    ASSERT_NE(nullptr, big);
+    ASSERT_EQ(nullptr, bitmap_create_in(arena, SIZE_MAX));
+    bitmap_arena_destroy(arena);
+    bitmap_arena_destroy(NULL);
+}
+
+TEST(block_store_readv, runs_and_scatter) {
+    block_store_t *bs = block_store_create_ex(64, 512);
+    ASSERT_NE(nullptr, bs);
+    // Ids 4, 5, 6 from one contiguous buffer (a run), then 9 and 2 from their own
+    std::vector<uint8_t> contiguous(3 * 64), single9(64, '9'), single2(64, '2');
+    for (size_t i = 0; i < contiguous.size(); i++) contiguous[i] = (uint8_t) (i / 64 + 'a');
+    const size_t ids[] = {4, 5, 6, 9, 2};
+    struct iovec iov[] = {{contiguous.data(), 64},       {contiguous.data() + 64, 64}, {contiguous.data() + 128, 64},
+                          {single9.data(), 64},          {single2.data(), 100}};
+    ASSERT_EQ(5 * 64, block_store_writev(bs, ids, 5, iov));
+
+    uint8_t buffer[64];
+    ASSERT_EQ(64, block_store_read(bs, 5, buffer));
+    ASSERT_EQ('b', buffer[63]);
+    ASSERT_EQ(64, block_store_read(bs, 2, buffer));
+    ASSERT_EQ('2', buffer[0]);
+
+    // Read them back in a different order and layout
+    std::vector<uint8_t> out(5 * 64, 0);
+    const size_t order[] = {2, 4, 5, 6, 9};
+    struct iovec back[5];
+    for (size_t i = 0; i < 5; i++) back[i] = {out.data() + i * 64, 64};
+    ASSERT_EQ(5 * 64, block_store_readv(bs, order, 5, back));
+    ASSERT_EQ('2', out[0]);
+    ASSERT_EQ('a', out[64]);
+    ASSERT_EQ('b', out[128]);
+    ASSERT_EQ('c', out[255]);
+    ASSERT_EQ('9', out[256]);
+
+    // All or nothing
+    const size_t bad_ids[] = {1, block_store_get_total_blocks_ex(bs)};
+    ASSERT_EQ(0, block_store_readv(bs, bad_ids, 2, back));
+    const size_t ok_ids[] = {1, 3};
+    struct iovec short_iov[] = {{out.data(), 64}, {out.data() + 64, 63}};
+    ASSERT_EQ(0, block_store_writev(bs, ok_ids, 2, short_iov));
+    ASSERT_EQ(0, block_store_readv(bs, ok_ids, 0, back));
+    ASSERT_EQ(0, block_store_readv(NULL, ok_ids, 2, back));
+    ASSERT_EQ(0, block_store_writev(bs, NULL, 2, back));
+    block_store_destroy(bs);
+}
+
+// Bit at a time, to check the real thing against
+static uint32_t reference_crc32c(const uint8_t *data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    }
+    return ~crc;
+}
+
+TEST(block_store_checksums, crc32c_values) {
+    block_store_t *bs = block_store_create_ex(32, 64);
+    ASSERT_NE(nullptr, bs);
+    uint32_t checksum;
+    ASSERT_FALSE(block_store_get_checksum(bs, 0, &checksum)) << "off by default";
+    ASSERT_FALSE(block_store_set_checksums(NULL, true));
+    uint8_t block[32] = {0};
+    ASSERT_EQ(32, block_store_write(bs, 0, block));
+    memset(block, 0xFF, sizeof(block));
+    ASSERT_EQ(32, block_store_write(bs, 1, block));
+    for (int i = 0; i < 32; i++) block[i] = (uint8_t) i;
+    ASSERT_EQ(32, block_store_write(bs, 2, block));
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    ASSERT_FALSE(block_store_get_checksum(bs, 0, NULL));
+    ASSERT_FALSE(block_store_get_checksum(bs, 63, &checksum));
+    // The iSCSI test vectors
+    ASSERT_TRUE(block_store_get_checksum(bs, 0, &checksum));
+    ASSERT_EQ(0x8A9136AA, checksum);
+    ASSERT_TRUE(block_store_get_checksum(bs, 1, &checksum));
+    ASSERT_EQ(0x62A8AB43, checksum);
+    ASSERT_TRUE(block_store_get_checksum(bs, 2, &checksum));
+    ASSERT_EQ(0x46DD794E, checksum);
+    block_store_destroy(bs);
+
+    // Big enough blocks for the interleaved loop, with its tail
+    for (size_t block_size : {1024, 4096, 8192}) {
+        bs = block_store_create_ex(block_size, 16);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_TRUE(block_store_set_checksums(bs, true));
+        std::vector<uint8_t> data(block_size);
+        for (size_t i = 0; i < block_size; i++) data[i] = (uint8_t) (i * 131 + (i >> 8));
+        ASSERT_EQ(block_size, block_store_write(bs, 3, data.data()));
+        ASSERT_TRUE(block_store_get_checksum(bs, 3, &checksum));
+        ASSERT_EQ(reference_crc32c(data.data(), block_size), checksum) << block_size;
+        ASSERT_EQ(1, block_store_pwrite(bs, 3, 5, 1, "!"));
+        data[5] = '!';
+        ASSERT_TRUE(block_store_get_checksum(bs, 3, &checksum));
+        ASSERT_EQ(reference_crc32c(data.data(), block_size), checksum) << block_size;
+        block_store_destroy(bs);
+    }
+}
+
+TEST(block_store_checksums, catches_damage) {
+    block_store_t *bs = block_store_create_ex(256, 128);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    uint8_t buffer[256], out[256];
+    memset(buffer, 'a', sizeof(buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 4, buffer));
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+
+    // Writing through the pointer is fine, the checksum catches up on unpin
+    uint8_t *block = (uint8_t *) block_store_mut(bs, 8);
+    ASSERT_NE(nullptr, block);
+    block[0] = 'm';
+    block_store_unpin(bs, 8);
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 8, out));
+
+    // Anything else that changes a block behind our back shows up
+    block = (uint8_t *) block_store_mut(bs, 4);
+    block_store_unpin(bs, 4);
+    block[10] ^= 1;
+    block = (uint8_t *) block_store_mut(bs, 9);
+    block_store_unpin(bs, 9);
+    block[0] ^= 0x80;
+    ASSERT_EQ(0, block_store_read(bs, 4, out));
+    ASSERT_EQ(0, block_store_pread(bs, 4, 100, 1, out));
+    ASSERT_EQ(0, block_store_pwrite(bs, 4, 100, 1, out));
+    ASSERT_EQ(nullptr, block_store_view(bs, 4));
+    size_t ids[2] = {3, 4};
+    uint8_t two[512];
+    struct iovec iov[2] = {{two, 256}, {two + 256, 256}};
+    ASSERT_EQ(0, block_store_readv(bs, ids, 2, iov));
+    size_t bad[1];
+    ASSERT_EQ(2, block_store_scrub(bs, bad, 1));
+    ASSERT_EQ(4, bad[0]);
+
+    // A whole block write puts it right, and turning them off stops all checking
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 4, buffer));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 4, out));
+    ASSERT_EQ(1, block_store_scrub(bs, NULL, 0));
+    ASSERT_TRUE(block_store_set_checksums(bs, false));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 9, out));
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_cold_tier, compacts_idle_blocks) {
+    block_store_t *bs = block_store_create_ex(4096, 64);
+    ASSERT_NE(nullptr, bs);
+    block_store_cold_stats_t stats;
+    ASSERT_FALSE(block_store_get_cold_stats(bs, &stats));
+    ASSERT_EQ(0, block_store_compact_cold(bs));
+    std::vector<uint8_t> buffer(4096), out(4096);
+    for (size_t i = 0; i < 63; i++) {
+        memset(buffer.data(), (int) i, 100);  // The rest stays zero, so it compresses well
+        ASSERT_EQ(4096, block_store_write(bs, i, buffer.data()));
+    }
+    // Random data doesn't compress
+    srand(7);
+    for (auto &byte : buffer) byte = (uint8_t) rand();
+    ASSERT_EQ(4096, block_store_write(bs, 62, buffer.data()));
+    ASSERT_TRUE(block_store_set_cold_tier(bs, true));
+    ASSERT_TRUE(block_store_set_cold_tier(bs, true));
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+
+    // Everything counts as used for the first round
+    ASSERT_EQ(0, block_store_compact_cold(bs));
+    ASSERT_EQ(4096, block_store_read(bs, 1, out.data()));
+    ASSERT_EQ(1, block_store_pread(bs, 2, 0, 1, out.data()));
+    ASSERT_EQ(60, block_store_compact_cold(bs));
+    ASSERT_TRUE(block_store_get_cold_stats(bs, &stats));
+    ASSERT_EQ(60, stats.blocks);
+    ASSERT_LT(stats.bytes, 60 * 200);
+    ASSERT_EQ(2, block_store_compact_cold(bs)) << "1 and 2 weren't used this round";
+    ASSERT_EQ(0, block_store_compact_cold(bs));
+
+    // Cold blocks come back on use, and everything that reads the whole device sees them
+    ASSERT_EQ(4096, block_store_read(bs, 40, out.data()));
+    ASSERT_EQ(40, out[99]);
+    ASSERT_EQ(0, out[100]);
+    ASSERT_EQ(4096, block_store_read(bs, 62, out.data()));
+    ASSERT_EQ(0, memcmp(buffer.data(), out.data(), 4096));
+    memset(buffer.data(), 'w', 4096);
+    ASSERT_EQ(4096, block_store_write(bs, 41, buffer.data()));
+    ASSERT_EQ(1, block_store_pwrite(bs, 42, 5, 1, "p"));
+    ASSERT_TRUE(block_store_get_cold_stats(bs, &stats));
+    ASSERT_EQ(59, stats.blocks);
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+
+    // Not while a pointer is out
+    const void *view = block_store_view(bs, 43);
+    ASSERT_NE(nullptr, view);
+    ASSERT_EQ(0, block_store_compact_cold(bs));
+    block_store_unpin(bs, 43);
+    ASSERT_EQ(0, block_store_compact_cold(bs)) << "the warm ones were all used this round";
+    ASSERT_EQ(4, block_store_compact_cold(bs));
+
+    ASSERT_TRUE(block_store_set_checksums(bs, false));
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    ASSERT_TRUE(block_store_set_cold_tier(bs, false));
+    ASSERT_FALSE(block_store_get_cold_stats(bs, &stats));
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+    for (size_t i = 0; i < 62; i++) {
+        ASSERT_EQ(4096, block_store_read(bs, i, out.data()));
+        ASSERT_EQ(i == 41 ? 'w' : (uint8_t) i, out[0]) << i;
+        ASSERT_EQ(i == 41 ? 'w' : 0, out[4095]) << i;
+    }
+    ASSERT_EQ('p', (block_store_read(bs, 42, out.data()), out[5]));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_snapshot, copy_on_write) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+    std::vector<uint8_t> buffer(256), out(256);
+    for (size_t i = 0; i < block_store_get_total_blocks(); i++) {
+        memset(buffer.data(), (int) i, 256);
+        ASSERT_EQ(256, block_store_write(bs, i, buffer.data()));
+    }
+    for (size_t i = 0; i < 10; i++) {
+        ASSERT_TRUE(block_store_request(bs, i));
+    }
+    block_store_t *other = block_store_create();
+    ASSERT_EQ(SIZE_MAX, block_store_diff(bs, other, NULL, 0)) << "never snapshotted";
+
+    block_store_t *first = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, first);
+    ASSERT_EQ(nullptr, block_store_snapshot(first));
+    ASSERT_EQ(nullptr, block_store_view(first, 0));
+    ASSERT_FALSE(block_store_set_cold_tier(bs, true));
+    ASSERT_EQ(10, block_store_get_used_blocks(first));
+    ASSERT_EQ(0, block_store_diff(bs, first, NULL, 0));
+    ASSERT_EQ(SIZE_MAX, block_store_diff(first, other, NULL, 0));
+
+    // The device's writes and releases don't reach the snapshot
+    memset(buffer.data(), 'x', 256);
+    ASSERT_EQ(256, block_store_write(bs, 3, buffer.data()));
+    ASSERT_EQ(1, block_store_pwrite(bs, 4, 7, 1, "y"));
+    block_store_release(bs, 5);
+    ASSERT_EQ(256, block_store_read(first, 3, out.data()));
+    ASSERT_EQ(3, out[0]);
+    ASSERT_EQ(1, block_store_pread(first, 4, 7, 1, out.data()));
+    ASSERT_EQ(4, out[0]);
+    ASSERT_EQ(256, block_store_read(bs, 3, out.data()));
+    ASSERT_EQ('x', out[0]);
+    ASSERT_EQ(9, block_store_get_used_blocks(bs));
+    ASSERT_EQ(10, block_store_get_used_blocks(first));
+    size_t ids[8];
+    ASSERT_EQ(3, block_store_diff(bs, first, ids, 8));
+    ASSERT_EQ(3, ids[0]);
+    ASSERT_EQ(4, ids[1]);
+    ASSERT_EQ(5, ids[2]);
+    ASSERT_EQ(3, block_store_diff(first, bs, ids, 1));
+    ASSERT_EQ(3, ids[0]);
+
+    // A block written after both were taken is the same in both
+    block_store_t *second = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, second);
+    ASSERT_EQ(0, block_store_diff(bs, second, NULL, 0));
+    ASSERT_EQ(3, block_store_diff(first, second, NULL, 0));
+    ASSERT_EQ(1, block_store_pwrite(bs, 6, 0, 1, "z"));
+    ASSERT_EQ(3, block_store_diff(first, second, NULL, 0));
+    ASSERT_EQ(1, block_store_diff(bs, second, ids, 8));
+    ASSERT_EQ(6, ids[0]);
+
+    // A snapshot's own writes only change the snapshot
+    ASSERT_EQ(256, block_store_write(second, 6, buffer.data()));
+    ASSERT_EQ(1, block_store_pwrite(second, 7, 0, 1, "s"));
+    ASSERT_EQ(5, block_store_allocate(second)) << "released before it was taken";
+    ASSERT_EQ(256, block_store_read(first, 6, out.data()));
+    ASSERT_EQ(6, out[0]);
+    ASSERT_EQ(256, block_store_read(bs, 7, out.data()));
+    ASSERT_EQ(7, out[0]);
+    ASSERT_EQ(256, block_store_read(second, 7, out.data()));
+    ASSERT_EQ('s', out[0]);
+    ASSERT_EQ(7, out[1]);
+    ASSERT_EQ(4, block_store_diff(first, second, ids, 8)) << "5 is in use in both again";
+    ASSERT_EQ(6, ids[2]);
+    ASSERT_EQ(7, ids[3]);
+
+    // Either side can go first, the blocks stay with whoever still has them
+    block_store_destroy(bs);
+    std::vector<struct iovec> iov(3);
+    std::vector<uint8_t> many(3 * 256);
+    const size_t vector_ids[3] = {2, 3, 4};
+    for (size_t i = 0; i < 3; i++) iov[i] = {many.data() + i * 256, 256};
+    ASSERT_EQ(3 * 256, block_store_readv(first, vector_ids, 3, iov.data()));
+    ASSERT_EQ(2, many[0]);
+    ASSERT_EQ(3, many[256]);
+    ASSERT_EQ(4, many[512 + 7]);
+    block_store_destroy(first);
+    ASSERT_EQ(256, block_store_read(second, 3, out.data()));
+    ASSERT_EQ('x', out[0]);
+    ASSERT_EQ(256, block_store_read(second, 200, out.data()));
+    ASSERT_EQ(200, out[0]);
+    block_store_destroy(second);
+    block_store_destroy(other);
+}
+
+TEST(block_store_stats, counts_and_histograms) {
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    block_store_stats_t stats;
+    ASSERT_FALSE(block_store_get_stats(bs, &stats)) << "off by default";
+    ASSERT_FALSE(block_store_set_stats(NULL, true));
+    ASSERT_TRUE(block_store_set_stats(bs, true));
+    ASSERT_FALSE(block_store_get_stats(bs, NULL));
+
+    // Bad parameters don't count, failures do
+    std::vector<uint8_t> buffer(256, 'a');
+    ASSERT_EQ(0, block_store_read(bs, SIZE_MAX, buffer.data()));
+    const size_t first = block_store_allocate(bs);
+    ASSERT_EQ(0, first);
+    ASSERT_EQ(256, block_store_write(bs, first, buffer.data()));
+    ASSERT_EQ(256, block_store_read(bs, first, buffer.data()));
+    ASSERT_EQ(16, block_store_pread(bs, first, 8, 16, buffer.data()));
+    block_store_release(bs, first);
+    size_t ids[300];
+    const size_t user_blocks = block_store_get_total_blocks();
+    ASSERT_EQ(user_blocks, block_store_allocate_n(bs, 300, ids)) << "more than there are";
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_get_stats(bs, &stats));
+    ASSERT_EQ(3, stats.calls[BS_STAT_ALLOCATE]);
+    ASSERT_EQ(2, stats.failures[BS_STAT_ALLOCATE]);
+    ASSERT_EQ(1, stats.calls[BS_STAT_RELEASE]);
+    ASSERT_EQ(2, stats.calls[BS_STAT_READ]);
+    ASSERT_EQ(0, stats.failures[BS_STAT_READ]);
+    ASSERT_EQ(256 + 16, stats.bytes_read);
+    ASSERT_EQ(1, stats.calls[BS_STAT_WRITE]);
+    ASSERT_EQ(256, stats.bytes_written);
+    ASSERT_EQ(0, stats.calls[BS_STAT_SERIALIZE]);
+    // One word for the first block, every word of the map for the rest and again for finding none
+    ASSERT_EQ(1 + 2 * 4, stats.ffz_words);
+
+    // The histogram holds every call, and its percentiles stay between the extremes
+    const block_store_latency_t &latency = stats.latency[BS_STAT_ALLOCATE];
+    size_t counted = 0;
+    for (size_t bucket = 0; bucket < BS_LATENCY_BUCKETS; bucket++) counted += latency.buckets[bucket];
+    ASSERT_EQ(3, counted);
+    ASSERT_LE(latency.min_ns, latency.max_ns);
+    ASSERT_GE(latency.total_ns, latency.max_ns);
+    for (double percentile : {0.0, 50.0, 99.9}) {
+        ASSERT_LE(latency.min_ns, block_store_latency_percentile(&latency, percentile));
+        ASSERT_GE(latency.max_ns, block_store_latency_percentile(&latency, percentile));
+    }
+    ASSERT_EQ(latency.max_ns, block_store_latency_percentile(&latency, 100));
+    ASSERT_EQ(0, block_store_latency_percentile(&latency, 101));
+    ASSERT_EQ(0, block_store_latency_percentile(&stats.latency[BS_STAT_SERIALIZE], 50));
+    ASSERT_EQ(0, stats.latency[BS_STAT_SERIALIZE].min_ns);
+
+    // Percentiles come from the bucket edges: 7ns is exact, 100ns lands in [96, 104)
+    block_store_latency_t made = {};
+    made.min_ns                   = 7;
+    made.max_ns                   = 1000;
+    made.buckets[7]               = 1;
+    made.buckets[(8 + 4) + 8 * 3] = 1;  // 96 = (8 + 4) << 3
+    ASSERT_EQ(7, block_store_latency_percentile(&made, 50));
+    ASSERT_EQ(103, block_store_latency_percentile(&made, 51));
+
+    // Threads count separately, nothing gets lost adding them up
+    ASSERT_TRUE(block_store_set_stats(bs, true));
+    ASSERT_TRUE(block_store_set_concurrent(bs, true));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([bs, t]() {
+            std::vector<uint8_t> data(256, (uint8_t) t);
+            for (size_t i = 0; i < 100; i++) block_store_write(bs, (size_t) t, data.data());
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    ASSERT_TRUE(block_store_get_stats(bs, &stats));
+    ASSERT_EQ(0, stats.calls[BS_STAT_ALLOCATE]) << "turning it on again starts over";
+    ASSERT_EQ(400, stats.calls[BS_STAT_WRITE]);
+    ASSERT_EQ(400 * 256, stats.bytes_written);
+    ASSERT_TRUE(block_store_set_stats(bs, false));
+    ASSERT_FALSE(block_store_get_stats(bs, &stats));
+    block_store_destroy(bs);
+}
+
 #if GRAD_TESTS
 
 TEST(block_store_serialize, valid_serialize) {
@@ -357,7 +1684,8 @@ TEST(block_store_serialize, valid_serialize) {
     // Try to call serialize...
     size_t bytesSerialized;
     bytesSerialized = block_store_serialize(bs, "test.bs");
-    ASSERT_EQ(bytesSerialized, BLOCK_SIZE_BYTES);
+    // The whole device plus the image header
+    ASSERT_GE(bytesSerialized, BLOCK_STORE_NUM_BYTES);
 
     free(write_buffer);
     block_store_destroy(bs);
@@ -437,4 +1765,855 @@ TEST(block_store_deserialize, null_filename) {
     score += 2;
 }
 
+
+TEST(block_store_deserialize, round_trip_geometry) {
+    // 5000 bits of fbm takes up two 512 byte blocks
+    block_store_t *bs = block_store_create_ex(512, 5000);
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[512];
+    for (size_t i = 0; i < 4998; i += 7) {
+        ASSERT_TRUE(block_store_request(bs, i));
+        memset(buffer, (int) (i & 0xFF), sizeof(buffer));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+    }
+    const size_t used = block_store_get_used_blocks(bs);
+    ASSERT_NE(0, block_store_serialize(bs, "test_geometry.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_geometry.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(512, block_store_get_block_size(bs));
+    ASSERT_EQ(4998, block_store_get_total_blocks_ex(bs));
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    for (size_t i = 0; i < 4998; i++) {
+        ASSERT_EQ(i % 7 != 0, block_store_request(bs, i)) << "block " << i;
+    }
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 4991, buffer));
+    ASSERT_EQ((uint8_t) (4991 & 0xFF), buffer[511]);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_deserialize, bad_files) {
+    ASSERT_EQ(nullptr, block_store_deserialize("does_not_exist.bs"));
+
+    // Not an image at all
+    FILE *file = fopen("test_garbage.bs", "wb");
+    ASSERT_NE(nullptr, file);
+    fputs("definitely not a block store", file);
+    fclose(file);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_garbage.bs"));
+
+    // A real image, cut short
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    const size_t size = block_store_serialize(bs, "test_truncated.bs");
+    ASSERT_NE(0, size);
+    block_store_destroy(bs);
+    ASSERT_EQ(0, truncate("test_truncated.bs", size - 1));
+    ASSERT_EQ(nullptr, block_store_deserialize("test_truncated.bs"));
+}
+
+
+TEST(block_store_open_mmap, in_place) {
+    block_store_t *bs = block_store_create_ex(1024, 3000);
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[1024];
+    memset(buffer, 'a', sizeof(buffer));
+    ASSERT_TRUE(block_store_request(bs, 17));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 17, buffer));
+    ASSERT_NE(0, block_store_serialize(bs, "test_mmap.bs"));
+    ASSERT_FALSE(block_store_sync(bs)) << "heap devices have nothing to sync to";
+    block_store_destroy(bs);
+
+    ASSERT_EQ(nullptr, block_store_open_mmap(NULL));
+    ASSERT_EQ(nullptr, block_store_open_mmap("does_not_exist.bs"));
+    ASSERT_FALSE(block_store_sync(NULL));
+
+    bs = block_store_open_mmap("test_mmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2999, block_store_get_total_blocks_ex(bs));
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 17));
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 17, buffer));
+    ASSERT_EQ('a', buffer[1023]);
+
+    // Changes land in the file itself
+    ASSERT_EQ(0, block_store_allocate(bs));
+    memset(buffer, 'b', sizeof(buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 0, buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 2998, buffer));
+    ASSERT_TRUE(block_store_sync(bs));
+    ASSERT_TRUE(block_store_sync(bs));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_mmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 2998, buffer));
+    ASSERT_EQ('b', buffer[0]);
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 17, buffer));
+    ASSERT_EQ('a', buffer[0]);
+    block_store_destroy(bs);
+}
+
+
+static off_t file_size(const char *path) {
+    struct stat info;
+    return stat(path, &info) == 0 ? info.st_size : -1;
+}
+
+TEST(block_store_journal, replays_on_deserialize) {
+    ASSERT_FALSE(block_store_journal_open(NULL, "test_journal.bs", 0));
+    ASSERT_FALSE(block_store_journal_commit(NULL));
+    ASSERT_FALSE(block_store_journal_checkpoint(NULL));
+    ASSERT_FALSE(block_store_journal_close(NULL));
+
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_journal_commit(bs)) << "no journal yet";
+    ASSERT_TRUE(block_store_request(bs, 5));
+    ASSERT_TRUE(block_store_journal_open(bs, "test_journal.bs", 0));
+    ASSERT_FALSE(block_store_journal_open(bs, "test_journal.bs", 0)) << "already journaled";
+    ASSERT_EQ(0, file_size("test_journal.bs.journal"));
+
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 'j', sizeof(buffer));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, buffer));
+    ASSERT_EQ(7, block_store_pwrite(bs, 5, 100, 7, "journal"));
+    const size_t extent = block_store_allocate_extent(bs, 10);
+    ASSERT_NE(SIZE_MAX, extent);
+    block_store_release_extent(bs, extent + 2, 3);
+    block_store_release(bs, 5);
+    ASSERT_EQ(0, file_size("test_journal.bs.journal")) << "nothing is written before a commit";
+    ASSERT_TRUE(block_store_journal_commit(bs));
+    ASSERT_TRUE(block_store_journal_commit(bs));
+    ASSERT_LT(0, file_size("test_journal.bs.journal"));
+    // Closing doesn't checkpoint, so the image alone is out of date and the journal has to fill in
+    block_store_destroy(bs);
+
+    // A torn record at the end is ignored
+    FILE *file = fopen("test_journal.bs.journal", "ab");
+    ASSERT_NE(nullptr, file);
+    fputs("torn", file);
+    fclose(file);
+
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(8, block_store_get_used_blocks(bs));
+    ASSERT_FALSE(block_store_request(bs, 0));
+    ASSERT_TRUE(block_store_request(bs, 5));
+    ASSERT_TRUE(block_store_request(bs, extent + 2));
+    ASSERT_FALSE(block_store_request(bs, extent + 5));
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 0, buffer));
+    ASSERT_EQ('j', buffer[0]);
+    ASSERT_EQ('j', buffer[BLOCK_SIZE_BYTES - 1]);
+    char text[8] = {0};
+    ASSERT_EQ(7, block_store_pread(bs, 5, 100, 7, text));
+    ASSERT_STREQ("journal", text);
+
+    // Checkpointing folds the journal into the image
+    ASSERT_TRUE(block_store_journal_open(bs, "test_journal.bs", 0));
+    ASSERT_TRUE(block_store_request(bs, 50));
+    ASSERT_TRUE(block_store_journal_commit(bs));
+    ASSERT_LT(0, file_size("test_journal.bs.journal"));
+    ASSERT_TRUE(block_store_journal_checkpoint(bs));
+    ASSERT_EQ(0, file_size("test_journal.bs.journal"));
+    ASSERT_TRUE(block_store_journal_close(bs));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_request(bs, 50));
+    ASSERT_EQ(11, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_journal, group_commit_and_background_checkpoint) {
+    block_store_t *bs = block_store_create_ex(512, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_concurrent(bs, true));
+    // Checkpoint as soon as the journal has anything in it
+    ASSERT_TRUE(block_store_journal_open(bs, "test_journal_group.bs", 1));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([bs, t]() {
+            uint8_t data[512];
+            memset(data, 'A' + t, sizeof(data));
+            for (int i = 0; i < 50; i++) {
+                const size_t id = block_store_allocate(bs);
+                ASSERT_NE(SIZE_MAX, id);
+                ASSERT_EQ(sizeof(data), block_store_write(bs, id, data));
+                ASSERT_TRUE(block_store_journal_commit(bs));
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+
+    // The checkpointer gets to it eventually
+    for (int i = 0; i < 500 && file_size("test_journal_group.bs.journal") != 0; i++) usleep(1000);
+    ASSERT_EQ(0, file_size("test_journal_group.bs.journal"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_journal_group.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(200, block_store_get_used_blocks(bs));
+    size_t per_thread[4] = {0};
+    uint8_t data[512];
+    for (size_t id = 0; id < block_store_get_total_blocks_ex(bs); id++) {
+        if (!block_store_request(bs, id)) {
+            ASSERT_EQ(sizeof(data), block_store_read(bs, id, data));
+            ASSERT_GE(data[0], 'A');
+            ASSERT_LE(data[0], 'D');
+            ASSERT_EQ(data[0], data[511]);
+            per_thread[data[0] - 'A']++;
+        }
+    }
+    for (size_t count : per_thread) ASSERT_EQ(50, count);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_journal, checkpoints_while_written) {
+    // A checkpoint cut short leaves its old journal behind, replay picks it up before the new one
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_journal_open(bs, "test_journal_rotate.bs", 0));
+    ASSERT_EQ(0, block_store_allocate(bs));
+    ASSERT_EQ(3, block_store_pwrite(bs, 0, 0, 3, "old"));
+    block_store_destroy(bs);
+    ASSERT_EQ(0, rename("test_journal_rotate.bs.journal", "test_journal_rotate.bs.journal.old"));
+    bs = block_store_deserialize("test_journal_rotate.bs");
+    ASSERT_NE(nullptr, bs);
+    uint8_t out[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(3, block_store_pread(bs, 0, 0, 3, out));
+    ASSERT_EQ(0, memcmp(out, "old", 3));
+    ASSERT_TRUE(block_store_journal_open(bs, "test_journal_rotate.bs", 0));
+    ASSERT_EQ(-1, file_size("test_journal_rotate.bs.journal.old")) << "the first checkpoint clears it out";
+
+    // Writers keep committing while checkpoints go on, whatever they committed is there afterwards
+    ASSERT_TRUE(block_store_set_concurrent(bs, true));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; t++) {
+        threads.emplace_back([bs, t]() {
+            uint8_t data[BLOCK_SIZE_BYTES];
+            for (int i = 0; i < 40; i++) {
+                memset(data, 'a' + i % 26, sizeof(data));
+                ASSERT_EQ(sizeof(data), block_store_write(bs, 1 + (size_t) t, data));
+                ASSERT_TRUE(block_store_journal_commit(bs));
+            }
+        });
+    }
+    for (int i = 0; i < 10; i++) {
+        ASSERT_TRUE(block_store_journal_checkpoint(bs));
+    }
+    for (auto &thread : threads) thread.join();
+    ASSERT_EQ(-1, file_size("test_journal_rotate.bs.journal.old"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_journal_rotate.bs");
+    ASSERT_NE(nullptr, bs);
+    for (size_t id = 1; id <= 3; id++) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, out));
+        ASSERT_EQ('a' + 39 % 26, out[0]) << id;
+        ASSERT_EQ(out[0], out[BLOCK_SIZE_BYTES - 1]);
+    }
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_serialize_incremental, writes_only_dirty_blocks) {
+    ASSERT_EQ(0, block_store_serialize_incremental(NULL, 0));
+    block_store_t *bs = block_store_create_ex(512, 2048);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_serialize_incremental(bs, -1));
+
+    uint8_t buffer[512];
+    memset(buffer, 'x', sizeof(buffer));
+    ASSERT_TRUE(block_store_request(bs, 3));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 3, buffer));
+
+    // An empty file gets the whole image, the same one block_store_serialize writes
+    const size_t image = block_store_serialize(bs, "test_incremental_full.bs");
+    ASSERT_NE(0, image);
+    int fd = open("test_incremental.bs", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(image, block_store_serialize_incremental(bs, fd));
+    ASSERT_EQ((off_t) image, file_size("test_incremental.bs"));
+
+    // Nothing changed, so just the fbm
+    const size_t fbm_only = block_store_serialize_incremental(bs, fd);
+    ASSERT_LT(0, fbm_only);
+    ASSERT_GT(512, fbm_only);
+
+    // Three neighbours and one loner
+    memset(buffer, 'y', sizeof(buffer));
+    for (size_t id : {10, 11, 12, 1000}) {
+        ASSERT_TRUE(block_store_request(bs, id));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, id, buffer));
+    }
+    ASSERT_EQ(4, block_store_pwrite(bs, 3, 508, 4, "tail"));
+    ASSERT_EQ(fbm_only + 5 * 512, block_store_serialize_incremental(bs, fd));
+    ASSERT_EQ(fbm_only, block_store_serialize_incremental(bs, fd));
+    ASSERT_EQ(0, close(fd));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_incremental.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(5, block_store_get_used_blocks(bs));
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 1000, buffer));
+    ASSERT_EQ('y', buffer[0]);
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 3, buffer));
+    ASSERT_EQ('x', buffer[0]);
+    ASSERT_EQ(0, memcmp(buffer + 508, "tail", 4));
+    block_store_destroy(bs);
+}
+
+
+struct async_results {
+    std::vector<std::pair<size_t, size_t>> done;
+    static void callback(size_t block_id, size_t bytes, void *arg) {
+        static_cast<async_results *>(arg)->done.emplace_back(block_id, bytes);
+    }
+};
+
+TEST(block_store_async, heap_device) {
+    async_results results;
+    uint8_t buffer[BLOCK_SIZE_BYTES], out[BLOCK_SIZE_BYTES];
+    ASSERT_FALSE(block_store_read_async(NULL, 0, buffer, async_results::callback, &results));
+    ASSERT_EQ(0, block_store_poll(NULL, true));
+
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_poll(bs, true)) << "nothing queued";
+    ASSERT_FALSE(block_store_read_async(bs, BLOCK_STORE_AVAIL_BLOCKS, buffer, async_results::callback, &results));
+    ASSERT_FALSE(block_store_write_async(bs, 0, NULL, async_results::callback, &results));
+    ASSERT_FALSE(block_store_write_async(bs, 0, buffer, NULL, &results));
+
+    memset(buffer, 'q', sizeof(buffer));
+    ASSERT_TRUE(block_store_write_async(bs, 7, buffer, async_results::callback, &results));
+    ASSERT_TRUE(block_store_read_async(bs, 7, out, async_results::callback, &results));
+    ASSERT_TRUE(results.done.empty()) << "nothing happens before the poll";
+    ASSERT_EQ(2, block_store_poll(bs, true));
+    ASSERT_EQ(2, results.done.size());
+    ASSERT_EQ(std::make_pair((size_t) 7, (size_t) BLOCK_SIZE_BYTES), results.done[0]);
+    ASSERT_EQ(0, memcmp(buffer, out, sizeof(buffer)));
+    ASSERT_EQ(0, block_store_poll(bs, false));
+
+    // The queue has a limit, and freed slots can be used again
+    size_t queued = 0;
+    while (block_store_read_async(bs, 0, out, async_results::callback, &results)) queued++;
+    ASSERT_LT(0, queued);
+    ASSERT_EQ(queued, block_store_poll(bs, false));
+    ASSERT_TRUE(block_store_read_async(bs, 0, out, async_results::callback, &results));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_async, journaled_writes) {
+    // An async write is journaled when the poll does it, so it replays and checkpoints like any other
+    async_results results;
+    uint8_t buffer[BLOCK_SIZE_BYTES], out[BLOCK_SIZE_BYTES];
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    ASSERT_TRUE(block_store_journal_open(bs, "test_journal_async.bs", 0));
+    memset(buffer, 'w', sizeof(buffer));
+    ASSERT_TRUE(block_store_write_async(bs, 9, buffer, async_results::callback, &results));
+    ASSERT_EQ(0, file_size("test_journal_async.bs.journal"));
+    ASSERT_EQ(1, block_store_poll(bs, true));
+    ASSERT_TRUE(block_store_journal_commit(bs));
+    ASSERT_LT(BLOCK_SIZE_BYTES, file_size("test_journal_async.bs.journal"));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 9, out)) << "the checksum went with the data";
+
+    // Its record comes after the one for the write before it
+    memset(buffer, 'x', sizeof(buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 10, buffer));
+    memset(buffer, 'y', sizeof(buffer));
+    ASSERT_TRUE(block_store_write_async(bs, 10, buffer, async_results::callback, &results));
+    ASSERT_EQ(1, block_store_poll(bs, true));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_journal_async.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 9, out));
+    ASSERT_EQ('w', out[0]);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, out));
+    ASSERT_EQ('y', out[BLOCK_SIZE_BYTES - 1]);
+    block_store_destroy(bs);
+}
+
+static void async_file_device(bool use_ring) {
+    block_store_t *bs = block_store_create_ex(4096, 600);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_NE(0, block_store_serialize(bs, "test_async.bs"));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_async.bs");
+    ASSERT_NE(nullptr, bs);
+    if (!use_ring) setenv("BLOCK_STORE_NO_IO_URING", "1", 1);
+
+    const size_t count = 100;
+    std::vector<std::vector<uint8_t>> blocks(count, std::vector<uint8_t>(4096));
+    async_results results;
+    for (size_t i = 0; i < count; i++) {
+        memset(blocks[i].data(), (int) i, 4096);
+        ASSERT_TRUE(block_store_write_async(bs, i * 5, blocks[i].data(), async_results::callback, &results));
+    }
+    while (results.done.size() < count) block_store_poll(bs, true);
+    unsetenv("BLOCK_STORE_NO_IO_URING");
+    for (const auto &done : results.done) ASSERT_EQ(4096, done.second) << done.first;
+
+    // The mapping sees what went to the file
+    uint8_t buffer[4096];
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 99 * 5, buffer));
+    ASSERT_EQ(99, buffer[4095]);
+
+    results.done.clear();
+    for (size_t i = 0; i < count; i++) {
+        memset(blocks[i].data(), 0xFF, 4096);
+        ASSERT_TRUE(block_store_read_async(bs, i * 5, blocks[i].data(), async_results::callback, &results));
+    }
+    while (results.done.size() < count) block_store_poll(bs, true);
+    for (size_t i = 0; i < count; i++) {
+        ASSERT_EQ(i, blocks[i][0]);
+        ASSERT_EQ(i, blocks[i][4095]);
+    }
+
+    // Left in flight, destroy still finishes it
+    memset(buffer, 'z', sizeof(buffer));
+    ASSERT_TRUE(block_store_write_async(bs, 1, buffer, async_results::callback, &results));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_async.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 1, buffer));
+    ASSERT_EQ('z', buffer[0]);
+    ASSERT_EQ(sizeof(buffer), block_store_read(bs, 50, buffer));
+    ASSERT_EQ(10, buffer[0]);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_async, file_device) {
+    async_file_device(true);
+}
+
+TEST(block_store_async, file_device_thread_pool) {
+    async_file_device(false);
+}
+
+TEST(block_store_async, file_device_checksums) {
+    block_store_t *bs = block_store_create_ex(4096, 64);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    ASSERT_NE(0, block_store_serialize(bs, "test_async_crc.bs"));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_async_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    setenv("BLOCK_STORE_NO_IO_URING", "1", 1);
+
+    // Until it's polled the write may or may not be in the block, but either way a read matches the checksum
+    async_results results;
+    uint8_t buffer[4096], out[4096];
+    memset(buffer, 'n', sizeof(buffer));
+    ASSERT_TRUE(block_store_write_async(bs, 3, buffer, async_results::callback, &results));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 3, out));
+    while (results.done.empty()) block_store_poll(bs, true);
+    ASSERT_EQ(4096, results.done[0].second);
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 3, out));
+    ASSERT_EQ('n', out[4095]);
+
+    // A write that fails (past the file size limit) leaves the block and its checksum alone
+    uint8_t before[4096];
+    ASSERT_EQ(sizeof(before), block_store_read(bs, 5, before));
+    struct rlimit limit, low;
+    ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &limit));
+    low          = limit;
+    low.rlim_cur = 4096;
+    void (*const previous)(int) = signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &low));
+    memset(buffer, 'f', sizeof(buffer));
+    results.done.clear();
+    ASSERT_TRUE(block_store_write_async(bs, 5, buffer, async_results::callback, &results));
+    while (results.done.empty()) block_store_poll(bs, true);
+    ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+    signal(SIGXFSZ, previous);
+    unsetenv("BLOCK_STORE_NO_IO_URING");
+    ASSERT_EQ(0, results.done[0].second);
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 5, out));
+    ASSERT_EQ(0, memcmp(before, out, sizeof(out)));
+    ASSERT_TRUE(block_store_sync(bs));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_async_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0)) << "the checksums saved match";
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_open_cached, evicts_and_writes_back) {
+    block_store_t *bs = block_store_create_ex(512, 200);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_request(bs, 3));
+    ASSERT_NE(0, block_store_serialize(bs, "test_cached.bs"));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(nullptr, block_store_open_cached(NULL, 8));
+    ASSERT_EQ(nullptr, block_store_open_cached("test_cached.bs", 0));
+    ASSERT_EQ(nullptr, block_store_open_cached("does_not_exist.bs", 8));
+    bs = block_store_open_cached("test_cached.bs", 8);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(nullptr, block_store_view(bs, 0));
+    ASSERT_EQ(nullptr, block_store_mut(bs, 0));
+    ASSERT_EQ(0, block_store_serialize(bs, "test_cached_copy.bs"));
+    block_store_cache_stats_t stats;
+    ASSERT_FALSE(block_store_get_cache_stats(bs, NULL));
+
+    // Far more blocks than frames, so most of them get evicted (and written back) along the way
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    uint8_t buffer[512], out[512];
+    for (size_t i = 0; i < user_blocks; i++) {
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+    }
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(0, stats.hits);
+    ASSERT_EQ(user_blocks, stats.misses);
+    ASSERT_EQ(user_blocks - 8, stats.evictions);
+    ASSERT_EQ(user_blocks - 8, stats.writebacks);
+
+    // The last few are still cached, the first ones come back from the file
+    ASSERT_EQ(sizeof(out), block_store_read(bs, user_blocks - 1, out));
+    ASSERT_EQ((uint8_t)(user_blocks - 1), out[511]);
+    ASSERT_EQ(4, block_store_pread(bs, 0, 100, 4, out));
+    ASSERT_EQ(0, out[0]);
+    ASSERT_EQ(2, block_store_pwrite(bs, 1, 510, 2, "zz"));
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(1, stats.hits);
+    ASSERT_EQ(user_blocks + 2, stats.misses);
+
+    // A block in use keeps its frame over one that isn't
+    for (size_t round = 0; round < 3; round++) {
+        ASSERT_EQ(sizeof(out), block_store_read(bs, 1, out));
+        for (size_t i = 10 + round * 4; i < 14 + round * 4; i++) {
+            ASSERT_EQ(sizeof(out), block_store_read(bs, i, out));
+        }
+    }
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    const size_t misses = stats.misses;
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 1, out));
+    ASSERT_EQ('z', out[511]);
+    ASSERT_TRUE(block_store_get_cache_stats(bs, &stats));
+    ASSERT_EQ(misses, stats.misses);
+
+    size_t ids[2] = {5, 150};
+    struct iovec iov[2] = {{buffer, sizeof(buffer)}, {out, sizeof(out)}};
+    ASSERT_EQ(2 * sizeof(buffer), block_store_readv(bs, ids, 2, iov));
+    ASSERT_EQ(5, buffer[0]);
+    ASSERT_EQ(150, out[0]);
+
+    size_t block = block_store_allocate(bs);
+    ASSERT_EQ(0, block);
+    ASSERT_TRUE(block_store_sync(bs));
+    block_store_release(bs, 3);
+    block_store_destroy(bs);
+
+    // Everything made it to the image, fbm included
+    bs = block_store_deserialize("test_cached.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1, block_store_get_used_blocks(bs));
+    ASSERT_TRUE(block_store_request(bs, 3));
+    for (size_t i = 0; i < user_blocks; i++) {
+        ASSERT_EQ(sizeof(out), block_store_read(bs, i, out));
+        ASSERT_EQ((uint8_t) i, out[0]) << i;
+    }
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 1, out));
+    ASSERT_EQ('z', out[510]);
+    ASSERT_FALSE(block_store_get_cache_stats(bs, &stats));
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_open_lazy, faults_blocks_in) {
+    block_store_t *bs = block_store_create_ex(512, 300);
+    ASSERT_NE(nullptr, bs);
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    uint8_t buffer[512], out[512];
+    for (size_t i = 0; i < user_blocks; i++) {
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+    }
+    ASSERT_TRUE(block_store_request(bs, 7));
+    ASSERT_TRUE(block_store_request(bs, 200));
+    ASSERT_NE(0, block_store_serialize(bs, "test_lazy.bs"));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(nullptr, block_store_open_lazy(NULL, false));
+    ASSERT_EQ(nullptr, block_store_open_lazy("does_not_exist.bs", false));
+    bs = block_store_open_lazy("test_lazy.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 5, out));
+    ASSERT_EQ(5, out[0]);
+
+    // Nothing else has been read yet, so a change to the image underneath shows up on first use
+    const int fd = open("test_lazy.bs", O_RDWR);
+    ASSERT_LE(0, fd);
+    memset(buffer, 'x', sizeof(buffer));
+    for (size_t block : {5, 10, 11}) {
+        ASSERT_EQ((ssize_t) sizeof(buffer), pwrite(fd, buffer, sizeof(buffer), 4096 + block * 512));
+    }
+    close(fd);
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 10, out));
+    ASSERT_EQ('x', out[0]);
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 5, out));
+    ASSERT_EQ(5, out[0]) << "already loaded";
+    // A whole-block write doesn't need the image, a partial one does
+    memset(buffer, 'w', sizeof(buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 11, buffer));
+    ASSERT_EQ(1, block_store_pwrite(bs, 12, 0, 1, "p"));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 12, out));
+    ASSERT_EQ('p', out[0]);
+    ASSERT_EQ(12, out[1]);
+
+    // Serializing pulls in the rest
+    ASSERT_NE(0, block_store_serialize(bs, "test_lazy_copy.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_lazy_copy.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    for (size_t i = 0; i < user_blocks; i++) {
+        ASSERT_EQ(sizeof(out), block_store_read(bs, i, out));
+        ASSERT_EQ(i == 10 ? 'x' : i == 11 ? 'w' : i == 12 ? 'p' : (uint8_t) i, out[0]) << i;
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store_open_lazy, prefetch) {
+    block_store_t *bs = block_store_create_ex(1024, 2000);
+    ASSERT_NE(nullptr, bs);
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    uint8_t buffer[1024], out[1024];
+    for (size_t i = 0; i < user_blocks; i++) {
+        memset(buffer, (int) (i * 7), sizeof(buffer));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+        if (i % 3 == 0) {
+            ASSERT_TRUE(block_store_request(bs, i));
+        }
+    }
+    ASSERT_NE(0, block_store_serialize(bs, "test_lazy.bs"));
+    block_store_destroy(bs);
+
+    // Reads and writes race the prefetcher, neither loses
+    bs = block_store_open_lazy("test_lazy.bs", true);
+    ASSERT_NE(nullptr, bs);
+    memset(buffer, 0xEE, sizeof(buffer));
+    for (size_t i = user_blocks; i-- > 0;) {
+        if (i % 5 == 0) {
+            ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+        } else {
+            ASSERT_EQ(sizeof(out), block_store_read(bs, i, out));
+            ASSERT_EQ((uint8_t) (i * 7), out[1023]) << i;
+        }
+    }
+    for (size_t i = 0; i < user_blocks; i++) {
+        ASSERT_EQ(sizeof(out), block_store_read(bs, i, out));
+        ASSERT_EQ(i % 5 == 0 ? 0xEE : (uint8_t) (i * 7), out[0]) << i;
+    }
+    block_store_destroy(bs);
+
+    // Destroying it mid-prefetch is fine too
+    bs = block_store_open_lazy("test_lazy.bs", true);
+    ASSERT_NE(nullptr, bs);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_open_lazy, prefetch_stops_at_the_fbm) {
+    // The last user block in use is followed by the fbm's own blocks (always set), the prefetcher's runs can't
+    // go on into them. A compressed image's index ends right after the last user block
+    block_store_t *bs = block_store_create_ex(256, 512);
+    ASSERT_NE(nullptr, bs);
+    const size_t last = block_store_get_total_blocks_ex(bs) - 1;
+    uint8_t buffer[256], out[256];
+    memset(buffer, 'L', sizeof(buffer));
+    ASSERT_TRUE(block_store_request(bs, last - 1));
+    ASSERT_TRUE(block_store_request(bs, last));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, last, buffer));
+    ASSERT_NE(0, block_store_serialize_compressed(bs, "test_lazy_last.bs"));
+    block_store_destroy(bs);
+
+    // Give the prefetcher time to get through the blocks in use before anything else takes the lock
+    bs = block_store_open_lazy("test_lazy_last.bs", true);
+    ASSERT_NE(nullptr, bs);
+    usleep(20000);
+    ASSERT_EQ(sizeof(out), block_store_read(bs, last, out));
+    ASSERT_EQ('L', out[255]);
+    ASSERT_EQ(2, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_checksums, kept_with_the_image) {
+    block_store_t *bs = block_store_create_ex(512, 64);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    uint8_t buffer[512], out[512];
+    for (size_t i = 0; i < 20; i++) {
+        memset(buffer, (int) i, sizeof(buffer));
+        ASSERT_EQ(sizeof(buffer), block_store_write(bs, i, buffer));
+    }
+    ASSERT_NE(0, block_store_serialize(bs, "test_crc.bs"));
+    block_store_destroy(bs);
+    struct stat info;
+    ASSERT_EQ(0, stat("test_crc.bs.crc", &info));
+
+    // Damage a block in the image, every way of loading it notices
+    int fd = open("test_crc.bs", O_RDWR);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(1, pwrite(fd, "X", 1, 4096 + 7 * 512 + 3));
+    close(fd);
+    bs = block_store_deserialize("test_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_read(bs, 7, out));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 6, out));
+    size_t bad[4];
+    ASSERT_EQ(1, block_store_scrub(bs, bad, 4));
+    ASSERT_EQ(7, bad[0]);
+    block_store_destroy(bs);
+
+    bs = block_store_open_lazy("test_crc.bs", false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_read(bs, 7, out));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 8, out));
+    block_store_destroy(bs);
+
+    bs = block_store_open_mmap("test_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_read(bs, 7, out));
+    async_results results;
+    ASSERT_TRUE(block_store_read_async(bs, 7, out, async_results::callback, &results));
+    ASSERT_TRUE(block_store_read_async(bs, 6, buffer, async_results::callback, &results));
+    while (results.done.size() < 2) block_store_poll(bs, true);
+    for (const auto &done : results.done) ASSERT_EQ(done.first == 7 ? 0 : 512, done.second) << done.first;
+    // Fix it in place, the sync writes the new checksum out
+    memset(buffer, 7, sizeof(buffer));
+    ASSERT_EQ(sizeof(buffer), block_store_write(bs, 7, buffer));
+    ASSERT_TRUE(block_store_sync(bs));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_crc.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+    ASSERT_EQ(sizeof(out), block_store_read(bs, 7, out));
+    // Without checksums the stale file goes away
+    ASSERT_TRUE(block_store_set_checksums(bs, false));
+    ASSERT_NE(0, block_store_serialize(bs, "test_crc.bs"));
+    ASSERT_NE(0, stat("test_crc.bs.crc", &info));
+    block_store_destroy(bs);
+}
+
+
+TEST(block_store_serialize_compressed, round_trip) {
+    block_store_t *bs = block_store_create_ex(1024, 512);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_serialize_compressed(NULL, "test_compressed.bs"));
+    ASSERT_EQ(0, block_store_serialize_compressed(bs, NULL));
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    std::vector<uint8_t> buffer(1024, 0), out(1024);
+    for (size_t i = 0; i < user_blocks; i++) {
+        buffer[0]    = (uint8_t) i;
+        buffer[1023] = (uint8_t)(i ^ 0x5A);
+        ASSERT_EQ(1024, block_store_write(bs, i, buffer.data()));
+        if (i % 2) {
+            ASSERT_TRUE(block_store_request(bs, i));
+        }
+    }
+    for (auto &byte : buffer) byte = (uint8_t) rand();
+    ASSERT_EQ(1024, block_store_write(bs, 100, buffer.data()));
+    const size_t plain = block_store_serialize(bs, "test_plain.bs");
+    const size_t compressed = block_store_serialize_compressed(bs, "test_compressed.bs");
+    ASSERT_NE(0, compressed);
+    ASSERT_EQ(compressed, file_size("test_compressed.bs"));
+    ASSERT_LT(compressed * 4, plain);
+    block_store_destroy(bs);
+
+    // Either way of loading it gets the same device back
+    for (int lazy = 0; lazy < 2; lazy++) {
+        bs = lazy ? block_store_open_lazy("test_compressed.bs", false) : block_store_deserialize("test_compressed.bs");
+        ASSERT_NE(nullptr, bs);
+        ASSERT_EQ(user_blocks / 2, block_store_get_used_blocks(bs));
+        ASSERT_EQ(1024, block_store_read(bs, 100, out.data()));
+        ASSERT_EQ(0, memcmp(buffer.data(), out.data(), 1024));
+        for (size_t i = user_blocks; i-- > 0;) {
+            ASSERT_EQ(1024, block_store_read(bs, i, out.data()));
+            if (i != 100) {
+                ASSERT_EQ((uint8_t) i, out[0]) << i;
+                ASSERT_EQ(0, out[500]) << i;
+                ASSERT_EQ((uint8_t)(i ^ 0x5A), out[1023]) << i;
+            }
+        }
+        block_store_destroy(bs);
+    }
+
+    // A compressed image can't be used in place, and a cut short one doesn't load
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_compressed.bs"));
+    ASSERT_EQ(nullptr, block_store_open_cached("test_compressed.bs", 4));
+    ASSERT_EQ(0, truncate("test_compressed.bs", compressed - 1));
+    ASSERT_EQ(nullptr, block_store_deserialize("test_compressed.bs"));
+    ASSERT_EQ(nullptr, block_store_open_lazy("test_compressed.bs", true));
+}
+
+TEST(block_store_snapshot, while_the_device_is_written) {
+    block_store_t *bs = block_store_create_ex(512, 1024);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_checksums(bs, true));
+    const size_t user_blocks = block_store_get_total_blocks_ex(bs);
+    std::vector<uint8_t> buffer(512), out(512);
+    for (size_t i = 0; i < user_blocks; i++) {
+        memset(buffer.data(), (int) i, 512);
+        ASSERT_EQ(512, block_store_write(bs, i, buffer.data()));
+    }
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+
+    // The snapshot keeps what the blocks had, however the device's writes fall
+    std::thread writer([bs, user_blocks]() {
+        std::vector<uint8_t> data(512);
+        for (int round = 1; round <= 4; round++) {
+            memset(data.data(), 0x80 | round, 512);
+            for (size_t i = (size_t) round; i < user_blocks; i += 2) {
+                block_store_write(bs, i, data.data());
+            }
+        }
+    });
+    for (int round = 0; round < 4; round++) {
+        for (size_t i = 0; i < user_blocks; i++) {
+            ASSERT_EQ(512, block_store_read(snapshot, i, out.data()));
+            ASSERT_EQ((uint8_t) i, out[0]) << i;
+            ASSERT_EQ((uint8_t) i, out[511]) << i;
+        }
+    }
+    writer.join();
+    ASSERT_EQ(0, block_store_scrub(snapshot, NULL, 0));
+    ASSERT_EQ(user_blocks - 1, block_store_diff(snapshot, bs, NULL, 0));
+
+    // And that's what goes in its image
+    const size_t image = block_store_serialize(snapshot, "test_snapshot.bs");
+    ASSERT_NE(0, image);
+    ASSERT_EQ(image, file_size("test_snapshot.bs"));
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_snapshot.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(0, block_store_scrub(bs, NULL, 0));
+    for (size_t i = 0; i < user_blocks; i++) {
+        ASSERT_EQ(512, block_store_read(bs, i, out.data()));
+        ASSERT_EQ((uint8_t) i, out[100]) << i;
+    }
+    block_store_destroy(bs);
+}
+
 #endif